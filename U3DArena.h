@@ -0,0 +1,81 @@
+// Export-scoped bump allocator. Memory is never freed piecemeal, everything
+// goes away at once in Release(). Only POD data belongs here, no destructors
+// are called.
+class FArena
+{
+    struct sBlock
+    {
+        sBlock* Next;
+        size_t  Size;
+        size_t  Used;
+    };
+
+    enum { BlockSize = 64*1024, Align = 16 };
+
+    sBlock* Head;
+    size_t  Reserved;
+
+public:
+    FArena() : Head(NULL), Reserved(0)
+    {
+    }
+
+    ~FArena()
+    {
+        Release();
+    }
+
+    void* Alloc( size_t size )
+    {
+        size = (size + Align-1) & ~static_cast<size_t>(Align-1);
+        if( Head == NULL || Head->Size - Head->Used < size )
+        {
+            // Large requests get a block of their own
+            size_t blocksize = max(static_cast<size_t>(BlockSize),size);
+            size_t header = (sizeof(sBlock) + Align-1) & ~static_cast<size_t>(Align-1);
+            sBlock* b = static_cast<sBlock*>(malloc(header+blocksize));
+            if( b == NULL )
+                throw MAXException(_T("Out of memory"));
+
+            b->Size = header+blocksize;
+            b->Used = header;
+            b->Next = Head;
+            Head = b;
+            Reserved += b->Size;
+        }
+
+        void* p = reinterpret_cast<BYTE*>(Head) + Head->Used;
+        Head->Used += size;
+        return p;
+    }
+
+    template<class T> T* New( int count )
+    {
+        return static_cast<T*>(Alloc(sizeof(T)*max(count,1)));
+    }
+
+    TCHAR* Dup( const TCHAR* str, int len )
+    {
+        TCHAR* p = New<TCHAR>(len+1);
+        memcpy(p,str,len*sizeof(TCHAR));
+        p[len] = 0;
+        return p;
+    }
+
+    void Release()
+    {
+        while( Head != NULL )
+        {
+            sBlock* b = Head;
+            Head = Head->Next;
+            free(b);
+        }
+        Reserved = 0;
+    }
+
+    size_t GetReserved() const
+    {
+        return Reserved;
+    }
+};
+
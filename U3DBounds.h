@@ -0,0 +1,343 @@
+/*======================================================================
+
+    Culling volumes of an exported vertex animation
+
+    FBoundsBuilder takes a box and a sphere of every frame while Prepare
+    scans the frames for the precision optimization, and unions them per
+    sequence. Engines and tools can then cull an animated actor with the
+    volume of the frame or sequence it plays instead of one box around
+    the whole animation.
+
+    Volumes are in the exported coordinates, before the precision
+    optimization, where playback with ORIGIN and SCALE puts the verts.
+    Spheres are centered on their box.
+
+    File layout:
+        FBoundsHeader                           Total is the whole animation
+        FBoundsVolume   [NumFrames]
+        per sequence:
+        FBoundsSeq
+        TCHAR           [NameLen]
+
+    The script gets the same volumes as default properties, per frame only
+    up to U3D_BOUNDS_SCRIPTFRAMES frames.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+#include <math.h>
+
+#define U3D_BOUNDS_MAGIC        0x42443355  // "U3DB"
+#define U3D_BOUNDS_VERSION      1
+#define U3D_BOUNDS_SCRIPTFRAMES 256         // longer clips keep per frame volumes in the sidecar only
+
+#pragma pack(push,1)
+struct FBoundsVolume
+{
+    U_FLOAT Min[3];
+    U_FLOAT Max[3];
+    U_FLOAT Center[3];
+    U_FLOAT Radius;
+};
+
+struct FBoundsHeader
+{
+    U_DWORD         Magic;
+    U_DWORD         Version;
+    U_DWORD         NumFrames;
+    U_DWORD         NumSequences;
+    FBoundsVolume   Total;
+};
+
+struct FBoundsSeq
+{
+    U_DWORD         StartFrame;
+    U_DWORD         NumFrames;
+    FBoundsVolume   Volume;
+    U_DWORD         NameLen;
+};
+#pragma pack(pop)
+
+
+class FBoundsBuilder
+{
+    struct sSeq
+    {
+        FString         Name;
+        int             Start;
+        int             NumFrames;
+    };
+
+public:
+    FBoundsVolume               Total;
+    std::vector<FBoundsVolume>  Frames;
+
+private:
+    std::vector<sSeq>           Seqs;
+    int                         Frame;
+
+public:
+    FBoundsBuilder() : Frame(0)
+    {
+        memset(&Total,0,sizeof(Total));
+    }
+
+    void Begin( int framecount )
+    {
+        memset(&Total,0,sizeof(Total));
+        Frames.resize(framecount);
+        Seqs.clear();
+        Frame = 0;
+    }
+
+    // Frames in file order, tm takes the points to the exported coordinates
+    void AddFrame( const float* points, int count, const float* tm )
+    {
+        FBoundsVolume& v = Frames[Frame];
+        memset(&v,0,sizeof(v));
+        if( count > 0 )
+        {
+            // Box and sphere are found where the points are, then moved
+            GetBox(points,count,v.Min,v.Max);
+            float center[3];
+            for( int a=0; a<3; ++a )
+                center[a] = (v.Min[a]+v.Max[a]) * 0.5f;
+            v.Radius = GetRadius(points,count,center) * GetScale(tm);
+            U3DTransformBounds(tm,v.Min,v.Max);
+            for( int a=0; a<3; ++a )
+                v.Center[a] = (v.Min[a]+v.Max[a]) * 0.5f;
+        }
+
+        if( ++Frame == static_cast<int>(Frames.size()) )
+            Total = Union(0,Frame);
+    }
+
+    // Sequence frames index the anim file, like STARTFRAME in the script
+    void AddSequence( const FStrView& name, int start, int numframes )
+    {
+        sSeq seq;
+        seq.Name.assign(name.Str,name.Len);
+        seq.Start = start;
+        seq.NumFrames = numframes;
+        Seqs.push_back(seq);
+    }
+
+    FBoundsVolume GetSequence( int s ) const
+    {
+        int start = Seqs[s].Start < 0 ? 0 : Seqs[s].Start;
+        int end = Seqs[s].Start + Seqs[s].NumFrames;
+        if( end > Frame )
+            end = Frame;
+        return Union(start,end);
+    }
+
+    // Average frame box volume over the volume of the whole animation
+    float GetFrameFill() const
+    {
+        double total = GetVolume(Total);
+        if( Frame == 0 || total <= 0 )
+            return 1;
+
+        double sum = 0;
+        for( int t=0; t<Frame; ++t )
+            sum += GetVolume(Frames[t]);
+        return static_cast<float>(sum / Frame / total);
+    }
+
+    bool Write( FOutFile& f ) const
+    {
+        FBoundsHeader h;
+        h.Magic = U3D_BOUNDS_MAGIC;
+        h.Version = U3D_BOUNDS_VERSION;
+        h.NumFrames = Frame;
+        h.NumSequences = static_cast<U_DWORD>(Seqs.size());
+        h.Total = Total;
+        bool ok = f.Write(&h,sizeof(h))
+               && (Frame == 0 || f.Write(&Frames[0],sizeof(FBoundsVolume)*Frame));
+
+        for( size_t s=0; s<Seqs.size() && ok; ++s )
+        {
+            FBoundsSeq seq;
+            seq.StartFrame = Seqs[s].Start;
+            seq.NumFrames = Seqs[s].NumFrames;
+            seq.Volume = GetSequence(static_cast<int>(s));
+            seq.NameLen = static_cast<U_DWORD>(Seqs[s].Name.size());
+            ok = f.Write(&seq,sizeof(seq))
+              && (seq.NameLen == 0 || f.Write(Seqs[s].Name.c_str(),sizeof(TCHAR)*seq.NameLen));
+        }
+        return ok;
+    }
+
+    // Variables and default properties, goes last in the script. Box and
+    // Plane are the engine's own structs, a sphere is a Plane with W the radius.
+    void WriteScript( FOutFile& f ) const
+    {
+        int seqs = static_cast<int>(Seqs.size());
+        int frames = Frame <= U3D_BOUNDS_SCRIPTFRAMES ? Frame : 0;
+
+        f.Printf( _T("\n// Culling volumes, see U3DBounds.h\n") );
+        f.Printf( _T("var const Box AnimBox;\n") );
+        f.Printf( _T("var const Plane AnimSphere;\n") );
+        if( seqs > 0 )
+        {
+            f.Printf( _T("var const name SeqName[%d];\n"), seqs );
+            f.Printf( _T("var const Box SeqBox[%d];\n"), seqs );
+            f.Printf( _T("var const Plane SeqSphere[%d];\n"), seqs );
+        }
+        if( frames > 0 )
+        {
+            f.Printf( _T("var const Box FrameBox[%d];\n"), frames );
+            f.Printf( _T("var const Plane FrameSphere[%d];\n"), frames );
+        }
+
+        f.Printf( _T("\ndefaultproperties\n{\n") );
+        WriteVolume(f,_T("AnimBox"),_T("AnimSphere"),-1,Total);
+        for( int s=0; s<seqs; ++s )
+        {
+            f.Printf( _T("    SeqName(%d)=%s\n"), s, Seqs[s].Name.c_str() );
+            WriteVolume(f,_T("SeqBox"),_T("SeqSphere"),s,GetSequence(s));
+        }
+        for( int t=0; t<frames; ++t )
+            WriteVolume(f,_T("FrameBox"),_T("FrameSphere"),t,Frames[t]);
+        f.Printf( _T("}\n") );
+    }
+
+private:
+    FBoundsVolume Union( int start, int end ) const
+    {
+        FBoundsVolume v;
+        memset(&v,0,sizeof(v));
+        if( start >= end )
+            return v;
+
+        v = Frames[start];
+        for( int t=start+1; t<end; ++t )
+        {
+            for( int a=0; a<3; ++a )
+            {
+                v.Min[a] = Frames[t].Min[a] < v.Min[a] ? Frames[t].Min[a] : v.Min[a];
+                v.Max[a] = Frames[t].Max[a] > v.Max[a] ? Frames[t].Max[a] : v.Max[a];
+            }
+        }
+
+        // Smaller of the frame spheres moved to the new center and the box corner
+        float diag = 0;
+        for( int a=0; a<3; ++a )
+        {
+            v.Center[a] = (v.Min[a]+v.Max[a]) * 0.5f;
+            diag += (v.Max[a]-v.Center[a]) * (v.Max[a]-v.Center[a]);
+        }
+        float radius = 0;
+        for( int t=start; t<end; ++t )
+        {
+            float d = 0;
+            for( int a=0; a<3; ++a )
+                d += (Frames[t].Center[a]-v.Center[a]) * (Frames[t].Center[a]-v.Center[a]);
+            d = static_cast<float>(sqrt(d)) + Frames[t].Radius;
+            radius = d > radius ? d : radius;
+        }
+        diag = static_cast<float>(sqrt(diag));
+        v.Radius = radius < diag ? radius : diag;
+        return v;
+    }
+
+    static double GetVolume( const FBoundsVolume& v )
+    {
+        return static_cast<double>(v.Max[0]-v.Min[0]) * (v.Max[1]-v.Min[1]) * (v.Max[2]-v.Min[2]);
+    }
+
+    // Longest row of the rotation part, radii grow by it
+    static float GetScale( const float* tm )
+    {
+        float scale = 0;
+        for( int r=0; r<3; ++r )
+        {
+            float s = tm[r*3+0]*tm[r*3+0] + tm[r*3+1]*tm[r*3+1] + tm[r*3+2]*tm[r*3+2];
+            scale = s > scale ? s : scale;
+        }
+        return static_cast<float>(sqrt(scale));
+    }
+
+    static void GetBox( const float* points, int count, float* mn, float* mx )
+    {
+        int i = 1;
+        memcpy(mn,points,sizeof(float)*3);
+        memcpy(mx,points,sizeof(float)*3);
+#ifdef U3D_SSE
+        // Loads a fourth float past each point, the last point is left to the tail
+        if( count > 1 )
+        {
+            __m128 vmn = _mm_loadu_ps(points);
+            __m128 vmx = vmn;
+            for( ; i+1 < count; ++i )
+            {
+                __m128 p = _mm_loadu_ps(points+i*3);
+                vmn = _mm_min_ps(vmn,p);
+                vmx = _mm_max_ps(vmx,p);
+            }
+            float a[4], b[4];
+            _mm_storeu_ps(a,vmn);
+            _mm_storeu_ps(b,vmx);
+            memcpy(mn,a,sizeof(float)*3);
+            memcpy(mx,b,sizeof(float)*3);
+        }
+#endif
+        for( ; i<count; ++i )
+        {
+            const float* p = points + i*3;
+            for( int a=0; a<3; ++a )
+            {
+                mn[a] = p[a] < mn[a] ? p[a] : mn[a];
+                mx[a] = p[a] > mx[a] ? p[a] : mx[a];
+            }
+        }
+    }
+
+    static float GetRadius( const float* points, int count, const float* center )
+    {
+        int i = 0;
+        float r2 = 0;
+#ifdef U3D_SSE
+        // Four points at a time, shuffled from XYZ triples to X, Y and Z lanes
+        __m128 cx = _mm_set1_ps(center[0]);
+        __m128 cy = _mm_set1_ps(center[1]);
+        __m128 cz = _mm_set1_ps(center[2]);
+        __m128 vr = _mm_setzero_ps();
+        for( ; i+4 <= count; i+=4 )
+        {
+            const float* p = points + i*3;
+            __m128 a = _mm_loadu_ps(p);
+            __m128 b = _mm_loadu_ps(p+4);
+            __m128 c = _mm_loadu_ps(p+8);
+            __m128 x = _mm_sub_ps(_mm_shuffle_ps(a,_mm_shuffle_ps(b,c,_MM_SHUFFLE(1,0,3,2)),_MM_SHUFFLE(3,0,3,0)),cx);
+            __m128 y = _mm_sub_ps(_mm_shuffle_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(0,0,1,1)),_mm_shuffle_ps(b,c,_MM_SHUFFLE(2,2,3,3)),_MM_SHUFFLE(2,0,2,0)),cy);
+            __m128 z = _mm_sub_ps(_mm_shuffle_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(1,1,2,2)),_mm_shuffle_ps(c,c,_MM_SHUFFLE(3,3,0,0)),_MM_SHUFFLE(2,0,2,0)),cz);
+            vr = _mm_max_ps(vr,_mm_add_ps(_mm_add_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y)),_mm_mul_ps(z,z)));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes,vr);
+        for( int k=0; k<4; ++k )
+            r2 = lanes[k] > r2 ? lanes[k] : r2;
+#endif
+        for( ; i<count; ++i )
+        {
+            const float* p = points + i*3;
+            float d = (p[0]-center[0])*(p[0]-center[0]) + (p[1]-center[1])*(p[1]-center[1]) + (p[2]-center[2])*(p[2]-center[2]);
+            r2 = d > r2 ? d : r2;
+        }
+        return static_cast<float>(sqrt(r2));
+    }
+
+    static void WriteVolume( FOutFile& f, const TCHAR* box, const TCHAR* sphere, int index, const FBoundsVolume& v )
+    {
+        TCHAR at[16] = _T("");
+        if( index >= 0 )
+            _stprintf(at,_T("(%d)"),index);
+
+        f.Printf( _T("    %s%s=(Min=(X=%f,Y=%f,Z=%f),Max=(X=%f,Y=%f,Z=%f),IsValid=1)\n")
+            , box, at, v.Min[0], v.Min[1], v.Min[2], v.Max[0], v.Max[1], v.Max[2] );
+        f.Printf( _T("    %s%s=(X=%f,Y=%f,Z=%f,W=%f)\n")
+            , sphere, at, v.Center[0], v.Center[1], v.Center[2], v.Radius );
+    }
+};
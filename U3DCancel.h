@@ -0,0 +1,81 @@
+/*======================================================================
+
+    Cooperative cancellation
+
+    Long kernels and writers take an FCancelToken and check it between
+    chunks of work that take a few milliseconds, so a cancel request is
+    acted on within U3D_CANCEL_LATENCY_MS in every phase.
+
+    Poll is for the thread that owns the token. It asks the callback at
+    most every U3D_CANCEL_POLL_MS, which makes it cheap enough to call per
+    frame or per chunk of a write. The plugin's callback asks 3ds Max,
+    which also keeps the progress bar and the Esc key alive during long
+    loops. Worker threads only read IsCancelled, they stop when the
+    owner's next Poll has seen the request.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+
+#define U3D_CANCEL_LATENCY_MS   100
+#define U3D_CANCEL_POLL_MS      25
+#define U3D_CANCEL_CHUNK        (1<<20)     // bytes written between polls
+
+// Returns true when the work should stop
+typedef bool (*U3DCancelFn)( void* ctx );
+
+
+class FCancelToken
+{
+    U3DCancelFn         Fn;
+    void*               Ctx;
+    U_DWORD             LastPoll;
+    volatile long       bCancelled;
+
+public:
+    FCancelToken() : Fn(NULL), Ctx(NULL), LastPoll(0), bCancelled(0)
+    {
+    }
+
+    void Reset( U3DCancelFn fn=NULL, void* ctx=NULL )
+    {
+        Fn = fn;
+        Ctx = ctx;
+        LastPoll = GetTickCount();
+        bCancelled = 0;
+    }
+
+    // Any thread, also safe from signal handlers
+    void Cancel()
+    {
+        bCancelled = 1;
+    }
+
+    bool IsCancelled() const
+    {
+        return bCancelled != 0;
+    }
+
+    // Owner thread only
+    bool Poll()
+    {
+        if( bCancelled || Fn == NULL )
+            return bCancelled != 0;
+
+        U_DWORD now = GetTickCount();
+        if( now - LastPoll < U3D_CANCEL_POLL_MS )
+            return false;
+
+        // The callback may wait for the user, the interval starts after it
+        if( Fn(Ctx) )
+            bCancelled = 1;
+        LastPoll = GetTickCount();
+        return bCancelled != 0;
+    }
+};
+
+// Kernels take an optional token
+static bool U3DPollCancel( FCancelToken* token )
+{
+    return token != NULL && token->Poll();
+}
@@ -0,0 +1,313 @@
+/*======================================================================
+
+    Max independent parts of the exporter: mesh precision optimization,
+    vertex packing and the _d.3d, _a.3d and _rc.uc writers.
+
+    Shared by the plugin and the u3dexport command line tool, so nothing
+    here may use Max SDK types. Writers go through FOutFile (U3DOutput.h). Points are X,Y,Z float triples laid out
+    like Tab<Point3>.
+
+========================================================================*/
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#define U3D_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define U3D_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Limits of the .3d format, header counts and vert indices are 16 bits
+// and FrameSize counts bytes
+#define U3D_MAX_VERTS       (0xFFFF/4)      // FrameSize / sizeof(FMeshVert)
+#define U3D_MAX_TRIS        0xFFFF
+#define U3D_MAX_FRAMES      0xFFFF
+#define U3D_MAX_INDEX       0xFFFF
+
+
+// Non-owning string, points into the arena or into strings owned by Max
+struct FStrView
+{
+    const TCHAR*    Str;
+    int             Len;
+
+    FStrView() : Str(_T("")), Len(0)
+    {
+    }
+
+    FStrView( const TCHAR* str, int len ) : Str(str), Len(len)
+    {
+    }
+
+    FStrView( const TCHAR* str ) : Str(str ? str : _T("")), Len(str ? static_cast<int>(_tcslen(str)) : 0)
+    {
+    }
+
+    bool isNull() const
+    {
+        return Len == 0;
+    }
+
+    // Case insensitive, like MatchPattern(s,"prefix*",TRUE)
+    bool StartsWith( const TCHAR* prefix ) const
+    {
+        int i = 0;
+        for( ; prefix[i] != 0; ++i )
+        {
+            if( i == Len || _totlower(Str[i]) != _totlower(prefix[i]) )
+                return false;
+        }
+        return true;
+    }
+
+    // Same rules as _ttoi
+    int ToInt() const
+    {
+        int i = 0;
+        while( i < Len && (Str[i] == _T(' ') || Str[i] == _T('\t')) )
+            ++i;
+
+        bool neg = false;
+        if( i < Len && (Str[i] == _T('-') || Str[i] == _T('+')) )
+            neg = Str[i++] == _T('-');
+
+        int v = 0;
+        for( ; i < Len && Str[i] >= _T('0') && Str[i] <= _T('9'); ++i )
+            v = v*10 + (Str[i] - _T('0'));
+
+        return neg ? -v : v;
+    }
+};
+
+
+// Extends mn/mx to contain the points, lets bounds be gathered frame by frame
+void U3DGrowBounds( const float* points, int count, float* mn, float* mx )
+{
+    for( int i=0; i<count; ++i )
+    {
+        const float* p = points + i*3;
+        for( int a=0; a<3; ++a )
+        {
+            if      ( p[a] > mx[a] )    mx[a] = p[a];
+            else if ( p[a] < mn[a] )    mn[a] = p[a];
+        }
+    }
+}
+
+// Offset and scale that center the bounds and stretch them over the full
+// FMeshVert range, 11 bits for X and Y, 10 bits for Z
+void U3DGetOptimization( const float* mn, const float* mx, float* offset, float* scale )
+{
+    static const float range[3] = { 1023.0f, 1023.0f, 511.0f };
+    for( int a=0; a<3; ++a )
+    {
+        // get center point
+        offset[a] = (mx[a]+mn[a]) * 0.5f;
+
+        // center bounding box, flat axes keep unit scale
+        float ext = mx[a]-offset[a];
+        scale[a] = ext > 0 ? range[a] / ext : 1.0f;
+    }
+}
+
+void U3DGetOptimization( const float* points, int count, float* offset, float* scale )
+{
+    // get scene bounding box
+    float mx[3] = { points[0], points[1], points[2] };
+    float mn[3] = { points[0], points[1], points[2] };
+    U3DGrowBounds(points+3,count-1,mn,mx);
+    U3DGetOptimization(mn,mx,offset,scale);
+}
+
+// Max style row vector transform, out = p * tm with tm as 4 rows of XYZ,
+// the last one the translation. points and out may be the same array.
+void U3DTransformPoints( const float* points, int count, const float* tm, float* out )
+{
+#ifdef U3D_SSE
+    __m128 r0 = _mm_setr_ps(tm[0],tm[1],tm[2],0);
+    __m128 r1 = _mm_setr_ps(tm[3],tm[4],tm[5],0);
+    __m128 r2 = _mm_setr_ps(tm[6],tm[7],tm[8],0);
+    __m128 r3 = _mm_setr_ps(tm[9],tm[10],tm[11],0);
+    for( int i=0; i<count; ++i )
+    {
+        const float* p = points + i*3;
+        __m128 v = _mm_add_ps( _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]),r0),_mm_mul_ps(_mm_set1_ps(p[1]),r1))
+                             , _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[2]),r2),r3) );
+        _mm_storel_pi(reinterpret_cast<__m64*>(out+i*3),v);
+        _mm_store_ss(out+i*3+2,_mm_movehl_ps(v,v));
+    }
+#else
+    for( int i=0; i<count; ++i )
+    {
+        const float* p = points + i*3;
+        float x = p[0]*tm[0] + p[1]*tm[3] + p[2]*tm[6] + tm[9];
+        float y = p[0]*tm[1] + p[1]*tm[4] + p[2]*tm[7] + tm[10];
+        float z = p[0]*tm[2] + p[1]*tm[5] + p[2]*tm[8] + tm[11];
+        out[i*3+0] = x;
+        out[i*3+1] = y;
+        out[i*3+2] = z;
+    }
+#endif
+}
+
+// Applies offset and scale and packs points into FMeshVert
+void U3DQuantize( const float* points, int count, const float* offset, const float* scale, FMeshVert* out )
+{
+    for( int i=0; i<count; ++i )
+    {
+        const float* p = points + i*3;
+        out[i] = FMeshVert( (p[0]-offset[0])*scale[0]
+                          , (p[1]-offset[1])*scale[1]
+                          , (p[2]-offset[2])*scale[2] );
+    }
+}
+
+// Bounds of the transformed box, exact when tm only swaps and flips axes
+void U3DTransformBounds( const float* tm, float* mn, float* mx )
+{
+    float lo[3], hi[3];
+    for( int a=0; a<3; ++a )
+    {
+        lo[a] = hi[a] = tm[9+a];
+        for( int r=0; r<3; ++r )
+        {
+            float p = mn[r]*tm[r*3+a];
+            float q = mx[r]*tm[r*3+a];
+            lo[a] += p < q ? p : q;
+            hi[a] += p < q ? q : p;
+        }
+    }
+    memcpy(mn,lo,sizeof(lo));
+    memcpy(mx,hi,sizeof(hi));
+}
+
+// U3DTransformPoints and U3DQuantize in one pass, packs the same verts
+void U3DQuantizeAffine( const float* points, int count, const float* tm, const float* offset, const float* scale, FMeshVert* out )
+{
+    int i = 0;
+#ifdef U3D_SSE2
+    // Four points at a time, shuffled from XYZ triples to X, Y and Z lanes
+    const __m128i mxy = _mm_set1_epi32(0x7FF);
+    const __m128i mz = _mm_set1_epi32(0x3FF);
+    for( ; i+4 <= count; i+=4 )
+    {
+        const float* p = points + i*3;
+        __m128 a = _mm_loadu_ps(p);
+        __m128 b = _mm_loadu_ps(p+4);
+        __m128 c = _mm_loadu_ps(p+8);
+        __m128 x = _mm_shuffle_ps(a,_mm_shuffle_ps(b,c,_MM_SHUFFLE(1,0,3,2)),_MM_SHUFFLE(3,0,3,0));
+        __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(0,0,1,1)),_mm_shuffle_ps(b,c,_MM_SHUFFLE(2,2,3,3)),_MM_SHUFFLE(2,0,2,0));
+        __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(1,1,2,2)),_mm_shuffle_ps(c,c,_MM_SHUFFLE(3,3,0,0)),_MM_SHUFFLE(2,0,2,0));
+
+        __m128i q[3];
+        for( int k=0; k<3; ++k )
+        {
+            __m128 v = _mm_add_ps( _mm_add_ps(_mm_mul_ps(x,_mm_set1_ps(tm[k])),_mm_mul_ps(y,_mm_set1_ps(tm[3+k])))
+                                 , _mm_add_ps(_mm_mul_ps(z,_mm_set1_ps(tm[6+k])),_mm_set1_ps(tm[9+k])) );
+            v = _mm_mul_ps(_mm_sub_ps(v,_mm_set1_ps(offset[k])),_mm_set1_ps(scale[k]));
+            q[k] = _mm_cvttps_epi32(v);
+        }
+        __m128i v = _mm_or_si128( _mm_and_si128(q[0],mxy)
+                                , _mm_or_si128( _mm_slli_epi32(_mm_and_si128(q[1],mxy),11)
+                                              , _mm_slli_epi32(_mm_and_si128(q[2],mz),22) ) );
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out+i),v);
+    }
+#endif
+    for( ; i<count; ++i )
+    {
+        const float* p = points + i*3;
+        float v[3];
+        for( int k=0; k<3; ++k )
+            v[k] = ((p[0]*tm[k] + p[1]*tm[3+k]) + (p[2]*tm[6+k] + tm[9+k]) - offset[k]) * scale[k];
+        out[i] = FMeshVert(v[0],v[1],v[2]);
+    }
+}
+
+// Sign extends the 11, 11 and 10 bit fields of a packed vert
+void U3DUnpack( const FMeshVert& v, float* out )
+{
+    out[0] = static_cast<float>(static_cast<int>(v.V << 21) >> 21);
+    out[1] = static_cast<float>(static_cast<int>(v.V << 10) >> 21);
+    out[2] = static_cast<float>(static_cast<int>(v.V) >> 22);
+}
+
+
+// #exec lines that import the mesh and undo the precision optimization
+void U3DWriteScriptHeader( FOutFile& f, const TCHAR* name, const float* offset, const float* scale, const float* rot, int framecount )
+{
+    // Write class def
+    f.Printf( _T("class %s extends Object;\n\n"), name );
+
+    // write import
+    f.Printf( _T("#exec MESH IMPORT MESH=%s ANIVFILE=%s_a.3D DATAFILE=%s_d.3D \n"), name, name, name );
+
+    // write origin & rotation
+    // TODO: figure out why it's incorrect without -1
+    float porg[3] = { offset[0]*scale[0]*-1, offset[1]*scale[1]*-1, offset[2]*scale[2]*-1 };
+    f.Printf( _T("#exec MESH ORIGIN MESH=%s X=%f Y=%f Z=%f PITCH=%d YAW=%d ROLL=%d \n"), name, porg[0], porg[1], porg[2], (int)rot[0], (int)rot[1], (int)rot[2] );
+
+    // write mesh scale
+    float psc[3] = { 1.0f/scale[0], 1.0f/scale[1], 1.0f/scale[2] };
+    f.Printf( _T("#exec MESH SCALE MESH=%s X=%f Y=%f Z=%f \n"), name, psc[0], psc[1], psc[2] );
+
+    // write meshmap
+    f.Printf( _T("#exec MESHMAP NEW MESHMA=P%s MESH=%smap \n"), name, name );
+
+    // write meshmap scale
+    f.Printf( _T("#exec MESHMAP SCALE MESHMAP=%s X=%f Y=%f Z=%f \n"), name, psc[0], psc[1], psc[2] );
+
+    // write sequence
+    f.Printf( _T("#exec MESH SEQUENCE MESH=%s SEQ=%s STARTFRAME=%d NUMFRAMES=%d \n"), name, _T("All"), 0, framecount-1 );
+}
+
+void U3DWriteSequence( FOutFile& f, const TCHAR* name, const FStrView& seq, int startframe, int numframes, const FStrView& rate, const FStrView& group )
+{
+    f.Printf( _T("#exec MESH SEQUENCE MESH=%s SEQ=%.*s STARTFRAME=%d NUMFRAMES=%d"), name, seq.Len, seq.Str, startframe, numframes );
+
+    if( !rate.isNull() )
+        f.Printf( _T(" RATE=%.*s"), rate.Len, rate.Str );
+
+    if( !group.isNull() )
+        f.Printf( _T(" GROUP=%.*s"), group.Len, group.Str );
+
+    f.Printf( _T(" \n") );
+}
+
+void U3DWriteNotify( FOutFile& f, const TCHAR* name, const FStrView& seq, const FStrView& time, const FStrView& func )
+{
+    f.Printf( _T("#exec MESH NOTIFY MESH=%s SEQ=%.*s TIME=%.*s FUNCTION=%.*s \n"), name, seq.Len, seq.Str, time.Len, time.Str, func.Len, func.Str );
+}
+
+void U3DWriteTexture( FOutFile& f, const TCHAR* name, int num, const TCHAR* texture )
+{
+    f.Printf( _T("#exec MESHMAP SETTEXTURE MESHMAP=%s NUM=%d TEXTURE=%s \n"), name, num, texture );
+}
+
+
+// Counts the headers can hold, larger ones would write truncated files
+bool U3DFitsFormat( int verts, int tris, int frames )
+{
+    return verts <= U3D_MAX_VERTS && tris <= U3D_MAX_TRIS && frames <= U3D_MAX_FRAMES;
+}
+
+// Data file: header followed by triangles
+bool U3DWriteData( FOutFile& f, const FJSDataHeader& header, const FJSMeshTri* tris )
+{
+    return f.Write(&header,sizeof(FJSDataHeader))
+        && f.Write(tris,sizeof(FJSMeshTri)*header.NumPolys);
+}
+
+// Aniv file: header followed by NumFrames frames of packed verts
+bool U3DWriteAnivHeader( FOutFile& f, const FJSAnivHeader& header )
+{
+    return f.Write(&header,sizeof(FJSAnivHeader));
+}
+
+bool U3DWriteAniv( FOutFile& f, const FJSAnivHeader& header, const FMeshVert* verts )
+{
+    size_t count = static_cast<size_t>(header.NumFrames) * (header.FrameSize / sizeof(FMeshVert));
+    return U3DWriteAnivHeader(f,header)
+        && f.Write(verts,sizeof(FMeshVert)*count);
+}
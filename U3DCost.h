@@ -0,0 +1,268 @@
+/*======================================================================
+
+    Engine side cost of an exported vertex animation
+
+    FCostAnalyzer looks at the packed frames as they are written and
+    reports what the mesh costs once it is in the engine: bytes per frame
+    and in total, verts that never move, per-sequence motion, how much of
+    the packed range each axis uses and the vertex work per rendered frame.
+
+    The engine blends two packed frames per vertex every time the mesh is
+    drawn, so the per-frame estimate counts two reads, the unpack and the
+    blend, and the transform to world space.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_COST_READS      2           // packed frames read per drawn vertex
+#define U3D_COST_FLOPS      30          // unpack 6, blend 6, transform 18
+
+
+class FCostAnalyzer
+{
+public:
+    struct FSeqCost
+    {
+        FString         Name;
+        int             Start;
+        int             NumFrames;
+        float           Range[3];       // largest travel of a single vert, world units
+        int             MovingVerts;
+    };
+
+    // Totals, filled in by End
+    int                     VertCount;
+    int                     TriCount;
+    int                     FrameCount;
+    U_QWORD                 FrameBytes;
+    U_QWORD                 DataBytes;
+    U_QWORD                 AnimBytes;
+    int                     StaticVerts;
+    float                   Precision[3];   // world units per packed step
+    float                   Headroom[3];    // unused share of the packed range
+    U_QWORD                 DrawBytes;      // per drawn frame
+    U_QWORD                 DrawFlops;
+    std::vector<FSeqCost>   Seqs;
+
+private:
+    float                   Scale[3];
+    int                     Frame;
+    std::vector<float>      Unpacked;
+    std::vector<float>      Mn, Mx;         // per vert, whole clip
+    std::vector< std::vector<float> > SeqMn, SeqMx;
+
+public:
+    FCostAnalyzer()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        VertCount = TriCount = FrameCount = 0;
+        FrameBytes = DataBytes = AnimBytes = DrawBytes = DrawFlops = 0;
+        StaticVerts = 0;
+        Frame = 0;
+        for( int a=0; a<3; ++a )
+        {
+            Precision[a] = Headroom[a] = 0;
+            Scale[a] = 1;
+        }
+        Seqs.clear();
+        SeqMn.clear();
+        SeqMx.clear();
+    }
+
+    // Sequence frames index the anim file, like STARTFRAME in the script
+    void AddSequence( const FStrView& name, int start, int numframes )
+    {
+        FSeqCost seq;
+        seq.Name.assign(name.Str,name.Len);
+        seq.Start = start;
+        seq.NumFrames = numframes;
+        seq.Range[0] = seq.Range[1] = seq.Range[2] = 0;
+        seq.MovingVerts = 0;
+        Seqs.push_back(seq);
+    }
+
+    void Begin( int vertcount, int tricount, int framecount, const float* scale )
+    {
+        VertCount = vertcount;
+        TriCount = tricount;
+        FrameCount = framecount;
+        Frame = 0;
+        for( int a=0; a<3; ++a )
+            Scale[a] = scale[a];
+
+        Unpacked.resize(VertCount*3+1);
+        Mn.resize(VertCount*3+1);
+        Mx.resize(VertCount*3+1);
+        SeqMn.resize(Seqs.size());
+        SeqMx.resize(Seqs.size());
+    }
+
+    // Frames come in file order, one call per frame
+    void AddFrame( const FMeshVert* verts )
+    {
+        float* p = &Unpacked[0];
+        for( int i=0; i<VertCount; ++i )
+            U3DUnpack(verts[i],p+i*3);
+
+        int count = VertCount*3;
+        if( Frame == 0 )
+        {
+            Mn.assign(Unpacked.begin(),Unpacked.end());
+            Mx.assign(Unpacked.begin(),Unpacked.end());
+        }
+        else
+        {
+            GrowRanges(p,count,&Mn[0],&Mx[0]);
+        }
+
+        for( size_t s=0; s<Seqs.size(); ++s )
+        {
+            const FSeqCost& seq = Seqs[s];
+            if( Frame < seq.Start || Frame >= seq.Start+seq.NumFrames )
+                continue;
+
+            if( Frame == seq.Start )
+            {
+                SeqMn[s].assign(Unpacked.begin(),Unpacked.end());
+                SeqMx[s].assign(Unpacked.begin(),Unpacked.end());
+            }
+            else
+            {
+                GrowRanges(p,count,&SeqMn[s][0],&SeqMx[s][0]);
+            }
+
+            if( Frame == seq.Start+seq.NumFrames-1 || Frame == FrameCount-1 )
+                EndSequence(s);
+        }
+        ++Frame;
+    }
+
+    void End()
+    {
+        FrameBytes = static_cast<U_QWORD>(VertCount)*sizeof(FMeshVert);
+        DataBytes = sizeof(FJSDataHeader) + static_cast<U_QWORD>(TriCount)*sizeof(FJSMeshTri);
+        AnimBytes = sizeof(FJSAnivHeader) + FrameBytes*FrameCount;
+        DrawBytes = FrameBytes*U3D_COST_READS;
+        DrawFlops = static_cast<U_QWORD>(VertCount)*U3D_COST_FLOPS;
+
+        StaticVerts = 0;
+        float used[3] = { 0,0,0 };
+        float lo[3] = { 0,0,0 };
+        float hi[3] = { 0,0,0 };
+        for( int i=0; i<VertCount && Frame>0; ++i )
+        {
+            bool still = true;
+            for( int a=0; a<3; ++a )
+            {
+                float mn = Mn[i*3+a];
+                float mx = Mx[i*3+a];
+                still = still && mn == mx;
+                lo[a] = i == 0 || mn < lo[a] ? mn : lo[a];
+                hi[a] = i == 0 || mx > hi[a] ? mx : hi[a];
+            }
+            StaticVerts += still ? 1 : 0;
+        }
+
+        static const float range[3] = { 2046.0f, 2046.0f, 1022.0f };
+        for( int a=0; a<3; ++a )
+        {
+            used[a] = (hi[a]-lo[a]) / range[a];
+            Headroom[a] = used[a] < 1 ? 1 - used[a] : 0;
+            Precision[a] = Scale[a] != 0 ? 1.0f / Scale[a] : 0;
+        }
+
+        Unpacked.clear();
+        Mn.clear();
+        Mx.clear();
+    }
+
+    // Writes through anything with a Printf, an FOutFile or a log channel
+    template<class TWriter> void WriteLog( TWriter& f ) const
+    {
+        f.Printf( _T("Cost: %u bytes per frame, %u KB anim, %u KB data, %d of %d verts static\n")
+            , static_cast<unsigned>(FrameBytes), static_cast<unsigned>(AnimBytes/1024)
+            , static_cast<unsigned>(DataBytes/1024), StaticVerts, VertCount );
+        f.Printf( _T("Cost: precision X=%f Y=%f Z=%f, headroom X=%.1f%% Y=%.1f%% Z=%.1f%%\n")
+            , Precision[0], Precision[1], Precision[2]
+            , Headroom[0]*100, Headroom[1]*100, Headroom[2]*100 );
+        f.Printf( _T("Cost: %u bytes and about %u flops per drawn frame\n")
+            , static_cast<unsigned>(DrawBytes), static_cast<unsigned>(DrawFlops) );
+        for( size_t s=0; s<Seqs.size(); ++s )
+        {
+            const FSeqCost& seq = Seqs[s];
+            f.Printf( _T("Cost: %s frames %d-%d, %d verts move, range X=%f Y=%f Z=%f\n")
+                , seq.Name.c_str(), seq.Start, seq.Start+seq.NumFrames-1, seq.MovingVerts
+                , seq.Range[0], seq.Range[1], seq.Range[2] );
+        }
+    }
+
+    bool WriteJson( FOutFile& f, const TCHAR* name ) const
+    {
+        f.Printf( _T("{\n  \"name\": \"%s\",\n"), name );
+        f.Printf( _T("  \"frames\": %d,\n  \"tris\": %d,\n  \"verts\": %d,\n"), FrameCount, TriCount, VertCount );
+        f.Printf( _T("  \"frame_bytes\": %u,\n  \"anim_bytes\": %u,\n  \"data_bytes\": %u,\n")
+            , static_cast<unsigned>(FrameBytes), static_cast<unsigned>(AnimBytes), static_cast<unsigned>(DataBytes) );
+        f.Printf( _T("  \"static_verts\": %d,\n  \"static_share\": %f,\n")
+            , StaticVerts, VertCount > 0 ? static_cast<float>(StaticVerts)/VertCount : 0.0f );
+        f.Printf( _T("  \"precision\": [%f, %f, %f],\n"), Precision[0], Precision[1], Precision[2] );
+        f.Printf( _T("  \"headroom\": [%f, %f, %f],\n"), Headroom[0], Headroom[1], Headroom[2] );
+        f.Printf( _T("  \"draw_bytes\": %u,\n  \"draw_flops\": %u,\n")
+            , static_cast<unsigned>(DrawBytes), static_cast<unsigned>(DrawFlops) );
+        f.Printf( _T("  \"sequences\": [") );
+        for( size_t s=0; s<Seqs.size(); ++s )
+        {
+            const FSeqCost& seq = Seqs[s];
+            f.Printf( _T("%s\n    { \"name\": \"%s\", \"start\": %d, \"frames\": %d, \"moving_verts\": %d, \"range\": [%f, %f, %f] }")
+                , s ? _T(",") : _T(""), seq.Name.c_str(), seq.Start, seq.NumFrames, seq.MovingVerts
+                , seq.Range[0], seq.Range[1], seq.Range[2] );
+        }
+        f.Printf( _T("%s]\n}\n"), Seqs.empty() ? _T("") : _T("\n  ") );
+        return true;
+    }
+
+private:
+    void EndSequence( size_t s )
+    {
+        FSeqCost& seq = Seqs[s];
+        const float* mn = &SeqMn[s][0];
+        const float* mx = &SeqMx[s][0];
+        for( int i=0; i<VertCount; ++i )
+        {
+            bool moves = false;
+            for( int a=0; a<3; ++a )
+            {
+                float travel = (mx[i*3+a] - mn[i*3+a]) / Scale[a];
+                seq.Range[a] = travel > seq.Range[a] ? travel : seq.Range[a];
+                moves = moves || travel > 0;
+            }
+            seq.MovingVerts += moves ? 1 : 0;
+        }
+        std::vector<float>().swap(SeqMn[s]);
+        std::vector<float>().swap(SeqMx[s]);
+    }
+
+    // Element-wise min/max of count floats
+    static void GrowRanges( const float* values, int count, float* mn, float* mx )
+    {
+        int i = 0;
+#ifdef U3D_SSE
+        for( ; i+4 <= count; i+=4 )
+        {
+            __m128 v = _mm_loadu_ps(values+i);
+            _mm_storeu_ps(mn+i,_mm_min_ps(_mm_loadu_ps(mn+i),v));
+            _mm_storeu_ps(mx+i,_mm_max_ps(_mm_loadu_ps(mx+i),v));
+        }
+#endif
+        for( ; i<count; ++i )
+        {
+            mn[i] = values[i] < mn[i] ? values[i] : mn[i];
+            mx[i] = values[i] > mx[i] ? values[i] : mx[i];
+        }
+    }
+};
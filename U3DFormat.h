@@ -94,9 +94,11 @@ public:
 	: X(x), Y(y), Z(z)
 	{}
 
+#ifndef U3D_HEADLESS
 	FVector( const Point3& p )
 	: X(p.x), Y(p.y), Z(p.z)
 	{}
+#endif
 
 	FVector( const U_INT x, const U_INT y, const U_INT z )
 	: X((U_FLOAT)x), Y((U_FLOAT)y), Z((U_FLOAT)z)
@@ -165,6 +167,13 @@ struct FMeshUV
 	: U(u), V(v)
 	{}
 
+    // Max texture space, V goes up
+    static FMeshUV FromFloat( const float u, const float v )
+    {
+        return FMeshUV(ConvertUV(u),255-ConvertUV(v));
+    }
+
+#ifndef U3D_HEADLESS
 	FMeshUV( const Point2& p )
 	: U(ConvertUV(p.x)), V(255-ConvertUV(p.y))
 	{}
@@ -175,6 +184,7 @@ struct FMeshUV
             , p.x, ConvertUV(p.x), u.U
             , p.y, 255-ConvertUV(p.y), u.V );
     }
+#endif
 
 };
 
@@ -246,12 +256,21 @@ struct FMeshVert
 	FMeshVert() : V(0)
 	{}
 
+	FMeshVert( const U_FLOAT x, const U_FLOAT y, const U_FLOAT z )
+    : V ( ( static_cast<U_INT>( x ) & 0x7FF ) |
+        ( ( static_cast<U_INT>( y ) & 0x7FF ) << 11 ) |
+        ( ( static_cast<U_INT>( z ) & 0x3FF ) << 22 ) )
+	{
+    }
+
+#ifndef U3D_HEADLESS
 	FMeshVert( const Point3& p )
     : V ( ( static_cast<U_INT>( p.x ) & 0x7FF ) |
         ( ( static_cast<U_INT>( p.y ) & 0x7FF ) << 11 ) |
         ( ( static_cast<U_INT>( p.z ) & 0x3FF ) << 22 ) )
 	{
     }
+#endif
 };
 
 
@@ -0,0 +1,149 @@
+// Sampled frames, one slot of Stride verts per frame. Kept in RAM when the
+// budget allows, otherwise in a temp file that is mapped a chunk at a time.
+// Frames are handed out one at a time: a pointer from GetFrame stays valid
+// only until a frame from another chunk is requested.
+class FFrameStore
+{
+    enum { ChunkBytes = 16*1024*1024 };
+
+    Point3*     Mem;
+    HANDLE      hFile;
+    HANDLE      hMapping;
+    Point3*     View;
+    int         ViewChunk;
+    int         Stride;
+    int         FrameCount;
+    int         FramesPerChunk;
+    size_t      ChunkStride;
+    ULONGLONG   SpilledBytes;
+
+public:
+    FFrameStore()
+    : Mem(NULL)
+    , hFile(INVALID_HANDLE_VALUE)
+    , hMapping(NULL)
+    , View(NULL)
+    , ViewChunk(-1)
+    , Stride(0)
+    , FrameCount(0)
+    , FramesPerChunk(0)
+    , ChunkStride(0)
+    , SpilledBytes(0)
+    {
+    }
+
+    ~FFrameStore()
+    {
+        Release();
+    }
+
+    // Returns false only if neither RAM nor the temp file could be had
+    bool Init( int stride, int framecount, bool spill )
+    {
+        Release();
+        Stride = stride;
+        FrameCount = framecount;
+
+        size_t framebytes = static_cast<size_t>(Stride)*sizeof(Point3);
+        if( static_cast<double>(framebytes)*FrameCount >= static_cast<double>(~static_cast<size_t>(0)) )
+            spill = true;
+
+        if( !spill )
+        {
+            Mem = static_cast<Point3*>(malloc(max(framebytes*FrameCount,sizeof(Point3))));
+            if( Mem != NULL )
+                return true;
+        }
+
+        // Chunks start on allocation granularity so each maps on its own
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        size_t gran = si.dwAllocationGranularity;
+        FramesPerChunk = max(1,static_cast<int>(ChunkBytes/max(framebytes,static_cast<size_t>(1))));
+        ChunkStride = (FramesPerChunk*framebytes + gran-1) / gran * gran;
+
+        int chunks = (FrameCount + FramesPerChunk-1) / FramesPerChunk;
+        ULONGLONG size = static_cast<ULONGLONG>(ChunkStride)*max(chunks,1);
+
+        TCHAR dir[MAX_PATH], path[MAX_PATH];
+        if( !GetTempPath(MAX_PATH,dir) || !GetTempFileName(dir,_T("u3d"),0,path) )
+            return false;
+
+        // Deleted by the system when closed, even if Max goes down
+        hFile = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,CREATE_ALWAYS
+            ,FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,NULL);
+        if( hFile == INVALID_HANDLE_VALUE )
+            return false;
+
+        hMapping = CreateFileMapping(hFile,NULL,PAGE_READWRITE
+            ,static_cast<DWORD>(size >> 32),static_cast<DWORD>(size),NULL);
+        if( hMapping == NULL )
+        {
+            Release();
+            return false;
+        }
+
+        SpilledBytes = size;
+        return true;
+    }
+
+    Point3* GetFrame( int t )
+    {
+        if( Mem != NULL )
+            return Mem + static_cast<size_t>(t)*Stride;
+
+        int chunk = t / FramesPerChunk;
+        if( chunk != ViewChunk )
+        {
+            if( View != NULL )
+                UnmapViewOfFile(View);
+
+            ULONGLONG offset = static_cast<ULONGLONG>(ChunkStride)*chunk;
+            View = static_cast<Point3*>(MapViewOfFile(hMapping,FILE_MAP_READ|FILE_MAP_WRITE
+                ,static_cast<DWORD>(offset >> 32),static_cast<DWORD>(offset),ChunkStride));
+            ViewChunk = View != NULL ? chunk : -1;
+            if( View == NULL )
+                throw MAXException(_T("Out of memory"));
+        }
+        return View + static_cast<size_t>(t - chunk*FramesPerChunk)*Stride;
+    }
+
+    void Release()
+    {
+        free(Mem);
+        Mem = NULL;
+
+        if( View != NULL )
+            UnmapViewOfFile(View);
+        View = NULL;
+        ViewChunk = -1;
+
+        if( hMapping != NULL )
+            CloseHandle(hMapping);
+        hMapping = NULL;
+
+        if( hFile != INVALID_HANDLE_VALUE )
+            CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+
+        SpilledBytes = 0;
+    }
+
+    bool IsSpilled() const
+    {
+        return hMapping != NULL;
+    }
+
+    // Bytes held in the process: everything in RAM mode, one view otherwise
+    size_t GetResidentBytes() const
+    {
+        if( Mem != NULL )
+            return static_cast<size_t>(Stride)*FrameCount*sizeof(Point3);
+        return View != NULL ? ChunkStride : 0;
+    }
+
+    ULONGLONG GetSpilledBytes() const
+    {
+        return SpilledBytes;
+    }
+};
@@ -0,0 +1,277 @@
+// FSceneSource on top of 3DXI. Mesh objects are fetched once and kept until
+// the source goes away, a new frame only re-evaluates their data instead of
+// going through GetIGameObject and ReleaseIGameObject for every node.
+class FGameSceneSource : public FSceneSource
+{
+    IGameScene*             Scene;
+    Tab<IGameNode*>         MeshNodes;
+    Tab<IGameMesh*>         Meshes;         // NULL if the data could not be had
+    Tab<BYTE>               Dirty;          // evaluated at another frame
+    Tab<int>                Instances;      // first mesh with the same object
+    Tab<IGameNode*>         TrackedNodes;
+    Tab<IGameMaterial*>     Materials;
+    Tab<int>                NoteFrames;
+    Tab<const TCHAR*>       NoteTexts;
+    int                     FrameStart;
+    int                     FrameEnd;
+
+public:
+    FGameSceneSource( IGameScene* scene, Interface* ip, const Tab<IGameNode*>& meshes, const Tab<IGameNode*>& tracked, int framestart, int frameend, FArena& arena )
+    : Scene(scene)
+    , MeshNodes(meshes)
+    , TrackedNodes(tracked)
+    , FrameStart(framestart)
+    , FrameEnd(frameend)
+    {
+        Meshes.SetCount(MeshNodes.Count());
+        Dirty.SetCount(MeshNodes.Count());
+        Instances.SetCount(MeshNodes.Count());
+        for( int n=0; n<MeshNodes.Count(); ++n )
+        {
+            Meshes[n] = static_cast<IGameMesh*>(MeshNodes[n]->GetIGameObject());
+            Dirty[n] = 0;
+            if( !Meshes[n]->InitializeData() )
+            {
+                MeshNodes[n]->ReleaseIGameObject();
+                Meshes[n] = NULL;
+            }
+            Instances[n] = FindInstance(n);
+        }
+
+        // World note track keys, copied so they outlive the scene pointer
+        ReferenceTarget *rtscene = ip->GetScenePointer();
+        for( int t=0; t<rtscene->NumNoteTracks(); ++t )
+        {
+            DefNoteTrack* notetrack = static_cast<DefNoteTrack*>(rtscene->GetNoteTrack(t));
+            for( int k=0; k<notetrack->keys.Count(); ++k )
+            {
+                NoteKey* notekey = notetrack->keys[k];
+                int frame = notekey->time / Scene->GetSceneTicks();
+                const TCHAR* text = arena.Dup(notekey->note.data(),notekey->note.Length());
+                NoteFrames.Append(1,&frame);
+                NoteTexts.Append(1,&text);
+            }
+        }
+    }
+
+    ~FGameSceneSource()
+    {
+        for( int n=0; n<Meshes.Count(); ++n )
+        {
+            if( Meshes[n] != NULL )
+                MeshNodes[n]->ReleaseIGameObject();
+        }
+    }
+
+    int             GetFrameStart()                 { return FrameStart; }
+    int             GetFrameEnd()                   { return FrameEnd; }
+    int             GetMaterialCount()              { return Materials.Count(); }
+    const TCHAR*    GetMaterialName( int m )        { return Materials[m]->GetMaterialName(); }
+    int             GetNoteCount()                  { return NoteTexts.Count(); }
+    int             GetNoteFrame( int i )           { return NoteFrames[i]; }
+    const TCHAR*    GetNoteText( int i )            { return NoteTexts[i]; }
+    int             GetMeshCount()                  { return Meshes.Count(); }
+    const TCHAR*    GetMeshName( int n )            { return MeshNodes[n]->GetName(); }
+    int             GetVertCount( int n )           { return Meshes[n] ? Meshes[n]->GetNumberOfVerts() : 0; }
+    int             GetFaceCount( int n )           { return Meshes[n] ? Meshes[n]->GetNumberOfFaces() : 0; }
+    int             GetTrackedCount()               { return TrackedNodes.Count(); }
+    const TCHAR*    GetTrackedName( int n )         { return TrackedNodes[n]->GetName(); }
+
+    int GetFaces( int n, FSceneFace* out )
+    {
+        IGameMesh* mesh = Meshes[n];
+        if( mesh == NULL )
+            return 0;
+
+        // Faces of one mesh mostly share a material, remember the last one
+        IGameMaterial* lastmat = NULL;
+        int lastindex = -1;
+
+        int count = 0;
+        int facecount = mesh->GetNumberOfFaces();
+        for( int i=0; i!=facecount; ++i )
+        {
+            FaceEx* f = mesh->GetFace(i);
+            if( f == NULL )
+                continue;
+
+            FSceneFace& face = out[count++];
+            face.UVMask = 0;
+            face.MatID = f->matID;
+
+            IGameMaterial* mat = mesh->GetMaterialFromFace(f);
+            if( mat != lastmat )
+            {
+                lastmat = mat;
+                lastindex = -1;
+                for( int m=0; m<Materials.Count() && mat != NULL; ++m )
+                {
+                    if( Materials[m] == mat )
+                        lastindex = m;
+                }
+                if( mat != NULL && lastindex == -1 )
+                {
+                    lastindex = Materials.Count();
+                    Materials.Append(1,&mat);
+                }
+            }
+            face.Material = lastindex;
+
+            for( int k=0; k<3; ++k )
+            {
+                Point2 uv;
+                face.Vert[k] = f->vert[k];
+                if( mesh->GetTexVertex(f->texCoord[k],uv) ){
+                    face.UV[k][0] = uv.x;
+                    face.UV[k][1] = uv.y;
+                    face.UVMask |= 1<<k;
+                }
+            }
+        }
+        return count;
+    }
+
+    void SetFrame( int frame )
+    {
+        Scene->SetStaticFrame(frame);
+        for( int n=0; n<Dirty.Count(); ++n )
+            Dirty[n] = 1;
+    }
+
+    int GetVerts( int n, float* out, int maxcount )
+    {
+        return ReadVerts(n,out,maxcount,false);
+    }
+
+    void GetTrackedTM( int n, float* tm )
+    {
+        CopyRows(TrackedNodes[n]->GetWorldTM().ExtractMatrix3(),tm);
+    }
+
+    // Only a stack without modifiers that move verts, on a base object
+    // whose parameters do not change over the export range. Candidates
+    // still have to agree on the probe frames before they are taken as
+    // rigid, see FindShared.
+    bool IsRigidCandidate( int n )
+    {
+        IGameMesh* mesh = Meshes[n];
+        if( mesh == NULL || mesh->IsObjectSkinned() )
+            return false;
+
+        // Space warp bindings are part of the stack too
+        Object* obj = MeshNodes[n]->GetMaxNode()->GetObjOrWSMRef();
+        while( obj != NULL && obj->SuperClassID() == GEN_DERIVOB_CLASS_ID )
+        {
+            IDerivedObject* derived = static_cast<IDerivedObject*>(obj);
+            for( int i=0; i<derived->NumModifiers(); ++i )
+            {
+                Modifier* mod = derived->GetModifier(i);
+                if( mod != NULL && mod->IsEnabled() && !IsStillModifier(mod) )
+                    return false;
+            }
+            obj = derived->GetObjRef();
+        }
+        if( obj == NULL )
+            return false;
+
+        // Animated parameters make the validity shorter than the range
+        int ticks = Scene->GetSceneTicks();
+        Interval range(FrameStart*ticks,FrameEnd*ticks);
+        return obj->Eval(range.Start()).Validity(range.Start()).InInterval(range) != 0;
+    }
+
+    int GetLocalVerts( int n, float* out, int maxcount )
+    {
+        return ReadVerts(n,out,maxcount,true);
+    }
+
+    void GetMeshTM( int n, float* tm )
+    {
+        CopyRows(MeshNodes[n]->GetObjectTM().ExtractMatrix3(),tm);
+    }
+
+    int GetInstanceOf( int n )
+    {
+        return Instances[n];
+    }
+
+private:
+    // Modifiers known to leave the verts where they are, anything else
+    // may deform the mesh on frames the probes do not see
+    static bool IsStillModifier( Modifier* mod )
+    {
+        static const Class_ID still[] = {
+            Class_ID(0x000f72b1,0x00000000),    // UVW Map
+            Class_ID(0x02df2e3a,0x72ba4e1f),    // Unwrap UVW
+            Class_ID(0x4aa52ae3,0x35ca1cde),    // Edit Normals
+        };
+        Class_ID id = mod->ClassID();
+        for( int i=0; i<sizeof(still)/sizeof(still[0]); ++i )
+        {
+            if( id == still[i] )
+                return true;
+        }
+        return false;
+    }
+
+    // Instances share the object reference, which holds the modifier stack
+    // too. The node material decides the face materials so it must match.
+    int FindInstance( int n )
+    {
+        if( Meshes[n] == NULL )
+            return n;
+
+        INode* node = MeshNodes[n]->GetMaxNode();
+        for( int m=0; m<n; ++m )
+        {
+            INode* other = MeshNodes[m]->GetMaxNode();
+            if( Meshes[m] != NULL && Instances[m] == m
+             && other->GetObjectRef() == node->GetObjectRef()
+             && other->GetMtl() == node->GetMtl()
+             && Meshes[m]->GetNumberOfVerts() == Meshes[n]->GetNumberOfVerts()
+             && Meshes[m]->GetNumberOfFaces() == Meshes[n]->GetNumberOfFaces() )
+                return m;
+        }
+        return n;
+    }
+
+    int ReadVerts( int n, float* out, int maxcount, bool objectspace )
+    {
+        IGameMesh* mesh = Meshes[n];
+        if( mesh == NULL )
+            return 0;
+
+        if( Dirty[n] )
+        {
+            Dirty[n] = 0;
+            if( !mesh->InitializeData() )
+                return 0;
+        }
+
+        int written = 0;
+        int vertcount = mesh->GetNumberOfVerts();
+        for( int i=0; i<vertcount; ++i )
+        {
+            Point3 p;
+            if( mesh->GetVertex(i,p,objectspace) && written < maxcount )
+            {
+                out[written*3+0] = p.x;
+                out[written*3+1] = p.y;
+                out[written*3+2] = p.z;
+                ++written;
+            }
+        }
+        return vertcount;
+    }
+
+    static void CopyRows( const Matrix3& m, float* tm )
+    {
+        for( int r=0; r<4; ++r )
+        {
+            Point3 row = m.GetRow(r);
+            tm[r*3+0] = row.x;
+            tm[r*3+1] = row.y;
+            tm[r*3+2] = row.z;
+        }
+    }
+};
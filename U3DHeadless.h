@@ -0,0 +1,39 @@
+// Stand-ins for the Windows and Max SDK definitions used by the shared
+// headers (U3DFormat.h, U3DCore.h, U3DPca.h) in builds without the Max SDK.
+// Must be included first, with U3D_HEADLESS defined.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+typedef char TCHAR;
+typedef unsigned char BYTE;
+
+#define _T(x)       x
+#define _ftprintf   fprintf
+#define _tfopen     fopen
+#define _tremove    remove
+#define _ftscanf    fscanf
+#define _stscanf    sscanf
+#define _vsntprintf vsnprintf
+#define _stprintf   sprintf
+#define _tcslen     strlen
+#define _tcschr     strchr
+#define _tcsstr     strstr
+#define _tcscmp     strcmp
+#define _tcstod     strtod
+#define _fgetts     fgets
+#define _totlower   tolower
+#define _ttoi       atoi
+
+#include <time.h>
+
+// Milliseconds from a monotonic clock, wraps like the Windows one
+static unsigned int GetTickCount()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return static_cast<unsigned int>(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+}
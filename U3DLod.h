@@ -0,0 +1,457 @@
+/*======================================================================
+
+    Distance LODs of an animated mesh
+
+    FLodBuilder simplifies the triangles with half edge collapses: a vert
+    is merged into one of its neighbours, so every vert of a LOD is a
+    vert of the full mesh and its sampled frames are used as they are.
+
+    The error of a collapse is the quadric error (Garland & Heckbert)
+    summed over up to U3D_LOD_FRAMES frames spread over the whole clip,
+    so parts that only deform later in the animation are kept. Collapses
+    that would flip a triangle in any of those frames are skipped, border
+    and material seam verts only move along their border, and the link
+    condition keeps the surface manifold.
+
+    Reduce can be called again with smaller targets, each LOD continues
+    from the previous one.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_LOD_FRAMES      16          // frames the error is measured in
+#define U3D_LOD_MAXLODS     4
+#define U3D_LOD_EDGE        1e-3        // weight of the edge length term
+#define U3D_LOD_STEPS       4096        // collapses between cancel checks
+
+
+class FLodBuilder
+{
+    struct sTri
+    {
+        FJSMeshTri  Src;
+        bool        bAlive;
+    };
+
+    struct sEdge
+    {
+        int         V;
+        int         Count;              // triangles on the edge
+        int         Material;
+        bool        bMixed;             // triangles with different materials
+    };
+
+    struct sCandidate
+    {
+        float       Cost;
+        int         A;                  // collapses into B
+        int         B;
+        int         VersionA;
+        int         VersionB;
+
+    };
+
+    int                             VertCount;
+    int                             FrameCount;
+    int                             Frame;
+    int                             AliveTris;
+    std::vector<float>              Points;         // [frame][vert][3]
+    std::vector<double>             Quadrics;       // [vert][frame][10]
+    std::vector<sTri>               Tris;
+    std::vector< std::vector<int> > VertTris;
+    std::vector<int>                Version;
+    std::vector<int>                Mark;
+    int                             MarkId;
+    std::vector<sCandidate>         Queue;          // binary heap, cheapest first
+    std::vector<sEdge>              EdgesA, EdgesB;
+
+public:
+    float                           MaxCost;
+
+    FLodBuilder() : VertCount(0), FrameCount(0), Frame(0), AliveTris(0), MarkId(0), MaxCost(0)
+    {
+    }
+
+    // Vert indices of tris are in [0,vertcount), framecount frames follow
+    void Begin( const FJSMeshTri* tris, int tricount, int vertcount, int framecount )
+    {
+        VertCount = vertcount;
+        FrameCount = framecount;
+        Frame = 0;
+        AliveTris = tricount;
+        MaxCost = 0;
+        Points.assign(static_cast<size_t>(framecount)*vertcount*3+1,0.0f);
+        Quadrics.assign(static_cast<size_t>(vertcount)*framecount*10+1,0.0);
+        Tris.resize(tricount);
+        VertTris.assign(vertcount,std::vector<int>());
+        Version.assign(vertcount,0);
+        Mark.assign(vertcount,0);
+        MarkId = 0;
+        Queue.clear();
+
+        for( int t=0; t<tricount; ++t )
+        {
+            Tris[t].Src = tris[t];
+            Tris[t].bAlive = true;
+            for( int k=0; k<3; ++k )
+                VertTris[tris[t].iVertex[k]].push_back(t);
+        }
+    }
+
+    // XYZ per vert, one call per frame
+    void AddFrame( const float* points )
+    {
+        if( Frame >= FrameCount )
+            return;
+
+        memcpy(&Points[static_cast<size_t>(Frame)*VertCount*3],points,sizeof(float)*VertCount*3);
+        for( size_t t=0; t<Tris.size(); ++t )
+        {
+            const U_WORD* v = Tris[t].Src.iVertex;
+            const float* p0 = GetPoint(Frame,v[0]);
+            const float* p1 = GetPoint(Frame,v[1]);
+            const float* p2 = GetPoint(Frame,v[2]);
+            double n[3];
+            Normal(p0,p1,p2,n);
+            double len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            if( len == 0 )
+                continue;
+
+            // Plane weighted by area
+            double w = len * 0.5;
+            double a = n[0]/len, b = n[1]/len, c = n[2]/len;
+            double d = -(a*p0[0] + b*p0[1] + c*p0[2]);
+            double q[10] = { a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d };
+            for( int k=0; k<3; ++k )
+            {
+                double* dst = GetQuadric(v[k],Frame);
+                for( int i=0; i<10; ++i )
+                    dst[i] += q[i] * w;
+            }
+        }
+        ++Frame;
+    }
+
+    void End()
+    {
+        FrameCount = Frame;
+        for( size_t t=0; t<Tris.size(); ++t )
+        {
+            const U_WORD* v = Tris[t].Src.iVertex;
+            for( int k=0; k<3; ++k )
+            {
+                Push(v[k],v[(k+1)%3]);
+                Push(v[(k+1)%3],v[k]);
+            }
+        }
+    }
+
+    int GetTriCount() const
+    {
+        return AliveTris;
+    }
+
+    // Collapses until at most target tris are left, at most steps at a
+    // time so callers can poll for cancel. True when done.
+    bool Reduce( int target, int steps )
+    {
+        while( AliveTris > target && steps-- > 0 )
+        {
+            if( Queue.empty() )
+                return true;
+
+            sCandidate c = Pop();
+            if( Version[c.A] != c.VersionA || Version[c.B] != c.VersionB || !CanCollapse(c.A,c.B) )
+                continue;
+
+            Collapse(c.A,c.B);
+            MaxCost = c.Cost > MaxCost ? c.Cost : MaxCost;
+        }
+        return AliveTris <= target || Queue.empty();
+    }
+
+    // Surviving tris in their original order, verts keep their numbers
+    void GetTris( std::vector<FJSMeshTri>& out ) const
+    {
+        out.clear();
+        for( size_t t=0; t<Tris.size(); ++t )
+        {
+            if( Tris[t].bAlive )
+                out.push_back(Tris[t].Src);
+        }
+    }
+
+private:
+    const float* GetPoint( int f, int v ) const
+    {
+        return &Points[(static_cast<size_t>(f)*VertCount + v)*3];
+    }
+
+    double* GetQuadric( int v, int f )
+    {
+        return &Quadrics[(static_cast<size_t>(v)*FrameCount + f)*10];
+    }
+
+    static void Normal( const float* p0, const float* p1, const float* p2, double* n )
+    {
+        double e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+        double e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+        n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+        n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+        n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+    }
+
+    static bool HasVert( const sTri& t, int v )
+    {
+        return t.Src.iVertex[0] == v || t.Src.iVertex[1] == v || t.Src.iVertex[2] == v;
+    }
+
+    // Error of moving a onto b, summed over the frames
+    float Evaluate( int a, int b )
+    {
+        double cost = 0;
+        for( int f=0; f<FrameCount; ++f )
+        {
+            const double* qa = GetQuadric(a,f);
+            const double* qb = GetQuadric(b,f);
+            double q[10];
+            for( int i=0; i<10; ++i )
+                q[i] = qa[i] + qb[i];
+
+            const float* p = GetPoint(f,b);
+            double x = p[0], y = p[1], z = p[2];
+            cost += q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+                  + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+                  + q[7]*z*z + 2*q[8]*z
+                  + q[9];
+
+            // Flat areas cost nothing, short edges go first there so the
+            // remaining triangles stay even instead of fanning out
+            const float* pa = GetPoint(f,a);
+            double dx = x-pa[0], dy = y-pa[1], dz = z-pa[2];
+            double len = dx*dx + dy*dy + dz*dz;
+            cost += len * len * U3D_LOD_EDGE;
+        }
+        return static_cast<float>(cost > 0 ? cost : 0);
+    }
+
+    void Push( int a, int b )
+    {
+        if( a == b )
+            return;
+
+        sCandidate c;
+        c.Cost = Evaluate(a,b);
+        c.A = a;
+        c.B = b;
+        c.VersionA = Version[a];
+        c.VersionB = Version[b];
+
+        // Sift up
+        size_t i = Queue.size();
+        Queue.push_back(c);
+        for( ; i > 0 && Queue[(i-1)/2].Cost > c.Cost; i=(i-1)/2 )
+            Queue[i] = Queue[(i-1)/2];
+        Queue[i] = c;
+    }
+
+    sCandidate Pop()
+    {
+        sCandidate top = Queue[0];
+        sCandidate last = Queue.back();
+        Queue.pop_back();
+
+        // Sift down
+        size_t count = Queue.size();
+        size_t i = 0;
+        while( count > 0 )
+        {
+            size_t c = i*2+1;
+            if( c >= count )
+                break;
+            if( c+1 < count && Queue[c+1].Cost < Queue[c].Cost )
+                ++c;
+            if( Queue[c].Cost >= last.Cost )
+                break;
+            Queue[i] = Queue[c];
+            i = c;
+        }
+        if( count > 0 )
+            Queue[i] = last;
+        return top;
+    }
+
+    void GetEdges( int a, std::vector<sEdge>& edges ) const
+    {
+        edges.clear();
+        const std::vector<int>& tris = VertTris[a];
+        for( size_t i=0; i<tris.size(); ++i )
+        {
+            const FJSMeshTri& t = Tris[tris[i]].Src;
+            for( int k=0; k<3; ++k )
+            {
+                int v = t.iVertex[k];
+                if( v == a )
+                    continue;
+
+                size_t e = 0;
+                while( e < edges.size() && edges[e].V != v )
+                    ++e;
+                if( e == edges.size() )
+                {
+                    sEdge edge = { v, 0, t.TextureNum, false };
+                    edges.push_back(edge);
+                }
+                edges[e].Count++;
+                edges[e].bMixed = edges[e].bMixed || edges[e].Material != t.TextureNum;
+            }
+        }
+    }
+
+    static bool IsBorder( const sEdge& e )
+    {
+        return e.Count != 2 || e.bMixed;
+    }
+
+    bool CanCollapse( int a, int b )
+    {
+        GetEdges(a,EdgesA);
+        const sEdge* ab = NULL;
+        bool border = false;
+        for( size_t e=0; e<EdgesA.size(); ++e )
+        {
+            ab = EdgesA[e].V == b ? &EdgesA[e] : ab;
+            border = border || IsBorder(EdgesA[e]);
+        }
+
+        // Border verts only slide along their border
+        if( ab == NULL || (border && !IsBorder(*ab)) )
+            return false;
+
+        // Link condition, a and b share no neighbours but the ones on their edge
+        ++MarkId;
+        for( size_t e=0; e<EdgesA.size(); ++e )
+            Mark[EdgesA[e].V] = MarkId;
+        GetEdges(b,EdgesB);
+        int common = 0;
+        for( size_t e=0; e<EdgesB.size(); ++e )
+            common += Mark[EdgesB[e].V] == MarkId ? 1 : 0;
+        if( common > ab->Count )
+            return false;
+
+        // No triangle may flip in any frame
+        const std::vector<int>& tris = VertTris[a];
+        for( size_t i=0; i<tris.size(); ++i )
+        {
+            const FJSMeshTri& t = Tris[tris[i]].Src;
+            if( HasVert(Tris[tris[i]],b) )
+                continue;
+
+            for( int f=0; f<FrameCount; ++f )
+            {
+                const float* p[3];
+                const float* q[3];
+                for( int k=0; k<3; ++k )
+                {
+                    p[k] = GetPoint(f,t.iVertex[k]);
+                    q[k] = t.iVertex[k] == a ? GetPoint(f,b) : p[k];
+                }
+                double n0[3], n1[3];
+                Normal(p[0],p[1],p[2],n0);
+                Normal(q[0],q[1],q[2],n1);
+                if( n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] <= 0 )
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    void Collapse( int a, int b )
+    {
+        // Tris on the edge go away, their UVs tell where a's UVs move to
+        std::vector<FMeshUV> from, to;
+        std::vector<int>& tris = VertTris[a];
+        for( size_t i=0; i<tris.size(); ++i )
+        {
+            sTri& t = Tris[tris[i]];
+            if( !HasVert(t,b) )
+                continue;
+
+            int ka = 0, kb = 0;
+            for( int k=0; k<3; ++k )
+            {
+                ka = t.Src.iVertex[k] == a ? k : ka;
+                kb = t.Src.iVertex[k] == b ? k : kb;
+            }
+            from.push_back(t.Src.Tex[ka]);
+            to.push_back(t.Src.Tex[kb]);
+
+            t.bAlive = false;
+            --AliveTris;
+            for( int k=0; k<3; ++k )
+            {
+                int v = t.Src.iVertex[k];
+                if( v != a )
+                    Unlink(v,tris[i]);
+            }
+        }
+
+        for( size_t i=0; i<tris.size(); ++i )
+        {
+            sTri& t = Tris[tris[i]];
+            if( !t.bAlive )
+                continue;
+
+            for( int k=0; k<3; ++k )
+            {
+                if( t.Src.iVertex[k] != a )
+                    continue;
+
+                t.Src.iVertex[k] = static_cast<U_WORD>(b);
+                for( size_t u=0; u<from.size(); ++u )
+                {
+                    if( from[u].U == t.Src.Tex[k].U && from[u].V == t.Src.Tex[k].V )
+                    {
+                        t.Src.Tex[k] = to[u];
+                        break;
+                    }
+                }
+            }
+            VertTris[b].push_back(tris[i]);
+        }
+        std::vector<int>().swap(tris);
+
+        for( int f=0; f<FrameCount; ++f )
+        {
+            double* qa = GetQuadric(a,f);
+            double* qb = GetQuadric(b,f);
+            for( int i=0; i<10; ++i )
+                qb[i] += qa[i];
+        }
+        ++Version[a];
+        ++Version[b];
+
+        GetEdges(b,EdgesB);
+        for( size_t e=0; e<EdgesB.size(); ++e )
+        {
+            Push(b,EdgesB[e].V);
+            Push(EdgesB[e].V,b);
+        }
+    }
+
+    void Unlink( int v, int t )
+    {
+        std::vector<int>& tris = VertTris[v];
+        for( size_t i=0; i<tris.size(); ++i )
+        {
+            if( tris[i] == t )
+            {
+                tris[i] = tris.back();
+                tris.pop_back();
+                return;
+            }
+        }
+    }
+};
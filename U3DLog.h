@@ -0,0 +1,262 @@
+/*======================================================================
+
+    Export log
+
+    FLogWriter formats a line into a slot of a fixed ring buffer and
+    returns, a background thread writes the slots to the file. Slots are
+    reserved with a compare exchange, so the sampling and tracking loops
+    and the ParallelFor workers may log without taking a lock and
+    without waiting for the disk.
+
+    Lines below the level or outside the enabled categories cost one
+    test. Tracking lines are export output and pass the filter whatever
+    it is set to. When the writer falls behind lines are dropped and
+    counted, except tracking lines: they wait for room.
+
+========================================================================*/
+#include <process.h>
+
+class FLogWriter
+{
+public:
+    enum { Debug, Info, Warning, Error };
+
+    enum
+    {
+        General     = 1 << 0,
+        Scene       = 1 << 1,
+        Sample      = 1 << 2,
+        Memory      = 1 << 3,
+        Geometry    = 1 << 4,
+        Output      = 1 << 5,
+        Track       = 1 << 6,
+        All         = (1 << 7) - 1
+    };
+
+    // Binds a level and category, for writers that take anything with a
+    // Printf, like FCostAnalyzer::WriteLog
+    struct FChannel
+    {
+        FLogWriter* Log;
+        int         Level;
+        int         Category;
+
+        void Printf( const TCHAR* fmt, ... ) const
+        {
+            va_list args;
+            va_start(args,fmt);
+            Log->VPrintf(Level,Category,fmt,args);
+            va_end(args);
+        }
+    };
+
+private:
+    enum { SlotCount = 4096, LineSize = 256, FlushMs = 20 };
+
+    struct sSlot
+    {
+        volatile LONG   bReady;
+        TCHAR           Text[LineSize];
+    };
+
+    sSlot*          Slots;
+    volatile LONG   Head;           // next slot to fill
+    volatile LONG   Tail;           // next slot to write
+    volatile LONG   Draining;
+    FILE*           File;
+    HANDLE          hThread;
+    HANDLE          hStop;
+    int             Level;
+    int             Categories;
+    volatile LONG   Lines;
+    volatile LONG   Dropped;
+    ULONGLONG       Bytes;          // touched by the draining thread only
+
+public:
+    FLogWriter()
+    : Slots(NULL)
+    , Head(0)
+    , Tail(0)
+    , Draining(0)
+    , File(NULL)
+    , hThread(NULL)
+    , hStop(NULL)
+    , Level(Info)
+    , Categories(All)
+    , Lines(0)
+    , Dropped(0)
+    , Bytes(0)
+    {
+    }
+
+    ~FLogWriter()
+    {
+        Close();
+    }
+
+    bool Open( const TCHAR* path )
+    {
+        Close();
+        File = _tfopen(path,_T("wb"));
+        if( File == NULL )
+            return false;
+
+        Slots = new sSlot[SlotCount];
+        for( int i=0; i<SlotCount; ++i )
+            Slots[i].bReady = 0;
+        Head = Tail = Draining = 0;
+        Lines = Dropped = 0;
+        Bytes = 0;
+
+        // Without a writer thread lines are written by whoever logs
+        hStop = CreateEvent(NULL,TRUE,FALSE,NULL);
+        if( hStop != NULL )
+            hThread = reinterpret_cast<HANDLE>(_beginthreadex(NULL,0,WriterThread,this,0,NULL));
+        return true;
+    }
+
+    // Writes what is left and the volume and drop counters
+    void Close()
+    {
+        if( hThread != NULL )
+        {
+            SetEvent(hStop);
+            WaitForSingleObject(hThread,INFINITE);
+            CloseHandle(hThread);
+            hThread = NULL;
+        }
+        if( hStop != NULL )
+        {
+            CloseHandle(hStop);
+            hStop = NULL;
+        }
+        if( File != NULL )
+        {
+            Drain();
+            _ftprintf( File, _T("Log: %u lines, %u KB written, %u lines dropped\n")
+                , static_cast<unsigned>(Lines-Dropped), static_cast<unsigned>(Bytes/1024)
+                , static_cast<unsigned>(Dropped) );
+            fclose(File);
+            File = NULL;
+        }
+        delete[] Slots;
+        Slots = NULL;
+    }
+
+    void SetFilter( int level, int categories )
+    {
+        Level = level;
+        Categories = categories;
+    }
+
+    int GetLevel() const        { return Level; }
+    int GetCategories() const   { return Categories; }
+
+    // Tracking is output, not diagnostics, and is never filtered
+    bool IsEnabled( int level, int category ) const
+    {
+        return File != NULL && ((category & Track) != 0 || (level >= Level && (Categories & category) != 0));
+    }
+
+    FChannel Channel( int level, int category )
+    {
+        FChannel c = { this, level, category };
+        return c;
+    }
+
+    void Printf( int level, int category, const TCHAR* fmt, ... )
+    {
+        va_list args;
+        va_start(args,fmt);
+        VPrintf(level,category,fmt,args);
+        va_end(args);
+    }
+
+    void VPrintf( int level, int category, const TCHAR* fmt, va_list args )
+    {
+        if( IsEnabled(level,category) )
+            Append(category,fmt,args);
+    }
+
+    // Config names, lower case, NULL past the last category
+    static const TCHAR* GetCategoryName( int i )
+    {
+        static const TCHAR* names[] = { _T("general"), _T("scene"), _T("sample"), _T("memory"), _T("geometry"), _T("output"), _T("track"), NULL };
+        return i >= 0 && i < 8 ? names[i] : NULL;
+    }
+
+private:
+    void Append( int category, const TCHAR* fmt, va_list args )
+    {
+        LONG h;
+        for( ;; )
+        {
+            h = Head;
+            if( static_cast<ULONG>(h) - static_cast<ULONG>(Tail) >= SlotCount )
+            {
+                if( (category & Track) == 0 )
+                {
+                    InterlockedIncrement(&Lines);
+                    InterlockedIncrement(&Dropped);
+                    return;
+                }
+
+                if( hThread == NULL )
+                    Drain();
+                else
+                    Sleep(1);
+                continue;
+            }
+            if( InterlockedCompareExchange(&Head,h+1,h) == h )
+                break;
+        }
+
+        // Old CRTs return -1 and leave no terminator on truncation
+        sSlot& slot = Slots[static_cast<ULONG>(h) % SlotCount];
+        int len = _vsntprintf(slot.Text,LineSize,fmt,args);
+        if( len < 0 || len >= LineSize )
+        {
+            slot.Text[LineSize-2] = _T('\n');
+            slot.Text[LineSize-1] = 0;
+        }
+        InterlockedIncrement(&Lines);
+        InterlockedExchange(&slot.bReady,1);
+
+        if( hThread == NULL )
+            Drain();
+    }
+
+    // Writes ready slots in order, one thread at a time
+    void Drain()
+    {
+        if( InterlockedCompareExchange(&Draining,1,0) != 0 )
+            return;
+
+        bool wrote = false;
+        for( ;; )
+        {
+            sSlot& slot = Slots[static_cast<ULONG>(Tail) % SlotCount];
+            if( slot.bReady == 0 )
+                break;
+
+            _fputts(slot.Text,File);
+            Bytes += _tcslen(slot.Text)*sizeof(TCHAR);
+            InterlockedExchange(&slot.bReady,0);
+            InterlockedIncrement(&Tail);
+            wrote = true;
+        }
+
+        // Flushed per batch so the log survives a crash of Max
+        if( wrote )
+            fflush(File);
+        InterlockedExchange(&Draining,0);
+    }
+
+    static unsigned __stdcall WriterThread( void* arg )
+    {
+        FLogWriter* log = static_cast<FLogWriter*>(arg);
+        while( WaitForSingleObject(log->hStop,FlushMs) == WAIT_TIMEOUT )
+            log->Drain();
+        return 0;
+    }
+};
@@ -0,0 +1,277 @@
+/*======================================================================
+
+    Triangle order of an exported mesh
+
+    The engine switches texture state whenever TextureNum changes between
+    consecutive triangles, and node and face order interleaves them.
+    FTriOrder numbers the materials by name, groups the triangles by
+    TextureNum and orders each group for vertex cache reuse, greedily
+    picking the triangle whose verts score best in a simulated LRU cache
+    (Forsyth, "Linear-Speed Vertex Cache Optimisation").
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+#include <math.h>
+
+#define U3D_ORDER_CACHE     32          // simulated LRU cache entries
+#define U3D_ORDER_VALENCE   64          // valence boost table size
+
+
+class FTriOrder
+{
+    struct sVert
+    {
+        int     CachePos;       // -1 when not in the cache
+        int     Remaining;      // tris of the group not yet added
+        int     First;          // into Adjacent
+        int     Count;
+        float   Score;
+    };
+
+    std::vector<sVert>      Verts;
+    std::vector<int>        Adjacent;
+    std::vector<float>      TriScore;
+    std::vector<U_BYTE>     Added;
+    float                   CacheScore[U3D_ORDER_CACHE];
+    float                   ValenceScore[U3D_ORDER_VALENCE];
+
+public:
+    FTriOrder()
+    {
+        for( int i=0; i<U3D_ORDER_CACHE; ++i )
+        {
+            // The last three verts score the same, the tri using them was just drawn
+            CacheScore[i] = i < 3 ? 0.75f : static_cast<float>(pow(1.0 - (i-3)/static_cast<double>(U3D_ORDER_CACHE-3),1.5));
+        }
+        ValenceScore[0] = 0;
+        for( int i=1; i<U3D_ORDER_VALENCE; ++i )
+            ValenceScore[i] = 2.0f / static_cast<float>(sqrt(static_cast<double>(i)));
+    }
+
+    // remap[old] = new for count TextureNum slots, slots with a name first
+    // in name order, then the others in their old order. names[i] is NULL
+    // for slots without a material.
+    static void GetMaterialOrder( const TCHAR* const* names, int count, int* remap )
+    {
+        std::vector<int> order(count+1);
+        for( int i=0; i<count; ++i )
+        {
+            int j = i;
+            for( ; j>0 && IsBefore(names,i,order[j-1]); --j )
+                order[j] = order[j-1];
+            order[j] = i;
+        }
+        for( int i=0; i<count; ++i )
+            remap[order[i]] = i;
+    }
+
+    // Times TextureNum changes from one tri to the next
+    static int CountTransitions( const FJSMeshTri* tris, int count )
+    {
+        int transitions = 0;
+        for( int i=1; i<count; ++i )
+            transitions += tris[i].TextureNum != tris[i-1].TextureNum ? 1 : 0;
+        return transitions;
+    }
+
+    // Average verts per tri that miss a FIFO cache of the given size
+    static float GetMissRate( const FJSMeshTri* tris, int count, int vertcount, int cachesize )
+    {
+        if( count == 0 )
+            return 0;
+
+        std::vector<int> stamp(vertcount+1,-cachesize-1);
+        int misses = 0;
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+            {
+                int v = tris[i].iVertex[k];
+                if( misses - stamp[v] >= cachesize )
+                    stamp[v] = ++misses;
+            }
+        }
+        return static_cast<float>(misses) / count;
+    }
+
+    // order[new] = old, grouped by TextureNum, each group in cache order
+    void Order( const FJSMeshTri* tris, int count, int vertcount, int* order )
+    {
+        // Counting sort by TextureNum keeps the groups in face order
+        int start[257];
+        memset(start,0,sizeof(start));
+        for( int i=0; i<count; ++i )
+            ++start[tris[i].TextureNum+1];
+        for( int g=0; g<256; ++g )
+            start[g+1] += start[g];
+
+        std::vector<int> grouped(count+1);
+        int fill[256];
+        memcpy(fill,start,sizeof(fill));
+        for( int i=0; i<count; ++i )
+            grouped[fill[tris[i].TextureNum]++] = i;
+
+        Verts.resize(vertcount+1);
+        Adjacent.resize(count*3+1);
+        TriScore.resize(count+1);
+        Added.assign(count+1,0);
+        for( int g=0; g<256; ++g )
+        {
+            if( start[g+1] > start[g] )
+                OrderGroup(tris,&grouped[start[g]],start[g+1]-start[g],order+start[g]);
+        }
+    }
+
+private:
+    static bool IsBefore( const TCHAR* const* names, int a, int b )
+    {
+        if( names[a] == NULL || names[b] == NULL )
+            return names[a] != NULL && names[b] == NULL;
+        return _tcscmp(names[a],names[b]) < 0;
+    }
+
+    float GetVertScore( const sVert& v ) const
+    {
+        if( v.Remaining == 0 )
+            return -1;
+
+        float score = v.CachePos >= 0 ? CacheScore[v.CachePos] : 0;
+        return score + ValenceScore[v.Remaining < U3D_ORDER_VALENCE ? v.Remaining : U3D_ORDER_VALENCE-1];
+    }
+
+    void OrderGroup( const FJSMeshTri* tris, const int* list, int count, int* out )
+    {
+        // Adjacency of the verts this group uses
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+            {
+                sVert& v = Verts[tris[list[i]].iVertex[k]];
+                v.CachePos = -1;
+                v.Count = 0;
+            }
+        }
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+                ++Verts[tris[list[i]].iVertex[k]].Count;
+        }
+        int offset = 0;
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+            {
+                sVert& v = Verts[tris[list[i]].iVertex[k]];
+                if( v.CachePos == -1 )
+                {
+                    v.CachePos = -2;
+                    v.First = offset;
+                    offset += v.Count;
+                    v.Remaining = 0;
+                }
+            }
+        }
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+            {
+                sVert& v = Verts[tris[list[i]].iVertex[k]];
+                v.CachePos = -1;
+                Adjacent[v.First + v.Remaining++] = i;
+            }
+        }
+        for( int i=0; i<count; ++i )
+        {
+            for( int k=0; k<3; ++k )
+            {
+                sVert& v = Verts[tris[list[i]].iVertex[k]];
+                v.Score = GetVertScore(v);
+            }
+        }
+        for( int i=0; i<count; ++i )
+        {
+            const U_WORD* iv = tris[list[i]].iVertex;
+            TriScore[i] = Verts[iv[0]].Score + Verts[iv[1]].Score + Verts[iv[2]].Score;
+        }
+
+        int cache[U3D_ORDER_CACHE+3];
+        int cached = 0;
+        int next = 0;           // lowest tri that may not be added yet
+        int best = -1;
+        for( int n=0; n<count; ++n )
+        {
+            // Nothing in the cache has tris left, take the first one left
+            if( best < 0 )
+            {
+                while( Added[list[next]] )
+                    ++next;
+                best = next;
+            }
+
+            const U_WORD* iv = tris[list[best]].iVertex;
+            Added[list[best]] = 1;
+            out[n] = list[best];
+
+            // Tri verts go to the front, the rest move back in LRU order
+            int newcache[U3D_ORDER_CACHE+3];
+            int newcount = 0;
+            for( int k=0; k<3; ++k )
+            {
+                sVert& v = Verts[iv[k]];
+                if( k == 0 || (iv[k] != iv[0] && iv[k] != iv[k-1]) )
+                    newcache[newcount++] = iv[k];
+
+                // Drops the tri from the vert's list of remaining tris
+                int* adj = &Adjacent[v.First];
+                for( int j=0; j<v.Remaining; ++j )
+                {
+                    if( adj[j] == best )
+                    {
+                        adj[j] = adj[--v.Remaining];
+                        break;
+                    }
+                }
+            }
+            for( int j=0; j<cached; ++j )
+            {
+                int v = cache[j];
+                if( v != iv[0] && v != iv[1] && v != iv[2] )
+                    newcache[newcount++] = v;
+            }
+
+            // Rescore what moved, the tris of those verts follow
+            cached = newcount < U3D_ORDER_CACHE ? newcount : U3D_ORDER_CACHE;
+            for( int j=0; j<newcount; ++j )
+            {
+                sVert& v = Verts[newcache[j]];
+                v.CachePos = j < U3D_ORDER_CACHE ? j : -1;
+                float score = GetVertScore(v);
+                float delta = score - v.Score;
+                v.Score = score;
+                for( int a=0; a<v.Remaining; ++a )
+                    TriScore[Adjacent[v.First+a]] += delta;
+                if( j < U3D_ORDER_CACHE )
+                    cache[j] = newcache[j];
+            }
+
+            // Best tri left among the cached verts
+            best = -1;
+            float bestscore = -1;
+            for( int j=0; j<cached; ++j )
+            {
+                const sVert& v = Verts[cache[j]];
+                for( int a=0; a<v.Remaining; ++a )
+                {
+                    int t = Adjacent[v.First+a];
+                    if( TriScore[t] > bestscore )
+                    {
+                        bestscore = TriScore[t];
+                        best = t;
+                    }
+                }
+            }
+        }
+    }
+};
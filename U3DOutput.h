@@ -0,0 +1,467 @@
+/*======================================================================
+
+    Content hashed output files
+
+    Outputs are written to a temp file next to the target and hashed
+    while they are generated. On Commit the hash is compared with the
+    manifest stored next to the outputs (<name>.u3dhash): unchanged files
+    are left untouched so their timestamps stay, changed files replace
+    the target atomically. A failed export never leaves a truncated file.
+    Exports with several outputs stage them in an FOutStage and commit
+    them together after the last write, so a failed or cancelled export
+    leaves all previous outputs untouched.
+    Big writes are split into chunks that check the cancel token, see
+    U3DCancel.h.
+
+========================================================================*/
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <io.h>
+typedef unsigned __int64 U_QWORD;
+#else
+typedef unsigned long long U_QWORD;
+#endif
+
+typedef std::basic_string<TCHAR> FString;
+
+#define U3D_FNV_BASIS   ((static_cast<U_QWORD>(0xCBF29CE4) << 32) | 0x84222325)
+#define U3D_FNV_PRIME   ((static_cast<U_QWORD>(0x00000100) << 32) | 0x000001B3)
+
+// 64 bit FNV-1a
+static U_QWORD HashBytes( U_QWORD hash, const void* data, size_t size )
+{
+    const U_BYTE* p = static_cast<const U_BYTE*>(data);
+    for( size_t i=0; i<size; ++i )
+    {
+        hash ^= p[i];
+        hash *= U3D_FNV_PRIME;
+    }
+    return hash;
+}
+
+// File name without directory, manifests stay valid if the folder moves
+static FString BaseName( const FString& path )
+{
+    size_t s = path.find_last_of(_T("\\/"));
+    return s == FString::npos ? path : path.substr(s+1);
+}
+
+static bool ReplaceFile( const FString& from, const FString& to )
+{
+#ifdef _WIN32
+    return MoveFileEx(from.c_str(),to.c_str(),MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) != FALSE;
+#else
+    return rename(from.c_str(),to.c_str()) == 0;
+#endif
+}
+
+// 64 bit, outputs past 4 GB must not look changed every time
+static bool GetFileSize( const FString& path, U_QWORD& size )
+{
+    FILE* f = _tfopen(path.c_str(),_T("rb"));
+    if( !f )
+        return false;
+#ifdef _MSC_VER
+    size = static_cast<U_QWORD>(_filelengthi64(_fileno(f)));
+#else
+    fseeko(f,0,SEEK_END);
+    size = static_cast<U_QWORD>(ftello(f));
+#endif
+    fclose(f);
+    return true;
+}
+
+// Hashes a file the way FOutFile hashes what it writes
+static bool GetFileHash( const FString& path, U_QWORD& hash )
+{
+    FILE* f = _tfopen(path.c_str(),_T("rb"));
+    if( !f )
+        return false;
+
+    U_BYTE buf[65536];
+    size_t len;
+    hash = U3D_FNV_BASIS;
+    while( (len = fread(buf,1,sizeof(buf),f)) > 0 )
+        hash = HashBytes(hash,buf,len);
+    bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
+
+
+// Hash and size of every output, one "hash size name" line per file with
+// hash and size as 16 hex digits and the name up to the end of the line
+class FOutManifest
+{
+    struct sEntry
+    {
+        FString Name;
+        U_QWORD Hash;
+        U_QWORD Size;
+    };
+
+    FString             Path;
+    std::vector<sEntry> Entries;
+    bool                bDirty;
+
+public:
+    FOutManifest() : bDirty(false)
+    {
+    }
+
+    void Load( const TCHAR* path )
+    {
+        Path = path;
+        Entries.clear();
+        bDirty = false;
+
+        FILE* f = _tfopen(path,_T("rb"));
+        if( !f )
+            return;
+
+        // Names may have spaces, they run to the end of the line
+        TCHAR line[1024+40];
+        while( _fgetts(line,sizeof(line)/sizeof(TCHAR),f) )
+        {
+            unsigned hi, lo, sizehi, sizelo;
+            int name = 0;
+            if( _stscanf(line,_T("%8x%8x %8x%8x %n"),&hi,&lo,&sizehi,&sizelo,&name) != 4 || name == 0 )
+                continue;
+
+            size_t len = _tcslen(line);
+            while( len > static_cast<size_t>(name) && (line[len-1] == _T('\n') || line[len-1] == _T('\r')) )
+                --len;
+
+            sEntry e;
+            e.Name = FString(line+name,line+len);
+            e.Hash = (static_cast<U_QWORD>(hi) << 32) | lo;
+            e.Size = (static_cast<U_QWORD>(sizehi) << 32) | sizelo;
+            Entries.push_back(e);
+        }
+        fclose(f);
+    }
+
+    bool Find( const FString& name, U_QWORD& hash, U_QWORD& size ) const
+    {
+        for( size_t i=0; i<Entries.size(); ++i )
+        {
+            if( Entries[i].Name == name )
+            {
+                hash = Entries[i].Hash;
+                size = Entries[i].Size;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Set( const FString& name, U_QWORD hash, U_QWORD size )
+    {
+        bDirty = true;
+        for( size_t i=0; i<Entries.size(); ++i )
+        {
+            if( Entries[i].Name == name )
+            {
+                Entries[i].Hash = hash;
+                Entries[i].Size = size;
+                return;
+            }
+        }
+
+        sEntry e;
+        e.Name = name;
+        e.Hash = hash;
+        e.Size = size;
+        Entries.push_back(e);
+    }
+
+    // Written like the outputs, through a temp file
+    bool Save()
+    {
+        if( !bDirty || Path.empty() )
+            return true;
+
+        FString temp = Path + _T(".tmp");
+        FILE* f = _tfopen(temp.c_str(),_T("wb"));
+        if( !f )
+            return false;
+
+        for( size_t i=0; i<Entries.size(); ++i )
+        {
+            const sEntry& e = Entries[i];
+            _ftprintf( f, _T("%08x%08x %08x%08x %s\n")
+                , static_cast<unsigned>(e.Hash >> 32), static_cast<unsigned>(e.Hash)
+                , static_cast<unsigned>(e.Size >> 32), static_cast<unsigned>(e.Size), e.Name.c_str() );
+        }
+
+        bool ok = fclose(f) == 0 && ReplaceFile(temp,Path);
+        if( !ok )
+            _tremove(temp.c_str());
+        bDirty = !ok;
+        return ok;
+    }
+};
+
+
+class FOutStage;
+
+class FOutFile
+{
+public:
+    enum EResult
+    {
+        Failed,
+        Written,
+        Unchanged
+    };
+
+protected:
+    FILE*       File;
+    FString     Path;
+    FString     TempPath;
+    U_QWORD     Hash;
+    U_QWORD     Size;
+    bool        bError;
+    FCancelToken* Cancel;
+
+public:
+    FOutFile() : File(NULL), Hash(U3D_FNV_BASIS), Size(0), bError(false), Cancel(NULL)
+    {
+    }
+
+    ~FOutFile()
+    {
+        Abort();
+    }
+
+    bool Open( const TCHAR* path )
+    {
+        Abort();
+        Path = path;
+        TempPath = Path + _T(".tmp");
+        Hash = U3D_FNV_BASIS;
+        Size = 0;
+        bError = false;
+        File = _tfopen(TempPath.c_str(),_T("wb"));
+        return File != NULL;
+    }
+
+    bool IsOpen() const
+    {
+        return File != NULL;
+    }
+
+    // Writes fail once the token is cancelled, kept across Open
+    void SetCancel( FCancelToken* token )
+    {
+        Cancel = token;
+    }
+
+    bool Write( const void* data, size_t size )
+    {
+        const U_BYTE* p = static_cast<const U_BYTE*>(data);
+        while( File != NULL && !bError )
+        {
+            if( U3DPollCancel(Cancel) )
+            {
+                bError = true;
+                break;
+            }
+
+            size_t chunk = size < U3D_CANCEL_CHUNK ? size : U3D_CANCEL_CHUNK;
+            Hash = HashBytes(Hash,p,chunk);
+            Size += chunk;
+            if( chunk > 0 && fwrite(p,chunk,1,File) != 1 )
+                bError = true;
+
+            p += chunk;
+            size -= chunk;
+            if( size == 0 )
+                return !bError;
+        }
+        return false;
+    }
+
+    bool Printf( const TCHAR* fmt, ... )
+    {
+        TCHAR stackbuf[1024];
+        std::vector<TCHAR> heapbuf;
+        TCHAR* buf = stackbuf;
+        int size = sizeof(stackbuf)/sizeof(TCHAR);
+
+        // Old CRTs return -1 on truncation, grow until it fits
+        for( ;; )
+        {
+            va_list args;
+            va_start(args,fmt);
+            int len = _vsntprintf(buf,size,fmt,args);
+            va_end(args);
+
+            if( len >= 0 && len < size )
+                return Write(buf,len*sizeof(TCHAR));
+
+            size *= 4;
+            heapbuf.resize(size);
+            buf = &heapbuf[0];
+        }
+    }
+
+    // Moves the temp file over the target unless the content is the same
+    // as last time and the target still holds it
+    EResult Commit( FOutManifest& manifest )
+    {
+        if( !Close() )
+            return Failed;
+        return Replace(manifest,Path,TempPath,Hash,Size);
+    }
+
+    // Closes the temp file and leaves it to the stage, which commits it
+    // along with the other outputs of the export
+    bool Stage( FOutStage& stage, int tag=0 );
+
+    static EResult Replace( FOutManifest& manifest, const FString& path, const FString& temppath, U_QWORD hash, U_QWORD size )
+    {
+        FString name = BaseName(path);
+        // The target is hashed too, a sync or another export may have put
+        // different bytes of the same size there
+        U_QWORD oldhash, oldsize, disksize, diskhash;
+        if( manifest.Find(name,oldhash,oldsize) && oldhash == hash && oldsize == size
+        &&  GetFileSize(path,disksize) && disksize == size
+        &&  GetFileHash(path,diskhash) && diskhash == hash )
+        {
+            _tremove(temppath.c_str());
+            return Unchanged;
+        }
+
+        if( !ReplaceFile(temppath,path) )
+        {
+            _tremove(temppath.c_str());
+            return Failed;
+        }
+
+        manifest.Set(name,hash,size);
+        return Written;
+    }
+
+    // Drops the temp file, the target is not touched
+    void Abort()
+    {
+        if( File != NULL )
+        {
+            fclose(File);
+            File = NULL;
+            _tremove(TempPath.c_str());
+        }
+    }
+
+protected:
+    // Keeps the temp file only if everything was written
+    bool Close()
+    {
+        if( File == NULL )
+            return false;
+
+        bool ok = fclose(File) == 0 && !bError;
+        File = NULL;
+        if( !ok )
+            _tremove(TempPath.c_str());
+        return ok;
+    }
+};
+
+
+// Finished outputs of one export, waiting for the last one
+class FOutStage
+{
+    struct sStaged
+    {
+        FString Path;
+        FString TempPath;
+        U_QWORD Hash;
+        U_QWORD Size;
+        int     Tag;
+    };
+
+    std::vector<sStaged> Staged;
+
+public:
+    int                 Written;
+    int                 Unchanged;
+    FString             FailedPath;     // first output Commit could not replace
+    int                 FailedTag;
+
+    FOutStage() : Written(0), Unchanged(0), FailedTag(0)
+    {
+    }
+
+    ~FOutStage()
+    {
+        Abort();
+    }
+
+    void Add( const FString& path, const FString& temppath, U_QWORD hash, U_QWORD size, int tag )
+    {
+        sStaged s;
+        s.Path = path;
+        s.TempPath = temppath;
+        s.Hash = hash;
+        s.Size = size;
+        s.Tag = tag;
+        Staged.push_back(s);
+    }
+
+    int GetCount() const
+    {
+        return static_cast<int>(Staged.size());
+    }
+
+    // Replaces the targets that changed. The others are still committed
+    // when one fails, FailedPath and FailedTag tell which.
+    bool Commit( FOutManifest& manifest )
+    {
+        bool ok = true;
+        for( size_t i=0; i<Staged.size(); ++i )
+        {
+            const sStaged& s = Staged[i];
+            switch( FOutFile::Replace(manifest,s.Path,s.TempPath,s.Hash,s.Size) )
+            {
+                case FOutFile::Written:
+                    ++Written;
+                    break;
+
+                case FOutFile::Unchanged:
+                    ++Unchanged;
+                    break;
+
+                default:
+                    if( ok )
+                    {
+                        FailedPath = s.Path;
+                        FailedTag = s.Tag;
+                    }
+                    ok = false;
+                    break;
+            }
+        }
+        Staged.clear();
+        return ok;
+    }
+
+    // Drops the staged temp files, the targets are not touched
+    void Abort()
+    {
+        for( size_t i=0; i<Staged.size(); ++i )
+            _tremove(Staged[i].TempPath.c_str());
+        Staged.clear();
+    }
+};
+
+inline bool FOutFile::Stage( FOutStage& stage, int tag )
+{
+    if( !Close() )
+        return false;
+    stage.Add(Path,TempPath,Hash,Size,tag);
+    return true;
+}
@@ -0,0 +1,544 @@
+/*======================================================================
+
+    Lossless archive of _a.3d files
+
+    Packed frames change little from one frame to the next, so every
+    11, 11 and 10 bit field is stored as the difference to the same field
+    of the previous frame. The first frame of a block is predicted from
+    the previous vert instead, which keeps blocks independent: any frame
+    range decodes on its own and blocks decode in parallel.
+
+    Differences are zigzag mapped and Rice coded in groups of
+    U3D_PACK_GROUP values sharing one parameter, groups of zeros (verts
+    that do not move) take 4 bits. Large values escape to raw bits, so a
+    block is never much bigger than its source.
+
+    Restore gives back the source byte for byte, header, frames and any
+    trailing bytes. Files that are not well formed are stored raw. The
+    _d.3d can be stored along, it is small and kept as is.
+
+    File layout:
+        FPackHeader
+        FPackBlock  [NumBlocks]
+        U_BYTE      [RawSize]           trailing bytes, or the whole file
+        U_BYTE      [DataSize]          _d.3d
+        U_BYTE      []                  blocks
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_PACK_MAGIC      0x5A443355  // "U3DZ"
+#define U3D_PACK_VERSION    1
+#define U3D_PACK_BLOCK      16          // frames per block, unit of random access
+#define U3D_PACK_GROUP      32          // values sharing one Rice parameter
+#define U3D_PACK_ZEROS      15          // parameter of an all zero group
+#define U3D_PACK_ESCAPE     16          // unary length that escapes to raw bits
+
+#pragma pack(push,1)
+struct FPackHeader
+{
+    U_DWORD Magic;
+    U_DWORD Version;
+    U_DWORD NumFrames;      // as in FJSAnivHeader, 0 for raw files
+    U_DWORD FrameSize;
+    U_DWORD BlockFrames;
+    U_DWORD NumBlocks;
+    U_DWORD RawSize;
+    U_DWORD DataSize;
+    U_QWORD SourceSize;
+    U_QWORD SourceHash;     // HashBytes of the _a.3d
+    U_QWORD DataHash;
+
+    FPackHeader()
+    : Magic(U3D_PACK_MAGIC)
+    , Version(U3D_PACK_VERSION)
+    , NumFrames(0)
+    , FrameSize(0)
+    , BlockFrames(U3D_PACK_BLOCK)
+    , NumBlocks(0)
+    , RawSize(0)
+    , DataSize(0)
+    , SourceSize(0)
+    , SourceHash(U3D_FNV_BASIS)
+    , DataHash(U3D_FNV_BASIS)
+    {
+    }
+};
+
+struct FPackBlock
+{
+    U_QWORD Offset;         // from the start of the file
+    U_DWORD Size;
+};
+#pragma pack(pop)
+
+
+// Field layout of FMeshVert, see U3DUnpack
+static const int PackShift[3] = { 0, 11, 22 };
+static const int PackBits[3] = { 11, 11, 10 };
+
+struct FPackBitWriter
+{
+    std::vector<U_BYTE>&    Out;
+    U_QWORD                 Acc;
+    int                     Count;
+
+    FPackBitWriter( std::vector<U_BYTE>& out ) : Out(out), Acc(0), Count(0)
+    {
+    }
+
+    void Put( U_DWORD v, int n )
+    {
+        Acc |= static_cast<U_QWORD>(v) << Count;
+        Count += n;
+        while( Count >= 8 )
+        {
+            Out.push_back(static_cast<U_BYTE>(Acc));
+            Acc >>= 8;
+            Count -= 8;
+        }
+    }
+
+    void Flush()
+    {
+        if( Count > 0 )
+            Out.push_back(static_cast<U_BYTE>(Acc));
+        Acc = 0;
+        Count = 0;
+    }
+};
+
+// Reads zeros past the end, Overrun tells if any of them were used.
+// Fill tops up to at least 56 bits, Get and GetUnary do not refill.
+struct FPackBitReader
+{
+    const U_BYTE*   P;
+    const U_BYTE*   End;
+    U_QWORD         Acc;
+    int             Count;
+    U_QWORD         Used;
+    U_QWORD         Avail;
+
+    FPackBitReader( const U_BYTE* p, size_t size )
+    : P(p), End(p+size), Acc(0), Count(0), Used(0), Avail(static_cast<U_QWORD>(size)*8)
+    {
+    }
+
+    void Fill()
+    {
+        // Bits above Count are the next bytes, or-ing them again is harmless
+        if( End - P >= 8 )
+        {
+            U_QWORD w;
+            memcpy(&w,P,sizeof(w));
+            Acc |= w << Count;
+            P += (63 - Count) >> 3;
+            Count |= 56;
+            return;
+        }
+
+        while( Count <= 56 )
+        {
+            U_QWORD b = P < End ? *P++ : 0;
+            Acc |= b << Count;
+            Count += 8;
+        }
+    }
+
+    U_DWORD Get( int n )
+    {
+        U_DWORD v = static_cast<U_DWORD>(Acc & ((static_cast<U_QWORD>(1) << n) - 1));
+        Acc >>= n;
+        Count -= n;
+        Used += n;
+        return v;
+    }
+
+    // Ones before the first zero, at most U3D_PACK_ESCAPE
+    int GetUnary()
+    {
+        int q = 0;
+        while( q < U3D_PACK_ESCAPE && (Acc >> q) & 1 )
+            ++q;
+        int n = q < U3D_PACK_ESCAPE ? q+1 : q;
+        Acc >>= n;
+        Count -= n;
+        Used += n;
+        return q;
+    }
+
+    bool Overrun() const
+    {
+        return Used > Avail;
+    }
+};
+
+
+// Zigzag of the wrapped difference, fits in bits
+inline U_DWORD PackDelta( U_DWORD cur, U_DWORD pred, int bits )
+{
+    U_DWORD mask = (1u << bits) - 1;
+    U_DWORD d = (cur - pred) & mask;
+    int sd = d > (mask >> 1) ? static_cast<int>(d) - static_cast<int>(mask+1) : static_cast<int>(d);
+    return sd >= 0 ? static_cast<U_DWORD>(sd) << 1 : (static_cast<U_DWORD>(-sd) << 1) - 1;
+}
+
+inline U_DWORD UnpackDelta( U_DWORD zig, U_DWORD pred, int bits )
+{
+    U_DWORD mask = (1u << bits) - 1;
+    U_DWORD d = zig & 1 ? ~(zig >> 1) : zig >> 1;
+    return (pred + d) & mask;
+}
+
+// Rice parameter with the fewest bits, searched around the mean
+static int PackGetParam( const U_DWORD* v, int count, int bits )
+{
+    U_QWORD sum = 0;
+    for( int i=0; i<count; ++i )
+        sum += v[i];
+    if( sum == 0 )
+        return U3D_PACK_ZEROS;
+
+    int mean = 0;
+    while( (sum / count) >> mean )
+        ++mean;
+
+    int best = 0;
+    U_QWORD bestcost = ~static_cast<U_QWORD>(0);
+    for( int k=(mean > 1 ? mean-2 : 0); k<=mean && k<bits; ++k )
+    {
+        U_QWORD cost = 0;
+        for( int i=0; i<count; ++i )
+        {
+            U_DWORD q = v[i] >> k;
+            cost += q < U3D_PACK_ESCAPE ? q+1+k : U3D_PACK_ESCAPE+bits;
+        }
+        if( cost < bestcost )
+        {
+            bestcost = cost;
+            best = k;
+        }
+    }
+    return best;
+}
+
+
+class FAnivPacker
+{
+public:
+    FPackHeader     Header;
+
+private:
+    const U_BYTE*   Source;
+    const U_BYTE*   Data;
+    int             Verts;
+
+public:
+    FAnivPacker() : Source(NULL), Data(NULL), Verts(0)
+    {
+    }
+
+    // Buffers must outlive the packer
+    void Init( const U_BYTE* aniv, size_t size, const U_BYTE* data, size_t datasize, int blockframes )
+    {
+        Header = FPackHeader();
+        Source = aniv;
+        Data = data;
+        Header.SourceSize = size;
+        Header.SourceHash = HashBytes(U3D_FNV_BASIS,aniv,size);
+        Header.DataSize = static_cast<U_DWORD>(datasize);
+        Header.DataHash = HashBytes(U3D_FNV_BASIS,data,datasize);
+        Header.BlockFrames = blockframes > 0 ? blockframes : U3D_PACK_BLOCK;
+
+        FJSAnivHeader h;
+        bool valid = size >= sizeof(FJSAnivHeader);
+        if( valid )
+        {
+            memcpy(&h,aniv,sizeof(h));
+            valid = h.FrameSize % sizeof(FMeshVert) == 0
+                 && sizeof(h) + static_cast<U_QWORD>(h.NumFrames)*h.FrameSize <= size;
+        }
+
+        if( valid && h.NumFrames > 0 && h.FrameSize > 0 )
+        {
+            Header.NumFrames = h.NumFrames;
+            Header.FrameSize = h.FrameSize;
+            Header.NumBlocks = (h.NumFrames + Header.BlockFrames-1) / Header.BlockFrames;
+            Header.RawSize = static_cast<U_DWORD>(size - sizeof(h) - static_cast<U_QWORD>(h.NumFrames)*h.FrameSize);
+            Verts = h.FrameSize / sizeof(FMeshVert);
+        }
+        else
+        {
+            Header.RawSize = static_cast<U_DWORD>(size);
+            Verts = 0;
+        }
+    }
+
+    int GetBlockCount() const
+    {
+        return Header.NumBlocks;
+    }
+
+    // Blocks do not depend on each other, callers may encode them in parallel
+    void EncodeBlock( int b, std::vector<U_BYTE>& out ) const
+    {
+        out.clear();
+        int first = b * static_cast<int>(Header.BlockFrames);
+        int last = first + static_cast<int>(Header.BlockFrames);
+        last = last < static_cast<int>(Header.NumFrames) ? last : static_cast<int>(Header.NumFrames);
+        const U_BYTE* frames = Source + sizeof(FJSAnivHeader);
+
+        FPackBitWriter w(out);
+        U_DWORD group[U3D_PACK_GROUP];
+        for( int a=0; a<3; ++a )
+        {
+            int shift = PackShift[a];
+            int bits = PackBits[a];
+            U_DWORD mask = (1u << bits) - 1;
+            int n = 0;
+            for( int t=first; t<last; ++t )
+            {
+                const U_BYTE* cur = frames + static_cast<size_t>(t)*Header.FrameSize;
+                const U_BYTE* prev = cur - Header.FrameSize;
+                for( int i=0; i<Verts; ++i )
+                {
+                    U_DWORD v = (GetVert(cur,i) >> shift) & mask;
+                    U_DWORD p = t > first ? (GetVert(prev,i) >> shift) & mask
+                                          : (i > 0 ? (GetVert(cur,i-1) >> shift) & mask : 0);
+                    group[n++] = PackDelta(v,p,bits);
+                    if( n == U3D_PACK_GROUP )
+                    {
+                        PutGroup(w,group,n,bits);
+                        n = 0;
+                    }
+                }
+            }
+            if( n > 0 )
+                PutGroup(w,group,n,bits);
+        }
+        w.Flush();
+    }
+
+    bool Write( FOutFile& f, const std::vector< std::vector<U_BYTE> >& blocks ) const
+    {
+        std::vector<FPackBlock> table(Header.NumBlocks);
+        U_QWORD offset = sizeof(FPackHeader) + sizeof(FPackBlock)*table.size() + Header.RawSize + Header.DataSize;
+        for( size_t b=0; b<table.size(); ++b )
+        {
+            table[b].Offset = offset;
+            table[b].Size = static_cast<U_DWORD>(blocks[b].size());
+            offset += blocks[b].size();
+        }
+
+        bool ok = f.Write(&Header,sizeof(Header))
+               && (table.empty() || f.Write(&table[0],sizeof(FPackBlock)*table.size()))
+               && f.Write(Source+Header.SourceSize-Header.RawSize,Header.RawSize)
+               && f.Write(Data,Header.DataSize);
+        for( size_t b=0; ok && b<blocks.size(); ++b )
+            ok = blocks[b].empty() || f.Write(&blocks[b][0],blocks[b].size());
+        return ok;
+    }
+
+private:
+    static U_DWORD GetVert( const U_BYTE* frame, int i )
+    {
+        U_DWORD v;
+        memcpy(&v,frame+i*sizeof(U_DWORD),sizeof(v));
+        return v;
+    }
+
+    static void PutGroup( FPackBitWriter& w, const U_DWORD* v, int count, int bits )
+    {
+        int k = PackGetParam(v,count,bits);
+        w.Put(k,4);
+        if( k == U3D_PACK_ZEROS )
+            return;
+
+        for( int i=0; i<count; ++i )
+        {
+            U_DWORD q = v[i] >> k;
+            if( q < U3D_PACK_ESCAPE )
+            {
+                w.Put((1u << q) - 1,q+1);
+                w.Put(v[i] & ((1u << k) - 1),k);
+            }
+            else
+            {
+                w.Put((1u << U3D_PACK_ESCAPE) - 1,U3D_PACK_ESCAPE);
+                w.Put(v[i],bits);
+            }
+        }
+    }
+};
+
+
+class FAnivUnpacker
+{
+public:
+    FPackHeader     Header;
+
+private:
+    const U_BYTE*   File;
+    size_t          FileSize;
+    const FPackBlock* Blocks;
+    int             Verts;
+
+public:
+    FAnivUnpacker() : File(NULL), FileSize(0), Blocks(NULL), Verts(0)
+    {
+    }
+
+    // Checks the header and block table, the buffer must outlive the unpacker
+    bool Open( const U_BYTE* file, size_t size )
+    {
+        File = file;
+        FileSize = size;
+        if( size < sizeof(FPackHeader) )
+            return false;
+
+        memcpy(&Header,file,sizeof(Header));
+        if( Header.Magic != U3D_PACK_MAGIC || Header.Version != U3D_PACK_VERSION || Header.BlockFrames == 0 )
+            return false;
+
+        Verts = Header.FrameSize / sizeof(FMeshVert);
+        U_QWORD table = sizeof(FPackHeader) + static_cast<U_QWORD>(Header.NumBlocks)*sizeof(FPackBlock);
+        if( Header.NumBlocks != (Header.NumFrames + Header.BlockFrames-1) / Header.BlockFrames
+        ||  table + Header.RawSize + Header.DataSize > size )
+            return false;
+
+        Blocks = reinterpret_cast<const FPackBlock*>(file+sizeof(FPackHeader));
+        for( U_DWORD b=0; b<Header.NumBlocks; ++b )
+        {
+            FPackBlock block;
+            memcpy(&block,Blocks+b,sizeof(block));
+            if( block.Offset > size || block.Size > size - block.Offset )
+                return false;
+        }
+        return true;
+    }
+
+    int GetBlockCount() const
+    {
+        return Header.NumBlocks;
+    }
+
+    int GetVertCount() const
+    {
+        return Verts;
+    }
+
+    const U_BYTE* GetData() const
+    {
+        return File + sizeof(FPackHeader) + sizeof(FPackBlock)*Header.NumBlocks + Header.RawSize;
+    }
+
+    bool CheckData() const
+    {
+        return HashBytes(U3D_FNV_BASIS,GetData(),Header.DataSize) == Header.DataHash;
+    }
+
+    // Writes the frames of block b to their place in frames, which holds
+    // the clip from frame base on. Blocks may be decoded in parallel.
+    bool DecodeBlock( int b, FMeshVert* frames, int base = 0 ) const
+    {
+        FPackBlock block;
+        memcpy(&block,Blocks+b,sizeof(block));
+        int first = b * static_cast<int>(Header.BlockFrames);
+        int last = first + static_cast<int>(Header.BlockFrames);
+        last = last < static_cast<int>(Header.NumFrames) ? last : static_cast<int>(Header.NumFrames);
+
+        U_DWORD* out = reinterpret_cast<U_DWORD*>(frames);
+        FPackBitReader r(File+block.Offset,block.Size);
+        for( int a=0; a<3; ++a )
+        {
+            int shift = PackShift[a];
+            int bits = PackBits[a];
+            U_DWORD mask = (1u << bits) - 1;
+            int k = 0;
+            int n = 0;
+            for( int t=first; t<last; ++t )
+            {
+                U_DWORD* cur = out + static_cast<size_t>(t-base)*Verts;
+                const U_DWORD* prev = cur - Verts;
+                for( int i=0; i<Verts; ++i )
+                {
+                    if( n == 0 )
+                    {
+                        r.Fill();
+                        k = r.Get(4);
+                    }
+                    n = n+1 < U3D_PACK_GROUP ? n+1 : 0;
+
+                    U_DWORD zig = 0;
+                    if( k != U3D_PACK_ZEROS )
+                    {
+                        r.Fill();
+                        int q = r.GetUnary();
+                        zig = q < U3D_PACK_ESCAPE ? (static_cast<U_DWORD>(q) << k) | r.Get(k) : r.Get(bits);
+                    }
+
+                    U_DWORD p = t > first ? (prev[i] >> shift) & mask
+                                          : (i > 0 ? (cur[i-1] >> shift) & mask : 0);
+                    U_DWORD v = UnpackDelta(zig,p,bits) << shift;
+                    cur[i] = a == 0 ? v : cur[i] | v;
+                }
+            }
+        }
+        return !r.Overrun();
+    }
+
+    // Random access, decodes only the blocks holding the range
+    bool ReadFrames( int first, int count, FMeshVert* out ) const
+    {
+        if( first < 0 || count < 0 || first+count > static_cast<int>(Header.NumFrames) )
+            return false;
+        if( count == 0 )
+            return true;
+
+        int b0 = first / Header.BlockFrames;
+        int b1 = (first+count-1) / Header.BlockFrames;
+        int base = b0 * Header.BlockFrames;
+        std::vector<FMeshVert> frames(static_cast<size_t>(b1-b0+1)*Header.BlockFrames*Verts+1);
+        for( int b=b0; b<=b1; ++b )
+        {
+            if( !DecodeBlock(b,&frames[0],base) )
+                return false;
+        }
+        memcpy(out,&frames[static_cast<size_t>(first-base)*Verts],sizeof(FMeshVert)*count*Verts);
+        return true;
+    }
+
+    // Source file from decoded frames, checked against the stored hash
+    bool Restore( const FMeshVert* frames, std::vector<U_BYTE>& aniv ) const
+    {
+        const U_BYTE* raw = File + sizeof(FPackHeader) + sizeof(FPackBlock)*Header.NumBlocks;
+        aniv.clear();
+        if( Header.NumFrames > 0 )
+        {
+            FJSAnivHeader h;
+            h.NumFrames = static_cast<U_WORD>(Header.NumFrames);
+            h.FrameSize = static_cast<U_WORD>(Header.FrameSize);
+            const U_BYTE* p = reinterpret_cast<const U_BYTE*>(&h);
+            aniv.insert(aniv.end(),p,p+sizeof(h));
+            p = reinterpret_cast<const U_BYTE*>(frames);
+            aniv.insert(aniv.end(),p,p+static_cast<size_t>(Header.NumFrames)*Header.FrameSize);
+        }
+        aniv.insert(aniv.end(),raw,raw+Header.RawSize);
+
+        return aniv.size() == Header.SourceSize
+            && HashBytes(U3D_FNV_BASIS,aniv.empty() ? NULL : &aniv[0],aniv.size()) == Header.SourceHash;
+    }
+
+    bool Restore( std::vector<U_BYTE>& aniv ) const
+    {
+        std::vector<FMeshVert> frames(static_cast<size_t>(Header.NumFrames)*Verts+1);
+        for( int b=0; b<GetBlockCount(); ++b )
+        {
+            if( !DecodeBlock(b,&frames[0]) )
+                return false;
+        }
+        return Restore(&frames[0],aniv);
+    }
+};
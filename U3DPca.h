@@ -0,0 +1,599 @@
+/*======================================================================
+
+    PCA compressed vertex animation archive
+
+    Stores the sampled vertex positions as a mean shape plus a truncated
+    orthonormal basis of per-frame displacements:
+
+        frame[t] = Mean + sum( Coeffs[t][j] * Basis[j] )
+
+    The basis is grown until every coordinate of every frame is within
+    Tolerance of the source, so most clips need a few dozen vectors
+    instead of one full frame per sample.
+
+    Encoder is streaming: it pulls frames from an FPcaFrameSource one at
+    a time and makes a few passes, only Mean, Basis and Coeffs are kept.
+    Each pulled frame checks the optional cancel token.
+
+    File layout:
+        FPcaHeader
+        FJSMeshTri  [NumPolys]
+        float       [NumVertices*3]                 Mean
+        float       [NumBasis][NumVertices*3]       Basis
+        float       [NumFrames][NumBasis]           Coeffs
+
+========================================================================*/
+#include <vector>
+
+#define U3D_PCA_MAGIC       0x50443355  // "U3DP"
+#define U3D_PCA_VERSION     1
+#define U3D_PCA_BLOCK       8           // basis vectors added per pass
+#define U3D_PCA_MAXBASIS    512
+
+#pragma pack(push,1)
+struct FPcaHeader
+{
+    U_DWORD Magic;
+    U_DWORD Version;
+    U_DWORD NumVertices;
+    U_DWORD NumFrames;
+    U_DWORD NumBasis;
+    U_DWORD NumPolys;
+    U_FLOAT Tolerance;      // requested max error per coordinate
+    U_FLOAT MaxError;       // achieved max error per coordinate
+
+    FPcaHeader()
+    : Magic(U3D_PCA_MAGIC)
+    , Version(U3D_PCA_VERSION)
+    , NumVertices(0)
+    , NumFrames(0)
+    , NumBasis(0)
+    , NumPolys(0)
+    , Tolerance(0)
+    , MaxError(0)
+    {
+    }
+};
+#pragma pack(pop)
+
+
+// Supplies frames to the encoder, frame layout is X,Y,Z per vertex
+class FPcaFrameSource
+{
+public:
+    virtual ~FPcaFrameSource() {}
+    virtual int GetFrameCount() = 0;
+    virtual int GetVertCount() = 0;
+    virtual void GetFrame( int t, float* out ) = 0;
+};
+
+
+// out[i] += s0*b0[i] + s1*b1[i] + s2*b2[i] + s3*b3[i]
+static void PcaAddScaled4( float* out, int n
+    , const float* b0, float s0, const float* b1, float s1
+    , const float* b2, float s2, const float* b3, float s3 )
+{
+    int i = 0;
+#ifdef U3D_SSE
+    __m128 v0 = _mm_set1_ps(s0);
+    __m128 v1 = _mm_set1_ps(s1);
+    __m128 v2 = _mm_set1_ps(s2);
+    __m128 v3 = _mm_set1_ps(s3);
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(b0+i),v0),_mm_mul_ps(_mm_loadu_ps(b1+i),v1));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(b2+i),v2),_mm_mul_ps(_mm_loadu_ps(b3+i),v3));
+        _mm_storeu_ps(out+i,_mm_add_ps(_mm_loadu_ps(out+i),_mm_add_ps(a,b)));
+    }
+#endif
+    for( ; i<n; ++i )
+    {
+        out[i] += s0*b0[i] + s1*b1[i] + s2*b2[i] + s3*b3[i];
+    }
+}
+
+// out[i] += s*b[i]
+static void PcaAddScaled( float* out, int n, const float* b, float s )
+{
+    int i = 0;
+#ifdef U3D_SSE
+    __m128 v = _mm_set1_ps(s);
+    for( ; i+4<=n; i+=4 )
+    {
+        _mm_storeu_ps(out+i,_mm_add_ps(_mm_loadu_ps(out+i),_mm_mul_ps(_mm_loadu_ps(b+i),v)));
+    }
+#endif
+    for( ; i<n; ++i )
+    {
+        out[i] += s*b[i];
+    }
+}
+
+static double PcaDot( const float* a, const float* b, int n )
+{
+    double d = 0;
+    for( int i=0; i<n; ++i )
+        d += static_cast<double>(a[i])*b[i];
+    return d;
+}
+
+static float PcaMaxAbs( const float* a, int n )
+{
+    float m = 0;
+    for( int i=0; i<n; ++i )
+    {
+        float v = a[i] < 0 ? -a[i] : a[i];
+        if( v > m )
+            m = v;
+    }
+    return m;
+}
+
+// Deterministic +1/-1 test vector entry for the range sketch
+static float PcaSign( int frame, int col, int pass )
+{
+    U_DWORD h = static_cast<U_DWORD>(frame)*0x9E3779B1u ^ static_cast<U_DWORD>(col)*0x85EBCA77u ^ static_cast<U_DWORD>(pass)*0xC2B2AE3Du;
+    h ^= h >> 15; h *= 0x2C1B3C6Du;
+    h ^= h >> 12; h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return (h & 1) ? 1.0f : -1.0f;
+}
+
+// Cyclic Jacobi eigen decomposition of symmetric n*n matrix a, row major.
+// Eigenvalues end up on the diagonal of a, eigenvectors in columns of v.
+static void PcaJacobi( std::vector<double>& a, std::vector<double>& v, int n )
+{
+    v.assign(n*n,0.0);
+    for( int i=0; i<n; ++i )
+        v[i*n+i] = 1.0;
+
+    for( int sweep=0; sweep<64; ++sweep )
+    {
+        double off = 0;
+        double diag = 0;
+        for( int p=0; p<n; ++p )
+        {
+            diag += a[p*n+p]*a[p*n+p];
+            for( int q=p+1; q<n; ++q )
+                off += a[p*n+q]*a[p*n+q];
+        }
+        if( off <= 1e-24*diag || off == 0 )
+            break;
+
+        for( int p=0; p<n; ++p )
+        {
+            for( int q=p+1; q<n; ++q )
+            {
+                double apq = a[p*n+q];
+                if( apq == 0 )
+                    continue;
+
+                double theta = (a[q*n+q]-a[p*n+p]) / (2*apq);
+                double t = 1.0 / (fabs(theta) + sqrt(theta*theta+1));
+                if( theta < 0 )
+                    t = -t;
+                double c = 1.0 / sqrt(t*t+1);
+                double s = t*c;
+
+                for( int k=0; k<n; ++k )
+                {
+                    double akp = a[k*n+p];
+                    double akq = a[k*n+q];
+                    a[k*n+p] = c*akp - s*akq;
+                    a[k*n+q] = s*akp + c*akq;
+                }
+                for( int k=0; k<n; ++k )
+                {
+                    double apk = a[p*n+k];
+                    double aqk = a[q*n+k];
+                    a[p*n+k] = c*apk - s*aqk;
+                    a[q*n+k] = s*apk + c*aqk;
+                }
+                for( int k=0; k<n; ++k )
+                {
+                    double vkp = v[k*n+p];
+                    double vkq = v[k*n+q];
+                    v[k*n+p] = c*vkp - s*vkq;
+                    v[k*n+q] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+}
+
+
+class FPcaEncoder
+{
+public:
+    FPcaHeader          Header;
+    std::vector<float>  Mean;
+    std::vector<float>  Basis;
+    std::vector<float>  Coeffs;
+
+protected:
+    FPcaFrameSource&    Source;
+    FCancelToken*       Cancel;
+    int                 Dim;
+    int                 MaxBasis;
+    std::vector<float>  Frame;
+    std::vector<float>  Resid;
+
+public:
+    // tolerance <= 0 picks a quarter of the 11/11/10 quantization step
+    FPcaEncoder( FPcaFrameSource& source, float tolerance, int maxbasis=U3D_PCA_MAXBASIS, FCancelToken* cancel=NULL )
+    : Source(source)
+    , Cancel(cancel)
+    , Dim(source.GetVertCount()*3)
+    , MaxBasis(maxbasis)
+    {
+        Header.NumVertices = source.GetVertCount();
+        Header.NumFrames = source.GetFrameCount();
+        Header.Tolerance = tolerance;
+        Frame.resize(Dim);
+        Resid.resize(Dim);
+    }
+
+    // False when cancelled
+    bool Encode()
+    {
+        int frames = Header.NumFrames;
+        if( !GetMean() )
+            return false;
+
+        // Grow the basis from sketches of the residual until the error
+        // bound holds, each pass measures error and sketches the next block
+        int k = 0;
+        int limit = MaxBasis;
+        if( limit > frames ) limit = frames;
+        if( limit > Dim ) limit = Dim;
+
+        std::vector<float> sketch;
+        for( int pass=0; ; ++pass )
+        {
+            int block = limit-k < U3D_PCA_BLOCK ? limit-k : U3D_PCA_BLOCK;
+            sketch.assign(static_cast<size_t>(block)*Dim,0.0f);
+
+            float maxerr = 0;
+            for( int t=0; t<frames; ++t )
+            {
+                if( !GetResidual(t,k) )
+                    return false;
+                float err = PcaMaxAbs(&Resid[0],Dim);
+                if( err > maxerr )
+                    maxerr = err;
+
+                for( int j=0; j<block; ++j )
+                    PcaAddScaled(&sketch[j*Dim],Dim,&Resid[0],PcaSign(t,j,pass));
+            }
+
+            Header.MaxError = maxerr;
+            if( maxerr <= Header.Tolerance || block == 0 )
+                break;
+
+            int added = AddBasis(sketch,block,k);
+            if( added == 0 )
+                break;
+            k += added;
+        }
+
+        Header.NumBasis = k;
+        if( !GetCoeffs() )
+            return false;
+        SortBasis();
+        return Truncate();
+    }
+
+    // Archive size in bytes, without the triangles
+    size_t GetSize() const
+    {
+        return sizeof(FPcaHeader) + (Mean.size() + Basis.size() + Coeffs.size())*sizeof(float);
+    }
+
+    bool Write( FOutFile& f, const FJSMeshTri* tris, int tricount )
+    {
+        Header.NumPolys = tricount;
+        bool ok = f.Write(&Header,sizeof(FPcaHeader));
+        if( ok && tricount > 0 )
+            ok = f.Write(tris,sizeof(FJSMeshTri)*tricount);
+        if( ok )
+            ok = f.Write(&Mean[0],sizeof(float)*Mean.size());
+        if( ok && !Basis.empty() )
+            ok = f.Write(&Basis[0],sizeof(float)*Basis.size());
+        if( ok && !Coeffs.empty() )
+            ok = f.Write(&Coeffs[0],sizeof(float)*Coeffs.size());
+        return ok;
+    }
+
+protected:
+    bool GetFrame( int t )
+    {
+        if( U3DPollCancel(Cancel) )
+            return false;
+        Source.GetFrame(t,&Frame[0]);
+        return true;
+    }
+
+    bool GetMean()
+    {
+        int frames = Header.NumFrames;
+        std::vector<double> sum(Dim,0.0);
+        float mn[3] = { 0,0,0 };
+        float mx[3] = { 0,0,0 };
+
+        for( int t=0; t<frames; ++t )
+        {
+            if( !GetFrame(t) )
+                return false;
+            for( int i=0; i<Dim; ++i )
+            {
+                float v = Frame[i];
+                int a = i%3;
+                sum[i] += v;
+                if( (t == 0 && i < 3) || v < mn[a] ) mn[a] = v;
+                if( (t == 0 && i < 3) || v > mx[a] ) mx[a] = v;
+            }
+        }
+
+        Mean.resize(Dim);
+        for( int i=0; i<Dim; ++i )
+            Mean[i] = static_cast<float>(sum[i]/frames);
+
+        // See FMeshVert, X and Y get 11 bits and Z gets 10
+        if( Header.Tolerance <= 0 )
+        {
+            float step[3] = { (mx[0]-mn[0])/2046.0f, (mx[1]-mn[1])/2046.0f, (mx[2]-mn[2])/1022.0f };
+            float s = step[0];
+            if( step[1] > 0 && (s <= 0 || step[1] < s) ) s = step[1];
+            if( step[2] > 0 && (s <= 0 || step[2] < s) ) s = step[2];
+            Header.Tolerance = s > 0 ? 0.25f*s : 1e-6f;
+        }
+        return true;
+    }
+
+    // Resid = frame - mean - projection onto the first k basis vectors
+    bool GetResidual( int t, int k )
+    {
+        if( !GetFrame(t) )
+            return false;
+        for( int i=0; i<Dim; ++i )
+            Resid[i] = Frame[i] - Mean[i];
+
+        // Modified Gram-Schmidt projection, stable with float basis
+        for( int j=0; j<k; ++j )
+        {
+            const float* b = &Basis[static_cast<size_t>(j)*Dim];
+            PcaAddScaled(&Resid[0],Dim,b,-static_cast<float>(PcaDot(b,&Resid[0],Dim)));
+        }
+        return true;
+    }
+
+    // Orthonormalize sketch columns against the basis and append them
+    int AddBasis( std::vector<float>& sketch, int block, int k )
+    {
+        int added = 0;
+        for( int j=0; j<block; ++j )
+        {
+            float* s = &sketch[static_cast<size_t>(j)*Dim];
+            double norm0 = sqrt(PcaDot(s,s,Dim));
+            if( norm0 == 0 )
+                continue;
+
+            // Second pass restores orthogonality lost to float rounding
+            for( int pass=0; pass<2; ++pass )
+            {
+                for( int i=0; i<k+added; ++i )
+                {
+                    const float* b = &Basis[static_cast<size_t>(i)*Dim];
+                    PcaAddScaled(s,Dim,b,-static_cast<float>(PcaDot(b,s,Dim)));
+                }
+            }
+
+            double norm = sqrt(PcaDot(s,s,Dim));
+            if( norm <= 1e-5*norm0 )
+                continue;
+
+            float inv = static_cast<float>(1.0/norm);
+            size_t base = Basis.size();
+            Basis.resize(base+Dim);
+            for( int i=0; i<Dim; ++i )
+                Basis[base+i] = s[i]*inv;
+            ++added;
+        }
+        return added;
+    }
+
+    bool GetCoeffs()
+    {
+        int k = Header.NumBasis;
+        Coeffs.assign(static_cast<size_t>(Header.NumFrames)*k,0.0f);
+        for( int t=0; t<static_cast<int>(Header.NumFrames); ++t )
+        {
+            if( !GetFrame(t) )
+                return false;
+            for( int i=0; i<Dim; ++i )
+                Resid[i] = Frame[i] - Mean[i];
+
+            for( int j=0; j<k; ++j )
+                Coeffs[static_cast<size_t>(t)*k+j] = static_cast<float>(PcaDot(&Basis[static_cast<size_t>(j)*Dim],&Resid[0],Dim));
+        }
+        return true;
+    }
+
+    // Rotate basis so vectors are ordered by the energy they carry,
+    // eigenvectors of Coeffs^T*Coeffs give the rotation
+    void SortBasis()
+    {
+        int k = Header.NumBasis;
+        int frames = Header.NumFrames;
+        if( k < 2 )
+            return;
+
+        std::vector<double> cov(k*k,0.0);
+        for( int t=0; t<frames; ++t )
+        {
+            const float* c = &Coeffs[static_cast<size_t>(t)*k];
+            for( int a=0; a<k; ++a )
+                for( int b=a; b<k; ++b )
+                    cov[a*k+b] += static_cast<double>(c[a])*c[b];
+        }
+        for( int a=0; a<k; ++a )
+            for( int b=0; b<a; ++b )
+                cov[a*k+b] = cov[b*k+a];
+
+        std::vector<double> rot;
+        PcaJacobi(cov,rot,k);
+
+        // Selection sort of eigenvalues, descending
+        std::vector<int> order(k);
+        for( int i=0; i<k; ++i )
+            order[i] = i;
+        for( int i=0; i<k; ++i )
+        {
+            int best = i;
+            for( int j=i+1; j<k; ++j )
+                if( cov[order[j]*k+order[j]] > cov[order[best]*k+order[best]] )
+                    best = j;
+            int tmp = order[i]; order[i] = order[best]; order[best] = tmp;
+        }
+
+        std::vector<float> basis(Basis.size(),0.0f);
+        for( int j=0; j<k; ++j )
+        {
+            float* out = &basis[static_cast<size_t>(j)*Dim];
+            for( int i=0; i<k; ++i )
+                PcaAddScaled(out,Dim,&Basis[static_cast<size_t>(i)*Dim],static_cast<float>(rot[i*k+order[j]]));
+        }
+        Basis.swap(basis);
+
+        std::vector<float> row(k);
+        for( int t=0; t<frames; ++t )
+        {
+            float* c = &Coeffs[static_cast<size_t>(t)*k];
+            for( int j=0; j<k; ++j )
+            {
+                double v = 0;
+                for( int i=0; i<k; ++i )
+                    v += c[i]*rot[i*k+order[j]];
+                row[j] = static_cast<float>(v);
+            }
+            for( int j=0; j<k; ++j )
+                c[j] = row[j];
+        }
+    }
+
+    // Drop trailing vectors that are not needed to meet the tolerance
+    bool Truncate()
+    {
+        int k = Header.NumBasis;
+        int frames = Header.NumFrames;
+        std::vector<float> err(k+1,0.0f);
+
+        for( int t=0; t<frames; ++t )
+        {
+            if( !GetFrame(t) )
+                return false;
+            for( int i=0; i<Dim; ++i )
+                Resid[i] = Frame[i] - Mean[i];
+
+            const float* c = &Coeffs[static_cast<size_t>(t)*k];
+            for( int j=0; j<=k; ++j )
+            {
+                if( j > 0 )
+                    PcaAddScaled(&Resid[0],Dim,&Basis[static_cast<size_t>(j-1)*Dim],-c[j-1]);
+                float e = PcaMaxAbs(&Resid[0],Dim);
+                if( e > err[j] )
+                    err[j] = e;
+            }
+        }
+
+        int keep = k;
+        for( int j=0; j<=k; ++j )
+        {
+            if( err[j] <= Header.Tolerance )
+            {
+                keep = j;
+                break;
+            }
+        }
+        Header.MaxError = err[keep];
+        if( keep == k )
+            return true;
+
+        Basis.resize(static_cast<size_t>(keep)*Dim);
+        for( int t=0; t<frames; ++t )
+        {
+            for( int j=0; j<keep; ++j )
+                Coeffs[static_cast<size_t>(t)*keep+j] = Coeffs[static_cast<size_t>(t)*k+j];
+        }
+        Coeffs.resize(static_cast<size_t>(frames)*keep);
+        Header.NumBasis = keep;
+        return true;
+    }
+};
+
+
+class FPcaDecoder
+{
+public:
+    FPcaHeader              Header;
+    std::vector<FJSMeshTri> Tris;
+    std::vector<float>      Mean;
+    std::vector<float>      Basis;
+    std::vector<float>      Coeffs;
+
+public:
+    bool Read( FILE* f )
+    {
+        if( fread(&Header,sizeof(FPcaHeader),1,f) != 1
+        ||  Header.Magic != U3D_PCA_MAGIC
+        ||  Header.Version != U3D_PCA_VERSION )
+            return false;
+
+        size_t dim = static_cast<size_t>(Header.NumVertices)*3;
+        Tris.resize(Header.NumPolys);
+        Mean.resize(dim);
+        Basis.resize(dim*Header.NumBasis);
+        Coeffs.resize(static_cast<size_t>(Header.NumFrames)*Header.NumBasis);
+
+        if( !Tris.empty() && fread(&Tris[0],sizeof(FJSMeshTri),Tris.size(),f) != Tris.size() )
+            return false;
+        if( !Mean.empty() && fread(&Mean[0],sizeof(float),Mean.size(),f) != Mean.size() )
+            return false;
+        if( !Basis.empty() && fread(&Basis[0],sizeof(float),Basis.size(),f) != Basis.size() )
+            return false;
+        if( !Coeffs.empty() && fread(&Coeffs[0],sizeof(float),Coeffs.size(),f) != Coeffs.size() )
+            return false;
+        return true;
+    }
+
+    // Reconstructs frame t into out, NumVertices*3 floats
+    void DecodeFrame( int t, float* out ) const
+    {
+        int dim = Header.NumVertices*3;
+        int k = Header.NumBasis;
+        if( dim == 0 )
+            return;
+
+        memcpy(out,&Mean[0],dim*sizeof(float));
+
+        const float* c = k > 0 ? &Coeffs[static_cast<size_t>(t)*k] : NULL;
+        int j = 0;
+        for( ; j+4<=k; j+=4 )
+        {
+            const float* b = &Basis[static_cast<size_t>(j)*dim];
+            PcaAddScaled4(out,dim,b,c[j],b+dim,c[j+1],b+2*dim,c[j+2],b+3*dim,c[j+3]);
+        }
+        for( ; j<k; ++j )
+        {
+            PcaAddScaled(out,dim,&Basis[static_cast<size_t>(j)*dim],c[j]);
+        }
+    }
+
+    // Reconstructs all frames, same layout as the exporter's Points
+    void DecodeAll( float* out ) const
+    {
+        int dim = Header.NumVertices*3;
+        for( int t=0; t<static_cast<int>(Header.NumFrames); ++t )
+            DecodeFrame(t,out+static_cast<size_t>(t)*dim);
+    }
+};
@@ -0,0 +1,246 @@
+/*======================================================================
+
+    Playback of exported meshes outside the engine
+
+    FMeshPlayer loads a _d.3d / _a.3d pair and the ORIGIN, SCALE and
+    SEQUENCE lines of the _rc.uc script, and evaluates the mesh the way
+    the engine does: packed 11/11/10 verts are sign extended, two frames
+    are blended, and the result is mapped back with
+
+        v = (packed - Origin) * Scale
+
+    Output is structure of arrays, one float array per axis, which suits
+    the batch callers (hitbox baking, thumbnails, validation). Rotation
+    from ORIGIN PITCH/YAW/ROLL is not applied, the exporter writes 0.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+class FMeshPlayer
+{
+public:
+    struct FSequence
+    {
+        FString     Name;
+        int         Start;
+        int         NumFrames;
+        float       Rate;           // frames per second
+    };
+
+    // One evaluation of a batch. Seq -1 takes Time as a fractional frame
+    // of the anim file, otherwise as seconds into that sequence.
+    struct FInstance
+    {
+        int         Seq;
+        float       Time;
+        bool        bLoop;
+        float*      X;
+        float*      Y;
+        float*      Z;
+    };
+
+    FJSDataHeader               Data;
+    std::vector<FJSMeshTri>     Tris;
+    std::vector<FSequence>      Seqs;
+    int                         NumFrames;
+    int                         NumVerts;
+    int                         FrameStride;    // verts per frame in the file
+    float                       Origin[3];
+    float                       Scale[3];
+
+private:
+    std::vector<FMeshVert>      Frames;
+
+public:
+    FMeshPlayer() : NumFrames(0), NumVerts(0), FrameStride(0)
+    {
+        for( int a=0; a<3; ++a )
+        {
+            Origin[a] = 0;
+            Scale[a] = 1;
+        }
+    }
+
+    // Script is optional, without it verts stay in packed units
+    bool Load( const TCHAR* datapath, const TCHAR* anivpath, const TCHAR* scriptpath )
+    {
+        FILE* f = _tfopen(datapath,_T("rb"));
+        if( f == NULL )
+            return false;
+
+        bool ok = fread(&Data,sizeof(Data),1,f) == 1;
+        Tris.resize(ok ? Data.NumPolys : 0);
+        ok = ok && (Tris.empty() || fread(&Tris[0],sizeof(FJSMeshTri)*Tris.size(),1,f) == 1);
+        fclose(f);
+        if( !ok )
+            return false;
+
+        f = _tfopen(anivpath,_T("rb"));
+        if( f == NULL )
+            return false;
+
+        FJSAnivHeader h;
+        ok = fread(&h,sizeof(h),1,f) == 1 && h.FrameSize >= Data.NumVertices*sizeof(FMeshVert);
+        NumFrames = ok ? h.NumFrames : 0;
+        NumVerts = Data.NumVertices;
+        FrameStride = h.FrameSize / sizeof(FMeshVert);
+        Frames.resize(static_cast<size_t>(NumFrames)*FrameStride+1);
+        ok = ok && (NumFrames == 0 || FrameStride == 0
+                 || fread(&Frames[0],sizeof(FMeshVert)*NumFrames*FrameStride,1,f) == 1);
+        fclose(f);
+
+        return ok && (scriptpath == NULL || LoadScript(scriptpath));
+    }
+
+    bool LoadScript( const TCHAR* path )
+    {
+        FILE* f = _tfopen(path,_T("rb"));
+        if( f == NULL )
+            return false;
+
+        TCHAR line[1024];
+        while( _fgetts(line,1024,f) )
+        {
+            if( _tcsstr(line,_T("#exec MESH ORIGIN ")) == line )
+            {
+                Origin[0] = GetFloat(line,_T(" X="),0);
+                Origin[1] = GetFloat(line,_T(" Y="),0);
+                Origin[2] = GetFloat(line,_T(" Z="),0);
+            }
+            else if( _tcsstr(line,_T("#exec MESH SCALE ")) == line )
+            {
+                Scale[0] = GetFloat(line,_T(" X="),1);
+                Scale[1] = GetFloat(line,_T(" Y="),1);
+                Scale[2] = GetFloat(line,_T(" Z="),1);
+            }
+            else if( _tcsstr(line,_T("#exec MESH SEQUENCE ")) == line )
+            {
+                FSequence seq;
+                const TCHAR* name = _tcsstr(line,_T(" SEQ="));
+                if( name == NULL )
+                    continue;
+
+                name += 5;
+                int len = 0;
+                while( name[len] != 0 && name[len] != _T(' ') && name[len] != _T('\r') && name[len] != _T('\n') )
+                    ++len;
+                seq.Name.assign(name,len);
+                seq.Start = static_cast<int>(GetFloat(line,_T(" STARTFRAME="),0));
+                seq.NumFrames = static_cast<int>(GetFloat(line,_T(" NUMFRAMES="),1));
+                seq.Rate = GetFloat(line,_T(" RATE="),30);
+                Seqs.push_back(seq);
+            }
+        }
+        fclose(f);
+        return true;
+    }
+
+    int FindSequence( const TCHAR* name ) const
+    {
+        for( size_t s=0; s<Seqs.size(); ++s )
+        {
+            if( Seqs[s].Name == name )
+                return static_cast<int>(s);
+        }
+        return -1;
+    }
+
+    // Frames to blend for a time into a sequence. Looping sequences blend
+    // from their last frame back to the first, others hold the last one.
+    void GetFrames( int s, float seconds, bool loop, int& a, int& b, float& alpha ) const
+    {
+        const FSequence& seq = Seqs[s];
+        int count = seq.NumFrames > 0 ? seq.NumFrames : 1;
+        float pos = seconds * seq.Rate;
+        if( loop )
+        {
+            pos = fmodf(pos,static_cast<float>(count));
+            pos = pos < 0 ? pos + count : pos;
+        }
+        else
+        {
+            pos = pos < 0 ? 0 : (pos > count-1 ? static_cast<float>(count-1) : pos);
+        }
+
+        int i = static_cast<int>(pos);
+        i = i < count ? i : count-1;
+        alpha = pos - i;
+        a = seq.Start + i;
+        b = i+1 < count ? a+1 : (loop ? seq.Start : a);
+    }
+
+    // Blended frame, alpha 0 gives frame a
+    void Blend( int a, int b, float alpha, float* x, float* y, float* z ) const
+    {
+        a = ClampFrame(a);
+        b = ClampFrame(b);
+        const FMeshVert* fa = &Frames[static_cast<size_t>(a)*FrameStride];
+        const FMeshVert* fb = &Frames[static_cast<size_t>(b)*FrameStride];
+
+        int i = 0;
+#ifdef U3D_SSE2
+        __m128 w = _mm_set1_ps(alpha);
+        __m128 ox = _mm_set1_ps(Origin[0]), oy = _mm_set1_ps(Origin[1]), oz = _mm_set1_ps(Origin[2]);
+        __m128 sx = _mm_set1_ps(Scale[0]), sy = _mm_set1_ps(Scale[1]), sz = _mm_set1_ps(Scale[2]);
+        for( ; i+4 <= NumVerts; i+=4 )
+        {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fa+i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fb+i));
+            __m128 xa = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(va,21),21));
+            __m128 xb = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(vb,21),21));
+            __m128 ya = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(va,10),21));
+            __m128 yb = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(vb,10),21));
+            __m128 za = _mm_cvtepi32_ps(_mm_srai_epi32(va,22));
+            __m128 zb = _mm_cvtepi32_ps(_mm_srai_epi32(vb,22));
+            _mm_storeu_ps(x+i,_mm_mul_ps(_mm_sub_ps(_mm_add_ps(xa,_mm_mul_ps(_mm_sub_ps(xb,xa),w)),ox),sx));
+            _mm_storeu_ps(y+i,_mm_mul_ps(_mm_sub_ps(_mm_add_ps(ya,_mm_mul_ps(_mm_sub_ps(yb,ya),w)),oy),sy));
+            _mm_storeu_ps(z+i,_mm_mul_ps(_mm_sub_ps(_mm_add_ps(za,_mm_mul_ps(_mm_sub_ps(zb,za),w)),oz),sz));
+        }
+#endif
+        for( ; i<NumVerts; ++i )
+        {
+            float ua[3], ub[3];
+            U3DUnpack(fa[i],ua);
+            U3DUnpack(fb[i],ub);
+            x[i] = (ua[0] + (ub[0]-ua[0])*alpha - Origin[0]) * Scale[0];
+            y[i] = (ua[1] + (ub[1]-ua[1])*alpha - Origin[1]) * Scale[1];
+            z[i] = (ua[2] + (ub[2]-ua[2])*alpha - Origin[2]) * Scale[2];
+        }
+    }
+
+    void Evaluate( const FInstance* instances, int count ) const
+    {
+        for( int n=0; n<count; ++n )
+        {
+            const FInstance& inst = instances[n];
+            int a, b;
+            float alpha;
+            if( inst.Seq >= 0 && inst.Seq < static_cast<int>(Seqs.size()) )
+            {
+                GetFrames(inst.Seq,inst.Time,inst.bLoop,a,b,alpha);
+            }
+            else
+            {
+                float pos = inst.Time < 0 ? 0 : inst.Time;
+                a = static_cast<int>(pos);
+                alpha = pos - a;
+                b = a+1 < NumFrames ? a+1 : (inst.bLoop ? 0 : a);
+            }
+            Blend(a,b,alpha,inst.X,inst.Y,inst.Z);
+        }
+    }
+
+private:
+    int ClampFrame( int t ) const
+    {
+        return t < 0 ? 0 : (t >= NumFrames ? (NumFrames > 0 ? NumFrames-1 : 0) : t);
+    }
+
+    static float GetFloat( const TCHAR* line, const TCHAR* key, float def )
+    {
+        const TCHAR* p = _tcsstr(line,key);
+        return p != NULL ? static_cast<float>(_tcstod(p+_tcslen(key),NULL)) : def;
+    }
+};
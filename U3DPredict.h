@@ -0,0 +1,205 @@
+/*======================================================================
+
+    Frames packed while they are sampled
+
+    The precision optimization needs the bounds of every frame before the
+    first one can be packed, so the sampled floats (12 bytes per vert and
+    frame) are kept until then. FPackedFrames predicts the bounds from a
+    few probe frames instead, grown by a margin on every side, and packs
+    each frame to FMeshVert (4 bytes) as soon as it is sampled.
+
+    A frame that leaves the predicted bounds grows them, and the frames
+    packed so far are packed again from their packed values. Each repack
+    can add up to half a step of the old, finer quantization to the error
+    of those frames. Growing by the margin again makes repacks rare even
+    for clips that drift.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_PREDICT_PROBES  8           // probe frames spread over the clip
+#define U3D_PREDICT_MARGIN  0.1f        // of the extent, added on each side
+
+
+class FPackedFrames
+{
+    std::vector<FMeshVert>  Verts;
+    float                   Tm[12];
+    int                     Stride;
+    int                     Packed;
+    bool                    bOptimize;
+    bool                    bBounds;
+    float                   Lo[3];      // frames seen so far, without the margin
+    float                   Hi[3];
+
+public:
+    float                   Min[3];     // predicted, in exported coordinates
+    float                   Max[3];
+    float                   Offset[3];
+    float                   Scale[3];
+    int                     Regrows;
+    int                     RepackedFrames;
+
+    FPackedFrames()
+    : Stride(0)
+    , Packed(0)
+    , bOptimize(false)
+    , bBounds(false)
+    , Regrows(0)
+    , RepackedFrames(0)
+    {
+    }
+
+    // tm takes the sampled points to the exported coordinates. Without
+    // optimize the points are packed as they are, like bMaxResolution off.
+    bool Begin( int stride, int framecount, const float* tm, bool optimize )
+    {
+        Stride = stride;
+        Packed = 0;
+        bOptimize = optimize;
+        bBounds = false;
+        Regrows = 0;
+        RepackedFrames = 0;
+        memcpy(Tm,tm,sizeof(Tm));
+        for( int a=0; a<3; ++a )
+        {
+            Min[a] = Max[a] = Lo[a] = Hi[a] = Offset[a] = 0;
+            Scale[a] = 1;
+        }
+
+        Verts.clear();
+        if( static_cast<double>(stride)*framecount*sizeof(FMeshVert) >= static_cast<double>(~static_cast<size_t>(0)/2) )
+            return false;
+        Verts.resize(static_cast<size_t>(stride)*framecount);
+        return true;
+    }
+
+    // Probe frames widen the prediction, any number before the first frame
+    void AddProbe( const float* points )
+    {
+        float mn[3], mx[3];
+        GetBox(points,mn,mx);
+        Grow(mn,mx);
+    }
+
+    // Frames in order, packed right away
+    void AddFrame( const float* points )
+    {
+        if( bOptimize )
+        {
+            float mn[3], mx[3];
+            GetBox(points,mn,mx);
+            bool inside = bBounds;
+            for( int a=0; a<3 && inside; ++a )
+                inside = mn[a] >= Min[a] && mx[a] <= Max[a];
+
+            if( !inside )
+            {
+                // Frames before the first probe only happen without probes
+                float offset[3], scale[3];
+                memcpy(offset,Offset,sizeof(offset));
+                memcpy(scale,Scale,sizeof(scale));
+                Grow(mn,mx);
+                if( Packed > 0 )
+                {
+                    Repack(offset,scale);
+                    ++Regrows;
+                    RepackedFrames += Packed;
+                }
+            }
+        }
+
+        if( Stride > 0 )
+            U3DQuantizeAffine(points,Stride,Tm,Offset,Scale,&Verts[static_cast<size_t>(Packed)*Stride]);
+        ++Packed;
+    }
+
+    FMeshVert* GetFrame( int t )
+    {
+        return &Verts[static_cast<size_t>(t)*Stride];
+    }
+
+    // Keeps the verts with remap[i] != -1, in order, like Strip
+    void Compact( const int* remap, int vertcount )
+    {
+        size_t dst = 0;
+        for( int t=0; t<Packed; ++t )
+        {
+            const FMeshVert* frame = GetFrame(t);
+            for( int i=0; i<Stride; ++i )
+            {
+                if( remap[i] != -1 )
+                    Verts[dst++] = frame[i];
+            }
+        }
+        Stride = vertcount;
+        Verts.resize(dst);
+    }
+
+    size_t GetBytes() const
+    {
+        return Verts.capacity()*sizeof(FMeshVert);
+    }
+
+    void Release()
+    {
+        std::vector<FMeshVert>().swap(Verts);
+        Stride = 0;
+        Packed = 0;
+    }
+
+private:
+    void GetBox( const float* points, float* mn, float* mx ) const
+    {
+        for( int a=0; a<3; ++a )
+            mn[a] = mx[a] = Stride > 0 ? points[a] : 0;
+        if( Stride > 1 )
+            U3DGrowBounds(points+3,Stride-1,mn,mx);
+        U3DTransformBounds(Tm,mn,mx);
+    }
+
+    // Takes in the box and adds the margin. Flat axes stay flat, a frame
+    // that moves them is rare enough to be worth a repack.
+    void Grow( const float* mn, const float* mx )
+    {
+        for( int a=0; a<3; ++a )
+        {
+            Lo[a] = bBounds && Lo[a] < mn[a] ? Lo[a] : mn[a];
+            Hi[a] = bBounds && Hi[a] > mx[a] ? Hi[a] : mx[a];
+            float pad = (Hi[a]-Lo[a]) * U3D_PREDICT_MARGIN;
+            Min[a] = Lo[a] - pad;
+            Max[a] = Hi[a] + pad;
+        }
+        bBounds = true;
+
+        if( bOptimize )
+            U3DGetOptimization(Min,Max,Offset,Scale);
+    }
+
+    // Packed values truncate toward zero, the middle of their step is the
+    // best guess of the point they came from
+    void Repack( const float* offset, const float* scale )
+    {
+        float fix[3], mul[3];
+        for( int a=0; a<3; ++a )
+        {
+            mul[a] = Scale[a] / scale[a];
+            fix[a] = (offset[a] - Offset[a]) * Scale[a];
+        }
+
+        size_t count = static_cast<size_t>(Packed)*Stride;
+        for( size_t i=0; i<count; ++i )
+        {
+            float q[3], v[3];
+            U3DUnpack(Verts[i],q);
+            for( int a=0; a<3; ++a )
+            {
+                float mid = q[a] > 0 ? q[a]+0.5f : q[a] < 0 ? q[a]-0.5f : 0;
+                v[a] = mid*mul[a] + fix[a];
+            }
+            Verts[i] = FMeshVert(v[0],v[1],v[2]);
+        }
+    }
+};
@@ -0,0 +1,493 @@
+/*======================================================================
+
+    Scene access used by the export pipeline
+
+    FSceneSource is everything the exporter asks of a scene: mesh and
+    tracked nodes, faces with UVs and materials, note track keys, and
+    per-frame vertices and transforms. The plugin implements it on top
+    of 3DXI, FSceneRecorder saves what a source returns to a .u3dscene
+    file and FSceneReplay plays such a file back without 3ds Max, so
+    production scenes can be exported and profiled on build machines.
+
+    Version 2 records points in Max world space and stores the axes that
+    take them to the exported coordinates right after the header, version
+    1 recordings are already converted.
+
+    Recordings keep the world space verts of every mesh, not which meshes
+    are rigid or instances. The recorder passes those queries through, so
+    recording does not change the export, but a replay treats every mesh
+    as deforming. The points are the same, only the shortcuts are lost.
+
+    Max independent, see U3DCore.h. Strings are stored as TCHAR so
+    recordings move between MBCS plugin builds and the Linux tools.
+
+========================================================================*/
+
+#define U3D_SCENE_MAGIC     0x53443355  // "U3DS"
+#define U3D_SCENE_VERSION   2
+
+#pragma pack(push,1)
+struct FSceneHeader
+{
+    U_DWORD Magic;
+    U_DWORD Version;
+    U_INT   FrameStart;
+    U_INT   FrameEnd;
+    U_DWORD NumMaterials;
+    U_DWORD NumNotes;
+    U_DWORD NumMeshes;
+    U_DWORD NumTracked;
+};
+
+struct FSceneFace
+{
+    U_INT   Vert[3];
+    U_FLOAT UV[3][2];
+    U_INT   UVMask;         // bit k set if UV[k] is valid
+    U_INT   MatID;          // face material ID, becomes TextureNum
+    U_INT   Material;       // index into the scene materials, -1 for none
+};
+#pragma pack(pop)
+
+
+class FSceneSource
+{
+public:
+    virtual ~FSceneSource() {}
+
+    virtual int             GetFrameStart() = 0;
+    virtual int             GetFrameEnd() = 0;
+
+    virtual int             GetMaterialCount() = 0;
+    virtual const TCHAR*    GetMaterialName( int m ) = 0;
+
+    // World note track keys
+    virtual int             GetNoteCount() = 0;
+    virtual int             GetNoteFrame( int i ) = 0;
+    virtual const TCHAR*    GetNoteText( int i ) = 0;
+
+    // Static mesh data, faces are written to out and counted, up to GetFaceCount
+    virtual int             GetMeshCount() = 0;
+    virtual const TCHAR*    GetMeshName( int n ) = 0;
+    virtual int             GetVertCount( int n ) = 0;
+    virtual int             GetFaceCount( int n ) = 0;
+    virtual int             GetFaces( int n, FSceneFace* out ) = 0;
+
+    virtual int             GetTrackedCount() = 0;
+    virtual const TCHAR*    GetTrackedName( int n ) = 0;
+
+    // Per-frame data for the frame last set. GetVerts writes at most
+    // maxcount XYZ triples and returns how many verts the mesh has, tracked
+    // transforms are 4 rows of XYZ, the last one is the translation.
+    virtual void            SetFrame( int frame ) = 0;
+    virtual int             GetVerts( int n, float* out, int maxcount ) = 0;
+    virtual void            GetTrackedTM( int n, float* tm ) = 0;
+
+    // Meshes that can only move as a whole. GetLocalVerts works like
+    // GetVerts in object space, GetMeshTM takes those verts to where
+    // GetVerts puts them. Sources that cannot tell keep the defaults.
+    virtual bool            IsRigidCandidate( int n )                       { return false; }
+    virtual int             GetLocalVerts( int n, float* out, int maxcount ){ return 0; }
+    virtual void            GetMeshTM( int n, float* tm )                   {}
+
+    // Meshes that share object, modifiers and material with an earlier
+    // mesh return its index, their faces and object space verts are the
+    // same and only GetMeshTM differs. Others return n.
+    virtual int             GetInstanceOf( int n )                          { return n; }
+};
+
+
+static bool WriteSceneStr( FILE* f, const TCHAR* str )
+{
+    U_DWORD len = static_cast<U_DWORD>(_tcslen(str));
+    return fwrite(&len,sizeof(len),1,f) == 1
+        && (len == 0 || fwrite(str,sizeof(TCHAR)*len,1,f) == 1);
+}
+
+static bool ReadSceneStr( FILE* f, FString& str )
+{
+    U_DWORD len;
+    if( fread(&len,sizeof(len),1,f) != 1 )
+        return false;
+
+    str.resize(len);
+    return len == 0 || fread(&str[0],sizeof(TCHAR)*len,1,f) == 1;
+}
+
+
+// Passes a source through and saves it. Open writes the static part:
+// header, notes, meshes with their faces, materials and tracked names.
+// Every frame is written the first time it is set: vert count and verts
+// per mesh, then a transform per tracked node.
+class FSceneRecorder : public FSceneSource
+{
+    FSceneSource&               Src;
+    FILE*                       File;
+    bool                        bError;
+    std::vector<int>            VertCounts;
+    std::vector<int>            VertOffsets;
+    std::vector<float>          Verts;
+    std::vector<float>          TMs;
+    std::vector<U_BYTE>         Recorded;
+
+public:
+    FSceneRecorder( FSceneSource& src ) : Src(src), File(NULL), bError(false)
+    {
+    }
+
+    ~FSceneRecorder()
+    {
+        Close();
+    }
+
+    // axes is a U3DTransformPoints tm from the recorded space to the exported one
+    bool Open( const TCHAR* path, const float* axes )
+    {
+        File = _tfopen(path,_T("wb"));
+        if( File == NULL )
+            return false;
+
+        FSceneHeader h;
+        h.Magic = U3D_SCENE_MAGIC;
+        h.Version = U3D_SCENE_VERSION;
+        h.FrameStart = Src.GetFrameStart();
+        h.FrameEnd = Src.GetFrameEnd();
+        h.NumMaterials = 0;
+        h.NumNotes = Src.GetNoteCount();
+        h.NumMeshes = Src.GetMeshCount();
+        h.NumTracked = Src.GetTrackedCount();
+        bool ok = fwrite(&h,sizeof(h),1,File) == 1
+               && fwrite(axes,sizeof(float)*12,1,File) == 1;
+
+        for( U_DWORD i=0; i<h.NumNotes && ok; ++i )
+        {
+            U_INT frame = Src.GetNoteFrame(i);
+            ok = fwrite(&frame,sizeof(frame),1,File) == 1
+              && WriteSceneStr(File,Src.GetNoteText(i));
+        }
+
+        std::vector<FSceneFace> faces;
+        VertOffsets.resize(h.NumMeshes+1,0);
+        for( U_DWORD n=0; n<h.NumMeshes && ok; ++n )
+        {
+            U_INT counts[2] = { Src.GetVertCount(n), 0 };
+            faces.resize(Src.GetFaceCount(n)+1);
+            counts[1] = Src.GetFaces(n,&faces[0]);
+            ok = WriteSceneStr(File,Src.GetMeshName(n))
+              && fwrite(counts,sizeof(counts),1,File) == 1
+              && (counts[1] == 0 || fwrite(&faces[0],sizeof(FSceneFace)*counts[1],1,File) == 1);
+            VertOffsets[n+1] = VertOffsets[n] + counts[0];
+        }
+
+        // Sources may find materials while handing out faces, so they
+        // come after the meshes and the header is completed afterwards
+        h.NumMaterials = Src.GetMaterialCount();
+        for( U_DWORD i=0; i<h.NumMaterials && ok; ++i )
+            ok = WriteSceneStr(File,Src.GetMaterialName(i));
+
+        for( U_DWORD n=0; n<h.NumTracked && ok; ++n )
+            ok = WriteSceneStr(File,Src.GetTrackedName(n));
+
+        ok = ok && fseek(File,0,SEEK_SET) == 0
+                && fwrite(&h,sizeof(h),1,File) == 1
+                && fseek(File,0,SEEK_END) == 0;
+
+        VertCounts.resize(h.NumMeshes);
+        Verts.resize((VertOffsets[h.NumMeshes]+1)*3);
+        TMs.resize((h.NumTracked+1)*12);
+        Recorded.resize(h.FrameEnd >= h.FrameStart ? h.FrameEnd-h.FrameStart+1 : 0,0);
+        bError = !ok;
+        return ok;
+    }
+
+    bool Close()
+    {
+        if( File == NULL )
+            return false;
+
+        bool ok = fclose(File) == 0 && !bError;
+        File = NULL;
+        return ok;
+    }
+
+    int             GetFrameStart()                 { return Src.GetFrameStart(); }
+    int             GetFrameEnd()                   { return Src.GetFrameEnd(); }
+    int             GetMaterialCount()              { return Src.GetMaterialCount(); }
+    const TCHAR*    GetMaterialName( int m )        { return Src.GetMaterialName(m); }
+    int             GetNoteCount()                  { return Src.GetNoteCount(); }
+    int             GetNoteFrame( int i )           { return Src.GetNoteFrame(i); }
+    const TCHAR*    GetNoteText( int i )            { return Src.GetNoteText(i); }
+    int             GetMeshCount()                  { return Src.GetMeshCount(); }
+    const TCHAR*    GetMeshName( int n )            { return Src.GetMeshName(n); }
+    int             GetVertCount( int n )           { return Src.GetVertCount(n); }
+    int             GetFaceCount( int n )           { return Src.GetFaceCount(n); }
+    int             GetFaces( int n, FSceneFace* out ) { return Src.GetFaces(n,out); }
+    int             GetTrackedCount()               { return Src.GetTrackedCount(); }
+    const TCHAR*    GetTrackedName( int n )         { return Src.GetTrackedName(n); }
+
+    // Samples the whole frame once, the pipeline reads it from here
+    void SetFrame( int frame )
+    {
+        Src.SetFrame(frame);
+
+        int meshes = static_cast<int>(VertCounts.size());
+        for( int n=0; n<meshes; ++n )
+            VertCounts[n] = Src.GetVerts(n,&Verts[VertOffsets[n]*3],VertOffsets[n+1]-VertOffsets[n]);
+
+        int tracked = Src.GetTrackedCount();
+        for( int n=0; n<tracked; ++n )
+            Src.GetTrackedTM(n,&TMs[n*12]);
+
+        int slot = frame - Src.GetFrameStart();
+        if( File == NULL || bError || slot < 0 || slot >= static_cast<int>(Recorded.size()) || Recorded[slot] )
+            return;
+
+        Recorded[slot] = 1;
+        U_INT f = frame;
+        bool ok = fwrite(&f,sizeof(f),1,File) == 1;
+        for( int n=0; n<meshes && ok; ++n )
+        {
+            U_INT count = VertCounts[n];
+            if( count > VertOffsets[n+1]-VertOffsets[n] )
+                count = VertOffsets[n+1]-VertOffsets[n];
+            ok = fwrite(&count,sizeof(count),1,File) == 1
+              && (count == 0 || fwrite(&Verts[VertOffsets[n]*3],sizeof(float)*3*count,1,File) == 1);
+        }
+        if( ok && tracked > 0 )
+            ok = fwrite(&TMs[0],sizeof(float)*12*tracked,1,File) == 1;
+        bError = !ok;
+    }
+
+    int GetVerts( int n, float* out, int maxcount )
+    {
+        int count = VertCounts[n];
+        if( count > VertOffsets[n+1]-VertOffsets[n] )
+            count = VertOffsets[n+1]-VertOffsets[n];
+        if( count > maxcount )
+            count = maxcount;
+        if( count > 0 )
+            memcpy(out,&Verts[VertOffsets[n]*3],sizeof(float)*3*count);
+        return VertCounts[n];
+    }
+
+    void GetTrackedTM( int n, float* tm )
+    {
+        memcpy(tm,&TMs[n*12],sizeof(float)*12);
+    }
+
+    // Not recorded, the frame set on the source is the one sampled above
+    bool            IsRigidCandidate( int n )       { return Src.IsRigidCandidate(n); }
+    int             GetLocalVerts( int n, float* out, int maxcount ) { return Src.GetLocalVerts(n,out,maxcount); }
+    void            GetMeshTM( int n, float* tm )   { Src.GetMeshTM(n,tm); }
+    int             GetInstanceOf( int n )          { return Src.GetInstanceOf(n); }
+};
+
+
+// Plays a recording back. Static data is loaded on Open, frames are read
+// from disk when set so long recordings do not have to fit in memory.
+class FSceneReplay : public FSceneSource
+{
+    struct sMesh
+    {
+        FString                 Name;
+        int                     VertCount;
+        std::vector<FSceneFace> Faces;
+    };
+
+    FILE*                       File;
+    FSceneHeader                Header;
+    std::vector<FString>        Materials;
+    std::vector<int>            NoteFrames;
+    std::vector<FString>        NoteTexts;
+    std::vector<sMesh>          Meshes;
+    std::vector<FString>        Tracked;
+    std::vector<long>           FrameOffsets;   // -1 if the frame was not recorded
+    std::vector<int>            VertCounts;
+    std::vector< std::vector<float> > Verts;
+    std::vector<float>          TMs;
+    float                       Axes[12];
+
+public:
+    FSceneReplay() : File(NULL)
+    {
+        memset(&Header,0,sizeof(Header));
+        memset(Axes,0,sizeof(Axes));
+        Axes[0] = Axes[4] = Axes[8] = 1;
+    }
+
+    ~FSceneReplay()
+    {
+        if( File != NULL )
+            fclose(File);
+    }
+
+    bool Open( const TCHAR* path )
+    {
+        File = _tfopen(path,_T("rb"));
+        if( File == NULL )
+            return false;
+
+        if( fread(&Header,sizeof(Header),1,File) != 1
+        ||  Header.Magic != U3D_SCENE_MAGIC
+        ||  Header.Version < 1 || Header.Version > U3D_SCENE_VERSION
+        ||  Header.FrameEnd < Header.FrameStart )
+            return false;
+
+        if( Header.Version >= 2 && fread(Axes,sizeof(Axes),1,File) != 1 )
+            return false;
+
+        bool ok = true;
+        NoteFrames.resize(Header.NumNotes);
+        NoteTexts.resize(Header.NumNotes);
+        for( U_DWORD i=0; i<Header.NumNotes && ok; ++i )
+        {
+            U_INT frame;
+            ok = fread(&frame,sizeof(frame),1,File) == 1 && ReadSceneStr(File,NoteTexts[i]);
+            NoteFrames[i] = frame;
+        }
+
+        Meshes.resize(Header.NumMeshes);
+        for( U_DWORD n=0; n<Header.NumMeshes && ok; ++n )
+        {
+            sMesh& m = Meshes[n];
+            U_INT counts[2];
+            ok = ReadSceneStr(File,m.Name) && fread(counts,sizeof(counts),1,File) == 1 && counts[0] >= 0 && counts[1] >= 0;
+            if( ok )
+            {
+                m.VertCount = counts[0];
+                m.Faces.resize(counts[1]);
+                ok = counts[1] == 0 || fread(&m.Faces[0],sizeof(FSceneFace)*counts[1],1,File) == 1;
+            }
+        }
+
+        Materials.resize(Header.NumMaterials);
+        for( U_DWORD i=0; i<Header.NumMaterials && ok; ++i )
+            ok = ReadSceneStr(File,Materials[i]);
+
+        // Unknown materials fall back to none rather than out of bounds
+        for( U_DWORD n=0; n<Header.NumMeshes && ok; ++n )
+        {
+            std::vector<FSceneFace>& faces = Meshes[n].Faces;
+            for( size_t i=0; i<faces.size(); ++i )
+            {
+                if( faces[i].Material >= static_cast<int>(Header.NumMaterials) )
+                    faces[i].Material = -1;
+            }
+        }
+
+        Tracked.resize(Header.NumTracked);
+        for( U_DWORD n=0; n<Header.NumTracked && ok; ++n )
+            ok = ReadSceneStr(File,Tracked[n]);
+        if( !ok )
+            return false;
+
+        // Index the frames, their size depends on the vert counts inside
+        FrameOffsets.assign(Header.FrameEnd-Header.FrameStart+1,-1);
+        for( ;; )
+        {
+            long offset = ftell(File);
+            U_INT frame;
+            if( fread(&frame,sizeof(frame),1,File) != 1 )
+                break;
+
+            for( U_DWORD n=0; n<Header.NumMeshes && ok; ++n )
+            {
+                U_INT count;
+                ok = fread(&count,sizeof(count),1,File) == 1 && count >= 0
+                  && fseek(File,static_cast<long>(sizeof(float)*3*count),SEEK_CUR) == 0;
+            }
+            ok = ok && fseek(File,static_cast<long>(sizeof(float)*12*Header.NumTracked),SEEK_CUR) == 0;
+            if( !ok )
+                return false;
+
+            int slot = frame - Header.FrameStart;
+            if( slot >= 0 && slot < static_cast<int>(FrameOffsets.size()) )
+                FrameOffsets[slot] = offset;
+        }
+
+        VertCounts.assign(Header.NumMeshes,0);
+        Verts.resize(Header.NumMeshes);
+        for( U_DWORD n=0; n<Header.NumMeshes; ++n )
+            Verts[n].resize((Meshes[n].VertCount+1)*3);
+        TMs.assign((Header.NumTracked+1)*12,0.0f);
+        return true;
+    }
+
+    // Takes the recorded points and transforms to the exported coordinates
+    void GetAxes( float* tm ) const
+    {
+        memcpy(tm,Axes,sizeof(Axes));
+    }
+
+    // Frames the recording does not have
+    int GetMissingFrames() const
+    {
+        int missing = 0;
+        for( size_t i=0; i<FrameOffsets.size(); ++i )
+            missing += FrameOffsets[i] < 0 ? 1 : 0;
+        return missing;
+    }
+
+    int             GetFrameStart()                 { return Header.FrameStart; }
+    int             GetFrameEnd()                   { return Header.FrameEnd; }
+    int             GetMaterialCount()              { return static_cast<int>(Materials.size()); }
+    const TCHAR*    GetMaterialName( int m )        { return Materials[m].c_str(); }
+    int             GetNoteCount()                  { return static_cast<int>(NoteTexts.size()); }
+    int             GetNoteFrame( int i )           { return NoteFrames[i]; }
+    const TCHAR*    GetNoteText( int i )            { return NoteTexts[i].c_str(); }
+    int             GetMeshCount()                  { return static_cast<int>(Meshes.size()); }
+    const TCHAR*    GetMeshName( int n )            { return Meshes[n].Name.c_str(); }
+    int             GetVertCount( int n )           { return Meshes[n].VertCount; }
+    int             GetFaceCount( int n )           { return static_cast<int>(Meshes[n].Faces.size()); }
+    int             GetTrackedCount()               { return static_cast<int>(Tracked.size()); }
+    const TCHAR*    GetTrackedName( int n )         { return Tracked[n].c_str(); }
+
+    int GetFaces( int n, FSceneFace* out )
+    {
+        const std::vector<FSceneFace>& faces = Meshes[n].Faces;
+        if( !faces.empty() )
+            memcpy(out,&faces[0],sizeof(FSceneFace)*faces.size());
+        return static_cast<int>(faces.size());
+    }
+
+    // Frames that were not recorded come back without verts
+    void SetFrame( int frame )
+    {
+        VertCounts.assign(VertCounts.size(),0);
+        int slot = frame - Header.FrameStart;
+        if( slot < 0 || slot >= static_cast<int>(FrameOffsets.size()) || FrameOffsets[slot] < 0 )
+            return;
+
+        fseek(File,FrameOffsets[slot]+static_cast<long>(sizeof(U_INT)),SEEK_SET);
+        for( U_DWORD n=0; n<Header.NumMeshes; ++n )
+        {
+            U_INT count;
+            if( fread(&count,sizeof(count),1,File) != 1 )
+                return;
+
+            int keep = count < Meshes[n].VertCount ? count : Meshes[n].VertCount;
+            if( keep > 0 && fread(&Verts[n][0],sizeof(float)*3*keep,1,File) != 1 )
+                return;
+            if( count > keep )
+                fseek(File,static_cast<long>(sizeof(float)*3*(count-keep)),SEEK_CUR);
+            VertCounts[n] = count;
+        }
+        if( Header.NumTracked > 0 && fread(&TMs[0],sizeof(float)*12*Header.NumTracked,1,File) != 1 )
+            return;
+    }
+
+    int GetVerts( int n, float* out, int maxcount )
+    {
+        int count = VertCounts[n] < Meshes[n].VertCount ? VertCounts[n] : Meshes[n].VertCount;
+        if( count > maxcount )
+            count = maxcount;
+        if( count > 0 )
+            memcpy(out,&Verts[n][0],sizeof(float)*3*count);
+        return VertCounts[n];
+    }
+
+    void GetTrackedTM( int n, float* tm )
+    {
+        memcpy(tm,&TMs[n*12],sizeof(float)*12);
+    }
+};
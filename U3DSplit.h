@@ -0,0 +1,202 @@
+/*======================================================================
+
+    Static and dynamic verts of an exported mesh
+
+    A vert is static when its packed FMeshVert is the same in every
+    frame. FVertSplit finds them from the packed frames and writes a
+    sidecar for runtimes that want to skip them: the static verts once,
+    then a frame stream of the dynamic verts only. The _d.3d / _a.3d pair
+    is written as usual and stays valid on its own.
+
+    With the static verts moved to the front of the vertex list the
+    static indices are simply 0..NumStatic-1 (Flags & U3D_SPLIT_ORDERED).
+
+    File layout:
+        FSplitHeader
+        U_WORD      [NumStatic]                 static vert indices
+        FMeshVert   [NumStatic]                 their packed position
+        U_WORD      [NumDynamic]                dynamic vert indices
+        FMeshVert   [NumFrames][NumDynamic]     dynamic verts per frame
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_SPLIT_MAGIC     0x54443355  // "U3DT", "U3DS" is the scene recording
+#define U3D_SPLIT_VERSION   1
+#define U3D_SPLIT_ORDERED   0x1         // static verts come first in _d.3d
+
+#pragma pack(push,1)
+struct FSplitHeader
+{
+    U_DWORD Magic;
+    U_DWORD Version;
+    U_DWORD NumVertices;
+    U_DWORD NumFrames;
+    U_DWORD NumStatic;
+    U_DWORD NumDynamic;
+    U_DWORD Flags;
+
+    FSplitHeader()
+    : Magic(U3D_SPLIT_MAGIC)
+    , Version(U3D_SPLIT_VERSION)
+    , NumVertices(0)
+    , NumFrames(0)
+    , NumStatic(0)
+    , NumDynamic(0)
+    , Flags(0)
+    {
+    }
+};
+#pragma pack(pop)
+
+
+class FVertSplit
+{
+public:
+    FSplitHeader            Header;
+    std::vector<U_WORD>     StaticIndex;
+    std::vector<FMeshVert>  StaticVerts;
+    std::vector<U_WORD>     DynamicIndex;
+
+private:
+    std::vector<FMeshVert>  First;
+    std::vector<U_DWORD>    Changed;        // bits that differ from the first frame
+    std::vector<FMeshVert>  Scratch;
+    int                     Frame;
+
+public:
+    FVertSplit() : Frame(0)
+    {
+    }
+
+    void Begin( int vertcount, int framecount )
+    {
+        Header = FSplitHeader();
+        Header.NumVertices = vertcount;
+        Header.NumFrames = framecount;
+        First.assign(vertcount+1,FMeshVert());
+        Changed.assign(vertcount+1,0);
+        Frame = 0;
+    }
+
+    // Packed frames, one call per frame
+    void AddFrame( const FMeshVert* verts )
+    {
+        int count = Header.NumVertices;
+        if( Frame++ == 0 )
+        {
+            if( count > 0 )
+                memcpy(&First[0],verts,sizeof(FMeshVert)*count);
+            return;
+        }
+
+        const U_DWORD* a = reinterpret_cast<const U_DWORD*>(&First[0]);
+        const U_DWORD* b = reinterpret_cast<const U_DWORD*>(verts);
+        U_DWORD* c = &Changed[0];
+        int i = 0;
+#ifdef U3D_SSE2
+        for( ; i+4 <= count; i+=4 )
+        {
+            __m128i d = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)),_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(c+i),_mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c+i)),d));
+        }
+#endif
+        for( ; i<count; ++i )
+            c[i] |= a[i] ^ b[i];
+    }
+
+    void End()
+    {
+        BuildLists();
+    }
+
+    int GetStaticCount() const
+    {
+        return Header.NumStatic;
+    }
+
+    bool IsStatic( int i ) const
+    {
+        return Changed[i] == 0;
+    }
+
+    // order[new] = old, static verts first, both parts keep their order
+    void GetStaticFirstOrder( int* order ) const
+    {
+        int n = 0;
+        for( U_DWORD i=0; i<Header.NumVertices; ++i )
+        {
+            if( Changed[i] == 0 )
+                order[n++] = i;
+        }
+        for( U_DWORD i=0; i<Header.NumVertices; ++i )
+        {
+            if( Changed[i] != 0 )
+                order[n++] = i;
+        }
+    }
+
+    // Follows a reorder of the output verts
+    void Reorder( const int* order, bool staticfirst )
+    {
+        std::vector<FMeshVert> first(First.size());
+        std::vector<U_DWORD> changed(Changed.size());
+        for( U_DWORD i=0; i<Header.NumVertices; ++i )
+        {
+            first[i] = First[order[i]];
+            changed[i] = Changed[order[i]];
+        }
+        First.swap(first);
+        Changed.swap(changed);
+        BuildLists();
+        Header.Flags = staticfirst ? Header.Flags | U3D_SPLIT_ORDERED : Header.Flags & ~U3D_SPLIT_ORDERED;
+    }
+
+    bool WriteHeader( FOutFile& f ) const
+    {
+        return f.Write(&Header,sizeof(Header))
+            && f.Write(StaticIndex.empty() ? NULL : &StaticIndex[0],sizeof(U_WORD)*StaticIndex.size())
+            && f.Write(StaticVerts.empty() ? NULL : &StaticVerts[0],sizeof(FMeshVert)*StaticVerts.size())
+            && f.Write(DynamicIndex.empty() ? NULL : &DynamicIndex[0],sizeof(U_WORD)*DynamicIndex.size());
+    }
+
+    // Packed frame of all verts, only the dynamic ones are written
+    bool WriteFrame( FOutFile& f, const FMeshVert* verts )
+    {
+        int count = static_cast<int>(DynamicIndex.size());
+        if( count == 0 )
+            return true;
+
+        if( Header.Flags & U3D_SPLIT_ORDERED )
+            return f.Write(verts+Header.NumStatic,sizeof(FMeshVert)*count);
+
+        Scratch.resize(count);
+        for( int i=0; i<count; ++i )
+            Scratch[i] = verts[DynamicIndex[i]];
+        return f.Write(&Scratch[0],sizeof(FMeshVert)*count);
+    }
+
+private:
+    void BuildLists()
+    {
+        StaticIndex.clear();
+        StaticVerts.clear();
+        DynamicIndex.clear();
+        for( U_DWORD i=0; i<Header.NumVertices; ++i )
+        {
+            if( Changed[i] == 0 )
+            {
+                StaticIndex.push_back(static_cast<U_WORD>(i));
+                StaticVerts.push_back(First[i]);
+            }
+            else
+            {
+                DynamicIndex.push_back(static_cast<U_WORD>(i));
+            }
+        }
+        Header.NumStatic = static_cast<U_DWORD>(StaticIndex.size());
+        Header.NumDynamic = static_cast<U_DWORD>(DynamicIndex.size());
+    }
+};
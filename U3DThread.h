@@ -0,0 +1,78 @@
+#include <process.h>
+
+// ParallelFor callback, called once for each index in [0,count)
+typedef void (*U3DParallelFn)( void* ctx, int index );
+
+struct sParallelJob
+{
+    U3DParallelFn   Fn;
+    void*           Ctx;
+    LONG            Count;
+    volatile LONG   Next;
+    FCancelToken*   Cancel;
+    DWORD           Owner;
+};
+
+static unsigned __stdcall ParallelWorker( void* arg )
+{
+    sParallelJob* job = static_cast<sParallelJob*>(arg);
+
+    // Indices are handed out one at a time so uneven items balance out.
+    // The calling thread polls the token, the others see its result.
+    bool owner = GetCurrentThreadId() == job->Owner;
+    for( LONG i=InterlockedIncrement(&job->Next)-1; i<job->Count; i=InterlockedIncrement(&job->Next)-1 )
+    {
+        if( job->Cancel != NULL && (owner ? job->Cancel->Poll() : job->Cancel->IsCancelled()) )
+            break;
+        job->Fn(job->Ctx,i);
+    }
+    return 0;
+}
+
+int GetWorkerCount()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return max(1,min(static_cast<int>(si.dwNumberOfProcessors),MAXIMUM_WAIT_OBJECTS));
+}
+
+// Runs fn for every index on all cores, returns when all indices are done
+// or the token was cancelled, then some indices are left out.
+// Callers must make each index write to its own disjoint output.
+void ParallelFor( int count, U3DParallelFn fn, void* ctx, FCancelToken* cancel=NULL )
+{
+    sParallelJob job;
+    job.Fn = fn;
+    job.Ctx = ctx;
+    job.Count = count;
+    job.Next = 0;
+    job.Cancel = cancel;
+    job.Owner = GetCurrentThreadId();
+
+    int workers = min(count,GetWorkerCount());
+    if( workers <= 1 )
+    {
+        for( int i=0; i<count && !U3DPollCancel(cancel); ++i )
+            fn(ctx,i);
+        return;
+    }
+
+    // Calling thread is one of the workers
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int started = 0;
+    for( int i=1; i<workers; ++i )
+    {
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL,0,ParallelWorker,&job,0,NULL));
+        if( h != NULL )
+            threads[started++] = h;
+    }
+
+    ParallelWorker(&job);
+
+    if( started > 0 )
+    {
+        WaitForMultipleObjects(started,threads,TRUE,INFINITE);
+        for( int i=0; i<started; ++i )
+            CloseHandle(threads[i]);
+    }
+}
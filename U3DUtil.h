@@ -62,6 +62,31 @@ UserCoord UnrealCoords = {
     0, 
 };  
 
+// UnrealCoords as a U3DTransformPoints tm from Max world space, where
+// right is +X, in is +Y and up is +Z. The default above is the identity,
+// handedness follows from the axes.
+void GetUnrealAxes( float* tm )
+{
+    static const float dirs[6][3] = {
+        { -1, 0, 0 },   // left
+        {  1, 0, 0 },   // right
+        {  0, 0, 1 },   // up
+        {  0, 0,-1 },   // down
+        {  0, 1, 0 },   // in
+        {  0,-1, 0 },   // out
+    };
+    static const int defaults[3] = { 1, 4, 2 };
+    int axes[3] = { UnrealCoords.xAxis, UnrealCoords.yAxis, UnrealCoords.zAxis };
+
+    memset(tm,0,sizeof(float)*12);
+    for( int a=0; a<3; ++a )
+    {
+        const float* d = dirs[axes[a] >= 0 && axes[a] < 6 ? axes[a] : defaults[a]];
+        for( int r=0; r<3; ++r )
+            tm[r*3+a] = d[r];
+    }
+}
+
 /*
 BOOL CALLBACK Unreal3DExportOptionsDlgProc(HWND hWnd,UINT message,WPARAM wParam,LPARAM lParam) 
 {
@@ -103,56 +128,63 @@ BOOL CALLBACK Unreal3DExportOptionsDlgProc(HWND hWnd,UINT message,WPARAM wParam,
     return FALSE;
 }*/
 
-Tab<TSTR*> TokStr( TSTR text, TSTR sep )
+// Splits text at any of the sep chars, tokens are views into text
+int TokStr( FArena& arena, const FStrView& text, const TCHAR* sep, FStrView*& tokens )
 {
-    Tab<TSTR*> tokens;
+    int count = 1;
+    for( int i=0; i!=text.Len; ++i )
+    {
+        if( _tcschr(sep,text.Str[i]) )
+            ++count;
+    }
+
+    tokens = arena.New<FStrView>(count);
+    count = 0;
 
     int last=0;
-    for( int i=0; i!=text.length(); ++i )
+    int i=0;
+    for( ; i!=text.Len; ++i )
     {
-        for( int s=0; s!=sep.length(); ++s )
+        if( _tcschr(sep,text.Str[i]) )
         {
-            if( text[i] == sep[s] )
-            {
-                TSTR* buf = new TSTR(text.Substr(last,i-last));
-                tokens.Append(1,&buf);
-                last = i+1;
-            }
+            tokens[count++] = FStrView(text.Str+last,i-last);
+            last = i+1;
         }
     }
 
     if( i > last )
     {
-        TSTR* buf = new TSTR(text.Substr(last,i-last));
-        tokens.Append(1,&buf);
+        tokens[count++] = FStrView(text.Str+last,i-last);
     }
 
-    return tokens;
+    return count;
 }
 
 
-TSTR SplitStr( TSTR& text, TCHAR sep )
+FStrView SplitStr( FStrView& text, TCHAR sep )
 {
-    int s = text.first(sep);
-    if( s != -1 )
+    for( int s=0; s!=text.Len; ++s )
     {
-        TSTR left = text.Substr(0,s++);
-        text = text.Substr(s,text.Length()-s);
-        return left;
-    }
-    else
-    {
-        TSTR left = text;
-        text.Resize(0);
-        return left;
+        if( text.Str[s] == sep )
+        {
+            FStrView left(text.Str,s++);
+            text = FStrView(text.Str+s,text.Len-s);
+            return left;
+        }
     }
+
+    FStrView left = text;
+    text = FStrView(text.Str+text.Len,0);
+    return left;
 }
 
-TSTR StrRepl( const TSTR& text, TCHAR from, TCHAR to )
+FStrView StrRepl( FArena& arena, const FStrView& text, TCHAR from, TCHAR to )
 {
-    TSTR buf = text;
-    for( int s=buf.first(from); s!=-1; s=buf.first(from) ) 
-        buf[s]=_T(to);
-    return buf;
+    TCHAR* buf = arena.Dup(text.Str,text.Len);
+    for( int s=0; s!=text.Len; ++s )
+    {
+        if( buf[s] == from )
+            buf[s] = to;
+    }
+    return FStrView(buf,text.Len);
 }
-
@@ -0,0 +1,522 @@
+/*======================================================================
+
+    Vertex animation textures
+
+    FVatWriter writes the sampled frames as a position texture for
+    engines that play vertex animation on the GPU: one RGBA texel per
+    vert, XYZ in RGB, frames stacked top to bottom. Texels are float16
+    positions or 16 bit normalized positions within the clip bounds.
+
+    A frame takes RowsPerFrame rows of Width texels, so a frame is one
+    contiguous block and frames can be streamed out as they are sampled.
+    Rows are a multiple of 8 texels (a 64 byte cache line). Long clips
+    are split into pages of at most U3D_VAT_MAXHEIGHT rows, all pages
+    but a single one have the same height.
+
+    Outputs of name:
+        name_vat.dds            DDS, A16B16G16R16F or A16B16G16R16
+        name_vat0.dds ...       when split into pages
+        name_vat.gltf/.bin      rest pose mesh, TEXCOORD_1 is the texel
+                                of the vert in frame 0
+        name_vat.json           layout, bounds and sequences
+
+    Decoding, f is the frame within the page:
+        uv = TEXCOORD_1 + (0, f * frame_step_v)
+        float16: position = rgb
+        unorm16: position = bounds_min + rgb * (bounds_max - bounds_min)
+
+    FVatReader reads the pages back for tests and tools.
+
+    Max independent, see U3DCore.h.
+
+========================================================================*/
+#include <vector>
+
+#define U3D_VAT_MAXWIDTH    4096
+#define U3D_VAT_MAXHEIGHT   4096
+#define U3D_VAT_ALIGN       8           // texels per row are a multiple of this
+#define U3D_VAT_HALFMAX     65504.0f
+
+#define U3D_DDS_MAGIC       0x20534444  // "DDS "
+#define U3D_DDS_RGBA16      36          // D3DFMT_A16B16G16R16
+#define U3D_DDS_RGBA16F     113         // D3DFMT_A16B16G16R16F
+
+#pragma pack(push,1)
+struct FDdsHeader
+{
+    U_DWORD Magic;
+    U_DWORD Size;
+    U_DWORD Flags;
+    U_DWORD Height;
+    U_DWORD Width;
+    U_DWORD Pitch;
+    U_DWORD Depth;
+    U_DWORD MipMapCount;
+    U_DWORD Reserved1[11];
+    U_DWORD PfSize;
+    U_DWORD PfFlags;
+    U_DWORD FourCC;
+    U_DWORD RGBBitCount;
+    U_DWORD RBitMask;
+    U_DWORD GBitMask;
+    U_DWORD BBitMask;
+    U_DWORD ABitMask;
+    U_DWORD Caps;
+    U_DWORD Caps2;
+    U_DWORD Caps3;
+    U_DWORD Caps4;
+    U_DWORD Reserved2;
+
+    FDdsHeader( int width, int height, U_DWORD fourcc )
+    {
+        memset(this,0,sizeof(FDdsHeader));
+        Magic = U3D_DDS_MAGIC;
+        Size = 124;
+        Flags = 0x100F;                 // CAPS, HEIGHT, WIDTH, PITCH, PIXELFORMAT
+        Height = height;
+        Width = width;
+        Pitch = width * 8;
+        PfSize = 32;
+        PfFlags = 0x4;                  // FOURCC
+        FourCC = fourcc;
+        Caps = 0x1000;                  // TEXTURE
+    }
+};
+#pragma pack(pop)
+
+
+// Round to nearest even, out of range values become infinity
+U_WORD U3DFloatToHalf( float f )
+{
+    U_DWORD x;
+    memcpy(&x,&f,sizeof(x));
+    U_DWORD sign = (x >> 16) & 0x8000;
+    U_DWORD mant = x & 0x7FFFFF;
+    int exp = static_cast<int>((x >> 23) & 0xFF) - 127 + 15;
+
+    if( ((x >> 23) & 0xFF) == 0xFF )
+        return static_cast<U_WORD>(sign | 0x7C00 | (mant ? 0x200 : 0));
+    if( exp >= 31 )
+        return static_cast<U_WORD>(sign | 0x7C00);
+    if( exp <= 0 )
+    {
+        if( exp < -10 )
+            return static_cast<U_WORD>(sign);
+
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        U_DWORD h = mant >> shift;
+        U_DWORD rem = mant & ((1u << shift) - 1);
+        U_DWORD half = 1u << (shift - 1);
+        if( rem > half || (rem == half && (h & 1)) )
+            ++h;
+        return static_cast<U_WORD>(sign | h);
+    }
+
+    // A carry out of the mantissa bumps the exponent, as it should
+    U_DWORD h = (static_cast<U_DWORD>(exp) << 10) | (mant >> 13);
+    U_DWORD rem = mant & 0x1FFF;
+    if( rem > 0x1000 || (rem == 0x1000 && (h & 1)) )
+        ++h;
+    return static_cast<U_WORD>(sign | h);
+}
+
+float U3DHalfToFloat( U_WORD h )
+{
+    int exp = (h >> 10) & 0x1F;
+    int mant = h & 0x3FF;
+    float v;
+    if( exp == 0 )
+        v = ldexp(static_cast<float>(mant),-24);
+    else if( exp == 31 )
+        v = mant ? sqrtf(-1.0f) : HUGE_VAL;
+    else
+        v = ldexp(static_cast<float>(mant | 0x400),exp-25);
+    return (h & 0x8000) ? -v : v;
+}
+
+
+class FVatWriter
+{
+public:
+    enum EFormat
+    {
+        Off,
+        Half,
+        Unorm16
+    };
+
+    struct FVatSeq
+    {
+        FString     Name;
+        FString     Rate;
+        int         Start;
+        int         NumFrames;
+    };
+
+    int                     Format;
+    int                     NumVerts;
+    int                     NumFrames;
+    int                     Width;
+    int                     RowsPerFrame;
+    int                     FramesPerPage;
+    int                     PageHeight;
+    int                     Pages;
+    float                   Min[3];
+    float                   Max[3];
+    std::vector<FVatSeq>    Seqs;
+
+private:
+    std::vector<U_WORD>     Row;
+
+    // Rest pose mesh, verts are split where their UVs differ
+    std::vector<float>      MeshPoints;
+    std::vector<float>      MeshUV0;
+    std::vector<float>      MeshUV1;
+    std::vector<U_DWORD>    MeshIndices;        // grouped by material
+    std::vector<int>        MeshMaterials;      // TextureNum of each group
+    std::vector<int>        MeshGroups;         // first index of each group, and the end
+
+public:
+    FVatWriter()
+    : Format(Off)
+    , NumVerts(0)
+    , NumFrames(0)
+    , Width(0)
+    , RowsPerFrame(0)
+    , FramesPerPage(0)
+    , PageHeight(0)
+    , Pages(0)
+    {
+    }
+
+    void Clear()
+    {
+        Seqs.clear();
+    }
+
+    // Sequence frames index the texture frames, like STARTFRAME in the script
+    void AddSequence( const FStrView& name, int start, int numframes, const FStrView& rate )
+    {
+        FVatSeq seq;
+        seq.Name.assign(name.Str,name.Len);
+        seq.Rate.assign(rate.Str,rate.Len);
+        seq.Start = start;
+        seq.NumFrames = numframes;
+        Seqs.push_back(seq);
+    }
+
+    // mn/mx are the bounds of all frames
+    void Begin( int format, int vertcount, int framecount, const float* mn, const float* mx )
+    {
+        Format = format;
+        NumVerts = vertcount;
+        NumFrames = framecount;
+        for( int a=0; a<3; ++a )
+        {
+            Min[a] = mn[a];
+            Max[a] = mx[a];
+        }
+
+        RowsPerFrame = (vertcount + U3D_VAT_MAXWIDTH-1) / U3D_VAT_MAXWIDTH;
+        RowsPerFrame = RowsPerFrame > 0 ? RowsPerFrame : 1;
+        Width = (vertcount + RowsPerFrame-1) / RowsPerFrame;
+        Width = (Width + U3D_VAT_ALIGN-1) / U3D_VAT_ALIGN * U3D_VAT_ALIGN;
+        Width = Width > 0 ? Width : U3D_VAT_ALIGN;
+
+        FramesPerPage = U3D_VAT_MAXHEIGHT / RowsPerFrame;
+        FramesPerPage = FramesPerPage < framecount ? FramesPerPage : framecount;
+        FramesPerPage = FramesPerPage > 0 ? FramesPerPage : 1;
+        Pages = (framecount + FramesPerPage-1) / FramesPerPage;
+        PageHeight = (Pages > 1 ? FramesPerPage : framecount) * RowsPerFrame;
+
+        Row.assign(static_cast<size_t>(Width)*RowsPerFrame*4,0);
+    }
+
+    // float16 tops out at 65504 units
+    bool IsInRange() const
+    {
+        for( int a=0; a<3 && Format == Half; ++a )
+        {
+            if( Min[a] < -U3D_VAT_HALFMAX || Max[a] > U3D_VAT_HALFMAX )
+                return false;
+        }
+        return true;
+    }
+
+    FString GetPageName( const TCHAR* name, int page ) const
+    {
+        TCHAR num[16] = _T("");
+        if( Pages > 1 )
+            _stprintf(num,_T("%d"),page);
+        return FString(name) + _T("_vat") + num + _T(".dds");
+    }
+
+    int GetPageFrames( int page ) const
+    {
+        int left = NumFrames - page*FramesPerPage;
+        return left < FramesPerPage ? left : FramesPerPage;
+    }
+
+    bool WritePageHeader( FOutFile& f ) const
+    {
+        FDdsHeader header(Width,PageHeight,Format == Half ? U3D_DDS_RGBA16F : U3D_DDS_RGBA16);
+        return f.Write(&header,sizeof(header));
+    }
+
+    // XYZ per vert, frames in order
+    bool WriteFrame( FOutFile& f, const float* points )
+    {
+        U_WORD* texel = &Row[0];
+        if( Format == Half )
+        {
+            U_WORD one = U3DFloatToHalf(1.0f);
+            for( int i=0; i<NumVerts; ++i, texel+=4 )
+            {
+                texel[0] = U3DFloatToHalf(points[i*3+0]);
+                texel[1] = U3DFloatToHalf(points[i*3+1]);
+                texel[2] = U3DFloatToHalf(points[i*3+2]);
+                texel[3] = one;
+            }
+        }
+        else
+        {
+            float scale[3];
+            for( int a=0; a<3; ++a )
+                scale[a] = Max[a] > Min[a] ? 65535.0f / (Max[a]-Min[a]) : 0.0f;
+            for( int i=0; i<NumVerts; ++i, texel+=4 )
+            {
+                for( int a=0; a<3; ++a )
+                {
+                    float v = (points[i*3+a]-Min[a]) * scale[a] + 0.5f;
+                    texel[a] = static_cast<U_WORD>(v <= 0 ? 0 : v >= 65535.0f ? 65535 : static_cast<int>(v));
+                }
+                texel[3] = 0xFFFF;
+            }
+        }
+        return f.Write(&Row[0],Row.size()*sizeof(U_WORD));
+    }
+
+    // Pads the last page to the shared page height
+    bool EndPage( FOutFile& f, int page )
+    {
+        std::vector<U_WORD> empty(Row.size(),0);
+        bool ok = true;
+        for( int i=GetPageFrames(page); i<PageHeight/RowsPerFrame && ok; ++i )
+            ok = f.Write(&empty[0],empty.size()*sizeof(U_WORD));
+        return ok;
+    }
+
+    // Texel of vert i in frame t
+    void GetTexel( int t, int i, int& page, int& x, int& y ) const
+    {
+        page = t / FramesPerPage;
+        x = i % Width;
+        y = (t % FramesPerPage) * RowsPerFrame + i / Width;
+    }
+
+    void Decode( const U_WORD* texel, float* out ) const
+    {
+        for( int a=0; a<3; ++a )
+        {
+            if( Format == Half )
+                out[a] = U3DHalfToFloat(texel[a]);
+            else
+                out[a] = Min[a] + texel[a] * ((Max[a]-Min[a]) / 65535.0f);
+        }
+    }
+
+    // Rest pose from points, tris index them
+    void BuildMesh( const float* points, const FJSMeshTri* tris, int count )
+    {
+        MeshPoints.clear();
+        MeshUV0.clear();
+        MeshUV1.clear();
+        MeshIndices.clear();
+        MeshMaterials.clear();
+        MeshGroups.clear();
+
+        // Render vert of each vert and UV pair
+        std::vector< std::vector<U_DWORD> > split(NumVerts);
+        std::vector<bool> used(256,false);
+        for( int i=0; i<count; ++i )
+            used[tris[i].TextureNum] = true;
+
+        for( int m=0; m<256; ++m )
+        {
+            if( !used[m] )
+                continue;
+
+            MeshMaterials.push_back(m);
+            MeshGroups.push_back(static_cast<int>(MeshIndices.size()));
+            for( int i=0; i<count; ++i )
+            {
+                if( tris[i].TextureNum != m )
+                    continue;
+
+                for( int k=0; k<3; ++k )
+                {
+                    int v = tris[i].iVertex[k];
+                    U_DWORD uv = tris[i].Tex[k].U | (tris[i].Tex[k].V << 8);
+                    std::vector<U_DWORD>& list = split[v];
+                    size_t s = 0;
+                    while( s < list.size() && (list[s] & 0xFFFF) != uv )
+                        ++s;
+                    if( s == list.size() )
+                    {
+                        list.push_back(uv | (static_cast<U_DWORD>(MeshPoints.size()/3) << 16));
+                        AddMeshVert(points,v,tris[i].Tex[k]);
+                    }
+                    MeshIndices.push_back(list[s] >> 16);
+                }
+            }
+        }
+        MeshGroups.push_back(static_cast<int>(MeshIndices.size()));
+    }
+
+    bool WriteMeshBin( FOutFile& f ) const
+    {
+        return f.Write(MeshPoints.empty() ? NULL : &MeshPoints[0],MeshPoints.size()*sizeof(float))
+            && f.Write(MeshUV0.empty() ? NULL : &MeshUV0[0],MeshUV0.size()*sizeof(float))
+            && f.Write(MeshUV1.empty() ? NULL : &MeshUV1[0],MeshUV1.size()*sizeof(float))
+            && f.Write(MeshIndices.empty() ? NULL : &MeshIndices[0],MeshIndices.size()*sizeof(U_DWORD));
+    }
+
+    // glTF 2.0 with the buffer in binname
+    bool WriteMeshGltf( FOutFile& f, const TCHAR* name, const TCHAR* binname ) const
+    {
+        int verts = static_cast<int>(MeshPoints.size()/3);
+        size_t uvbytes = verts*8;
+        size_t indexstart = verts*12 + uvbytes*2;
+
+        float mn[3] = { 0,0,0 };
+        float mx[3] = { 0,0,0 };
+        for( int i=0; i<verts; ++i )
+        {
+            for( int a=0; a<3; ++a )
+            {
+                float v = MeshPoints[i*3+a];
+                mn[a] = i == 0 || v < mn[a] ? v : mn[a];
+                mx[a] = i == 0 || v > mx[a] ? v : mx[a];
+            }
+        }
+
+        f.Printf( _T("{\n  \"asset\": { \"version\": \"2.0\", \"generator\": \"Unreal3DExport\" },\n") );
+        f.Printf( _T("  \"scene\": 0,\n  \"scenes\": [ { \"nodes\": [ 0 ] } ],\n") );
+        f.Printf( _T("  \"nodes\": [ { \"name\": \"%s\", \"mesh\": 0 } ],\n"), name );
+        f.Printf( _T("  \"meshes\": [ { \"name\": \"%s\", \"primitives\": ["), name );
+        for( size_t g=0; g<MeshMaterials.size(); ++g )
+        {
+            f.Printf( _T("%s\n    { \"attributes\": { \"POSITION\": 0, \"TEXCOORD_0\": 1, \"TEXCOORD_1\": 2 }, \"indices\": %d, \"material\": %d }")
+                , g ? _T(",") : _T(""), static_cast<int>(3+g), static_cast<int>(g) );
+        }
+        f.Printf( _T("\n  ] } ],\n  \"materials\": [") );
+        for( size_t g=0; g<MeshMaterials.size(); ++g )
+            f.Printf( _T("%s\n    { \"name\": \"Texture%d\" }"), g ? _T(",") : _T(""), MeshMaterials[g] );
+        f.Printf( _T("\n  ],\n  \"buffers\": [ { \"uri\": \"%s\", \"byteLength\": %u } ],\n"), binname
+            , static_cast<unsigned>(indexstart + MeshIndices.size()*4) );
+
+        f.Printf( _T("  \"bufferViews\": [\n") );
+        f.Printf( _T("    { \"buffer\": 0, \"byteOffset\": 0, \"byteLength\": %u, \"target\": 34962 },\n"), static_cast<unsigned>(verts*12) );
+        f.Printf( _T("    { \"buffer\": 0, \"byteOffset\": %u, \"byteLength\": %u, \"target\": 34962 },\n"), static_cast<unsigned>(verts*12), static_cast<unsigned>(uvbytes) );
+        f.Printf( _T("    { \"buffer\": 0, \"byteOffset\": %u, \"byteLength\": %u, \"target\": 34962 }"), static_cast<unsigned>(verts*12+uvbytes), static_cast<unsigned>(uvbytes) );
+        for( size_t g=0; g<MeshMaterials.size(); ++g )
+        {
+            f.Printf( _T(",\n    { \"buffer\": 0, \"byteOffset\": %u, \"byteLength\": %u, \"target\": 34963 }")
+                , static_cast<unsigned>(indexstart + MeshGroups[g]*4), static_cast<unsigned>((MeshGroups[g+1]-MeshGroups[g])*4) );
+        }
+
+        f.Printf( _T("\n  ],\n  \"accessors\": [\n") );
+        f.Printf( _T("    { \"bufferView\": 0, \"componentType\": 5126, \"count\": %d, \"type\": \"VEC3\", \"min\": [%f, %f, %f], \"max\": [%f, %f, %f] },\n")
+            , verts, mn[0], mn[1], mn[2], mx[0], mx[1], mx[2] );
+        f.Printf( _T("    { \"bufferView\": 1, \"componentType\": 5126, \"count\": %d, \"type\": \"VEC2\" },\n"), verts );
+        f.Printf( _T("    { \"bufferView\": 2, \"componentType\": 5126, \"count\": %d, \"type\": \"VEC2\" }"), verts );
+        for( size_t g=0; g<MeshMaterials.size(); ++g )
+        {
+            f.Printf( _T(",\n    { \"bufferView\": %d, \"componentType\": 5125, \"count\": %d, \"type\": \"SCALAR\" }")
+                , static_cast<int>(3+g), MeshGroups[g+1]-MeshGroups[g] );
+        }
+        return f.Printf( _T("\n  ]\n}\n") );
+    }
+
+    bool WriteJson( FOutFile& f, const TCHAR* name ) const
+    {
+        f.Printf( _T("{\n  \"name\": \"%s\",\n"), name );
+        f.Printf( _T("  \"format\": \"%s\",\n"), Format == Half ? _T("float16") : _T("unorm16") );
+        f.Printf( _T("  \"frames\": %d,\n  \"verts\": %d,\n"), NumFrames, NumVerts );
+        f.Printf( _T("  \"width\": %d,\n  \"height\": %d,\n"), Width, PageHeight );
+        f.Printf( _T("  \"rows_per_frame\": %d,\n  \"frames_per_page\": %d,\n"), RowsPerFrame, FramesPerPage );
+        f.Printf( _T("  \"frame_step_v\": %.9g,\n"), static_cast<double>(RowsPerFrame)/PageHeight );
+        f.Printf( _T("  \"bounds_min\": [%.9g, %.9g, %.9g],\n"), Min[0], Min[1], Min[2] );
+        f.Printf( _T("  \"bounds_max\": [%.9g, %.9g, %.9g],\n"), Max[0], Max[1], Max[2] );
+        f.Printf( _T("  \"mesh\": \"%s_vat.gltf\",\n"), name );
+        f.Printf( _T("  \"pages\": [") );
+        for( int p=0; p<Pages; ++p )
+            f.Printf( _T("%s \"%s\""), p ? _T(",") : _T(""), GetPageName(name,p).c_str() );
+        f.Printf( _T(" ],\n  \"sequences\": [") );
+        for( size_t s=0; s<Seqs.size(); ++s )
+        {
+            const FVatSeq& seq = Seqs[s];
+            f.Printf( _T("%s\n    { \"name\": \"%s\", \"start\": %d, \"frames\": %d, \"rate\": %s }")
+                , s ? _T(",") : _T(""), seq.Name.c_str(), seq.Start, seq.NumFrames
+                , seq.Rate.empty() ? _T("30") : seq.Rate.c_str() );
+        }
+        return f.Printf( _T("%s]\n}\n"), Seqs.empty() ? _T("") : _T("\n  ") );
+    }
+
+private:
+    void AddMeshVert( const float* points, int v, const FMeshUV& uv )
+    {
+        for( int a=0; a<3; ++a )
+            MeshPoints.push_back(points[v*3+a]);
+        MeshUV0.push_back(uv.U / 255.0f);
+        MeshUV0.push_back(uv.V / 255.0f);
+
+        int page, x, y;
+        GetTexel(0,v,page,x,y);
+        MeshUV1.push_back((x + 0.5f) / Width);
+        MeshUV1.push_back((y + 0.5f) / PageHeight);
+    }
+};
+
+
+// A page written by FVatWriter, for tests and tools
+class FVatReader
+{
+public:
+    int             Width;
+    int             Height;
+    U_DWORD         FourCC;
+
+private:
+    const U_WORD*   Texels;
+
+public:
+    FVatReader() : Width(0), Height(0), FourCC(0), Texels(NULL)
+    {
+    }
+
+    bool Open( const U_BYTE* data, size_t size )
+    {
+        if( size < sizeof(FDdsHeader) )
+            return false;
+
+        FDdsHeader header(0,0,0);
+        memcpy(&header,data,sizeof(header));
+        if( header.Magic != U3D_DDS_MAGIC || header.Size != 124
+        ||  (header.FourCC != U3D_DDS_RGBA16 && header.FourCC != U3D_DDS_RGBA16F)
+        ||  size != sizeof(header) + static_cast<size_t>(header.Width)*header.Height*8 )
+            return false;
+
+        Width = header.Width;
+        Height = header.Height;
+        FourCC = header.FourCC;
+        Texels = reinterpret_cast<const U_WORD*>(data + sizeof(header));
+        return true;
+    }
+
+    const U_WORD* GetTexel( int x, int y ) const
+    {
+        return Texels + (static_cast<size_t>(y)*Width + x)*4;
+    }
+};
@@ -14,10 +14,26 @@
 #include <math.h>
 #include "Unreal3DExport.h"
 #include "U3DFormat.h"
+#include "U3DCancel.h"
+#include "U3DOutput.h"
+#include "U3DCore.h"
+#include "U3DScene.h"
+#include "U3DArena.h"
+#include "U3DFrames.h"
+#include "U3DPca.h"
+#include "U3DCost.h"
+#include "U3DSplit.h"
+#include "U3DLod.h"
+#include "U3DOrder.h"
+#include "U3DBounds.h"
+#include "U3DPredict.h"
+#include "U3DVat.h"
+#include "U3DLog.h"
 #include "decomp.h"
 #include "utilapi.h"
 #include <inode.h> 
 #include <notetrck.h> 
+#include <ilayer.h>
 
 #include "IGame.h"
 #include "IGameObject.h"
@@ -28,6 +44,7 @@
 #include "IGameError.h"
 #include "IGameFX.h"
 #include <IGameMaterial.h> 
+#include "U3DGameScene.h"
 
 #define Unreal3DExport_CLASS_ID Class_ID(0x4f803aa9, 0x95911a2e)
 
@@ -36,13 +53,13 @@
 
 struct sMaterial
 {
-    IGameMaterial* Mat;
+    int Mat;            // scene material, -1 for none
     TSTR* Tex;
     int Flags;
     bool bSkin;
     static sMaterial DefaultMaterial;
 
-    sMaterial(IGameMaterial* cmat=NULL, TSTR* ctex=NULL, int cflags=0)
+    sMaterial(int cmat=-1, TSTR* ctex=NULL, int cflags=0)
     : Mat(cmat), Tex(ctex), Flags(cflags)
     {
     }
@@ -50,6 +67,71 @@ struct sMaterial
 
 sMaterial sMaterial::DefaultMaterial = sMaterial();
 
+// Triangle rotated to a canonical vertex order, for duplicate search
+struct sTriKey
+{
+    FJSMeshTri Tri;
+    int Index;
+};
+
+// Feeds sampled frames to the PCA encoder
+class FPointsFrameSource : public FPcaFrameSource
+{
+    FFrameStore&        Frames;
+    const float*        Axes;
+    int                 VertCount;
+    int                 FrameCount;
+
+public:
+    FPointsFrameSource( FFrameStore& frames, const float* axes, int vertcount, int framecount )
+    : Frames(frames), Axes(axes), VertCount(vertcount), FrameCount(framecount)
+    {
+    }
+
+    int GetFrameCount() { return FrameCount; }
+    int GetVertCount() { return VertCount; }
+
+    // Archived in UnrealCoords, like the packed frames
+    void GetFrame( int t, float* out )
+    {
+        U3DTransformPoints(&Frames.GetFrame(t)->x,VertCount,Axes,out);
+    }
+};
+
+// Range of one node's verts and faces in the assembled arrays
+struct sNodeSpan
+{
+    FSceneFace* Faces;
+    int VertCount;
+    int VertOffset;
+    int TriCount;
+    int TriOffset;
+    float* Rigid;       // object space verts if the mesh only moves as a whole
+    int Shared;         // mesh whose object space verts this one transforms, or -1
+    float* Local;       // object space verts of this mesh at LocalFrame
+    int LocalCount;
+    int LocalFrame;
+};
+
+// Include/Exclude line from the config, checked before a node is evaluated
+struct sNodeRule
+{
+    enum { Name, Layer, Prop };
+
+    bool bInclude;
+    int Kind;
+    const TCHAR* Text;      // as written in the config
+    const TCHAR* Pattern;   // name, layer or property key
+    const TCHAR* Value;     // property value pattern, NULL if the key is enough
+};
+
+// Extra model written from the same frames, one per named selection set
+struct sVariant
+{
+    const TCHAR* Name;
+    BYTE* Meshes;       // 1 for each mesh whose node is in the set
+};
+
 
 class Unreal3DExport : public SceneExport 
 {
@@ -59,36 +141,88 @@ public:
     // 3DXI
     Interface *         pInt;
     IGameScene *        pScene;
+    FCancelToken        Cancel;
 
     // Files
-    FILE*               fMesh;
-    FILE*               fAnim;
-    FILE*               fLog;
-    FILE*               fScript;
+    FOutFile            fMesh;
+    FOutFile            fAnim;
+    FLogWriter          Log;
+    FOutFile            fScript;
+    FOutFile            fCost;
+    FOutFile            fSplit;
+    FOutFile            fVat;
+    FOutFile            fBounds;
+    FOutFile            fArchive;
+    FOutManifest        Outputs;
+    FOutStage           Staged;             // finished outputs, committed together at the end
 
     // Scene data
     Tab<IGameNode*>     Nodes;
     Tab<IGameNode*>     TrackedNodes;
+    FSceneSource*       Source;
+    FGameSceneSource*   GameSource;
+    FSceneRecorder*     Recorder;
+    FCostAnalyzer       Cost;
+    FVertSplit          Split;
+    FVatWriter          Vat;
+    FBoundsBuilder      Bounds;
+    int*                MaterialSlots;      // FaceMaterials slot per scene material
+    float*              TrackTMs;           // per frame, per tracked node, 4 rows of XYZ
     Tab<FMeshVert>      Verts;
     Tab<FJSMeshTri>     Tris;
-    Tab<Point3>         Points;
+    Tab<FJSMeshTri>     SceneTris;          // all of Tris while variants are written
+    Tab<sVariant>       Variants;
+    Tab<sNodeRule>      NodeRules;
+    int*                TriNodes;           // mesh of each triangle
+    int*                VertMap;            // frame vert of each output vert, NULL for all
+    Point3*             Gathered;           // frame verts picked by VertMap
+    FFrameStore         Frames;
+    FPackedFrames       Packed;             // frames packed while sampling, see bPacked
     Tab<NoteTrack*>     NoteTracks;
     Tab<sMaterial>      Materials;
+    Tab<sMaterial>      FaceMaterials;
+    sNodeSpan*          Spans;
     
     int                 NodeIdx;
     int                 NodeCount;
+    int                 FilteredNodes;
     int                 VertsPerFrame;
-    TSTR                SeqName;
+    int                 SceneVerts;
+    FStrView            SeqName;
     int                 SeqFrame;
     int                 FrameStart;
     int                 FrameEnd;
     int                 FrameCount;
+    int                 FrameStep;          // scene frames per sampled frame
+    int                 StrippedDegenerate;
+    int                 StrippedDuplicate;
+    int                 StrippedVerts;
+    int                 OutputsWritten;
+    int                 OutputsUnchanged;
+    size_t              LiveBytes;
+    size_t              PeakBytes;
     
     // Global options
     bool                bExportSelected;
     bool                bShowPrompts;
     bool                bIgnoreHidden;
     bool                bMaxResolution;
+    bool                bStripGeometry;
+    bool                bWriteArchive;
+    bool                bRecordScene;
+    bool                bSplitStatic;
+    bool                bStaticFirst;
+    bool                bWriteBounds;
+    bool                bSinglePass;
+    bool                bPacked;            // bSinglePass and nothing needs the float frames
+    int                 LodPercent[U3D_LOD_MAXLODS];    // tris kept by each LOD, largest first
+    int                 LodCount;
+    int                 VatFormat;          // FVatWriter::EFormat, Off writes none
+    int                 MemoryBudget;       // MB, 0 keeps all frames in RAM
+    int                 PreviewStep;        // sample every Nth frame of one sequence, 0 is off
+
+    // Transient strings and scratch buffers, released after export
+    FArena              Arena;
 
     // Progress Bar
     float               Progress;
@@ -98,14 +232,24 @@ public:
     Point3              OptScale;
     Point3              OptOffset;
     Point3              OptRot;
+    Point3              BoundsMin;          // all frames, from Prepare or predicted
+    Point3              BoundsMax;
+    float               Axes[12];           // Max world to UnrealCoords, 4 rows of XYZ
 
     // File names
     TSTR                FilePath;
     TSTR                FileName;
+    TSTR                ExportName;
     TSTR                FileExt;
     TSTR                ModelFileName;
     TSTR                AnimFileName;
     TSTR                ScriptFileName;
+    TSTR                CostFileName;
+    TSTR                SplitFileName;
+    TSTR                BoundsFileName;
+    TSTR                ArchiveFileName;
+    TSTR                ManifestFileName;
+    TSTR                SceneFileName;
 
     // File Headers
     FJSDataHeader       hData;
@@ -134,20 +278,45 @@ public:
 protected:
     // Custom
     void CheckCancel();
+    bool AskCancel();
+    static bool AskCancelFn( void* ctx );
     void ExportNode( IGameNode * child);
-    void RegisterMaterial( IGameNode* node, IGameMesh* mesh, FaceEx* f, FJSMeshTri* tri );
+    bool IsNodeWanted( IGameNode* node );
+    void AddNodeRule( bool include, FStrView text );
+    int RegisterMaterial( int matid, int material );
     void SortMaterials();
     void Init();
+    void SetPreviewRange();
+    void FindVariants();
+    void SelectVariant( int v );
+    void SetOutputNames( const TSTR& name );
+    void SelectTris( const FJSMeshTri* tris, int count );
+    const Point3* GetOutputFrame( int t );
+    const FMeshVert* GetPackedFrame( int t );
     void GetTris();
+    void AssembleTris( int n );
+    static void AssembleTrisFn( void* ctx, int n );
     void GetAnim();
+    void SampleFrame( int t, Point3* frame );
+    void AddProbes( Point3* frame );
+    void FindShared();
+    void Strip();
+    void WriteArchive();
+    void WriteLods();
     void Prepare();
+    void SortStaticFirst();
     void WriteScript();
     void WriteModel();
+    void WriteVat();
+    void TrackMemory( const TCHAR* phase );
+    void StageOutput( FOutFile& f, const TSTR& filename, int errid );
+    void CommitOutputs();
     void WriteTracking();
     void ShowSummary();
 
     // Config
     BOOL ReadConfig();
+    void ParseLodPercent( FStrView text );
     void WriteConfig();
     TSTR GetCfgFileName();
 
@@ -175,34 +344,75 @@ ClassDesc2* GetUnreal3DExportDesc() { return &Unreal3DExportDesc; }
 
 
 #include "U3DUtil.h"
+#include "U3DThread.h"
 
 
 //--- Unreal3DExport -------------------------------------------------------
 Unreal3DExport::Unreal3DExport()
 : pInt(NULL)
 , pScene(NULL)
-, fMesh(NULL)
-, fAnim(NULL)
-, fLog(NULL)
-, fScript(NULL)
+, Source(NULL)
+, GameSource(NULL)
+, Recorder(NULL)
+, MaterialSlots(NULL)
+, TrackTMs(NULL)
+, Spans(NULL)
+, TriNodes(NULL)
+, VertMap(NULL)
+, Gathered(NULL)
 , bExportSelected(false)
 , bShowPrompts(false)
 , bIgnoreHidden(false)
 , bMaxResolution(true)
+, bStripGeometry(true)
+, bWriteArchive(false)
+, bRecordScene(false)
+, bSplitStatic(false)
+, bStaticFirst(false)
+, bWriteBounds(false)
+, bSinglePass(false)
+, bPacked(false)
+, LodCount(0)
+, VatFormat(FVatWriter::Off)
+, MemoryBudget(512)
+, PreviewStep(0)
 , NodeIdx(0)
 , NodeCount(0)
+, FilteredNodes(0)
 , VertsPerFrame(0)
+, SceneVerts(0)
 , SeqFrame(0)
 , FrameStart(0)
 , FrameEnd(0)
 , FrameCount(0)
+, FrameStep(1)
+, StrippedDegenerate(0)
+, StrippedDuplicate(0)
+, StrippedVerts(0)
+, OutputsWritten(0)
+, OutputsUnchanged(0)
+, LiveBytes(0)
+, PeakBytes(0)
 , Progress(0)
 , OptScale(1,1,1)
 , OptOffset(0,0,0)
 , OptRot(0,0,0)
+, BoundsMin(0,0,0)
+, BoundsMax(0,0,0)
 , hData(FJSDataHeader())
 , hAnim(FJSAnivHeader())
 {
+    GetUnrealAxes(Axes);
+
+    // Writes stop within U3D_CANCEL_LATENCY_MS of a cancel
+    fMesh.SetCancel(&Cancel);
+    fAnim.SetCancel(&Cancel);
+    fScript.SetCancel(&Cancel);
+    fCost.SetCancel(&Cancel);
+    fSplit.SetCancel(&Cancel);
+    fVat.SetCancel(&Cancel);
+    fBounds.SetCancel(&Cancel);
+    fArchive.SetCancel(&Cancel);
 }
 
 Unreal3DExport::~Unreal3DExport() 
@@ -218,20 +428,25 @@ BOOL CALLBACK Unreal3DExportOptionsDlgProc(HWND hWnd,UINT message,WPARAM wParam,
 			imp = (Unreal3DExport *)lParam;
 			CenterWindow(hWnd,GetParent(hWnd));
 
+            // Handedness follows from the axes, GetUnrealAxes has no use for H
             SetDlgItemInt(hWnd, IDC_EDIT_H, UnrealCoords.rotation, FALSE );
+            EnableWindow(GetDlgItem(hWnd, IDC_EDIT_H), FALSE );
             SetDlgItemInt(hWnd, IDC_EDIT_X, UnrealCoords.xAxis, FALSE );
             SetDlgItemInt(hWnd, IDC_EDIT_Y, UnrealCoords.yAxis, FALSE );
             SetDlgItemInt(hWnd, IDC_EDIT_Z, UnrealCoords.zAxis, FALSE );
+
+            // Previews are asked for on each export, never saved
+            SetDlgItemInt(hWnd, IDC_EDIT_PREVIEW, 0, FALSE );
 			return TRUE;
 
 		case WM_COMMAND:
 			switch (LOWORD(wParam)) 
             {
 		        case IDOK:
-                    UnrealCoords.rotation = GetDlgItemInt(hWnd, IDC_EDIT_H, NULL, FALSE );
                     UnrealCoords.xAxis = GetDlgItemInt(hWnd, IDC_EDIT_X, NULL, FALSE );
                     UnrealCoords.yAxis = GetDlgItemInt(hWnd, IDC_EDIT_Y, NULL, FALSE );
                     UnrealCoords.zAxis = GetDlgItemInt(hWnd, IDC_EDIT_Z, NULL, FALSE );
+                    imp->PreviewStep = GetDlgItemInt(hWnd, IDC_EDIT_PREVIEW, NULL, FALSE );
 			        EndDialog(hWnd, 1);
 			        break;
 
@@ -262,17 +477,23 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
         FileName = FileName.Substr(0,FileName.length()-2);
     }
 
-    ModelFileName = FilePath + _T("\\") + FileName + TSTR(_T("_d")) + FileExt;
-    AnimFileName = FilePath + _T("\\") + FileName + TSTR(_T("_a")) + FileExt;
-    ScriptFileName = FilePath + _T("\\") + FileName + TSTR(_T("_rc.uc"));
+    ExportName = FileName;
+    SetOutputNames(ExportName);
+    ArchiveFileName = FilePath + _T("\\") + FileName + TSTR(_T(".u3dpca"));
+    ManifestFileName = FilePath + _T("\\") + FileName + TSTR(_T(".u3dhash"));
+    SceneFileName = FilePath + _T("\\") + FileName + TSTR(_T(".u3dscene"));
 
 
     // Open Log
-    fLog = _tfopen(FilePath + _T("\\") + FileName + _T(".log") ,_T("wb"));
+    Log.Open(FilePath + _T("\\") + FileName + _T(".log"));
+
+    // Hashes of the previous export, unchanged outputs are not rewritten
+    Outputs.Load(ManifestFileName);
 
     // Init
     pInt = GetCOREInterface();
     pInt->ProgressStart( GetString(IDS_INFO_INIT), TRUE, fn, this);
+    Cancel.Reset(AskCancelFn,this);
     Progress += U3D_PROGRESS_INIT;
 
     try 
@@ -289,24 +510,54 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
                 GetActiveWindow(), 
                 Unreal3DExportOptionsDlgProc, (LPARAM)this);*/
 
-	    //if(showPrompts) 
-	    {
-		    // Prompt the user with our dialogbox, and get all the options.
-		    if(!DialogBoxParam(hInstance, 
-				MAKEINTRESOURCE(IDD_PANEL), 
-				GetActiveWindow(), 
-				Unreal3DExportOptionsDlgProc, (LPARAM)this)) 
-            {
-			    throw CancelException();
-		    }
-	    }
+        // Prompt the user with our dialogbox, and get all the options.
+        PreviewStep = 0;
+        if(!DialogBoxParam(hInstance, 
+            MAKEINTRESOURCE(IDD_PANEL), 
+            GetActiveWindow(), 
+            Unreal3DExportOptionsDlgProc, (LPARAM)this)) 
+        {
+            throw CancelException();
+        }
 
         // Enumerate interesting nodes
         Init();
+        if( PreviewStep == 0 )
+            FindVariants();
 
         // Fetch data from nodes
         GetTris();
+        TrackMemory(_T("GetTris"));
         GetAnim();
+        TrackMemory(_T("GetAnim"));
+
+        // Remove geometry the engine would process for nothing
+        Strip();
+        TrackMemory(_T("Strip"));
+
+        // Fewer texture switches and vertex cache misses in the engine
+        SortMaterials();
+
+        // Optional compressed copy of the sampled frames
+        if( bWriteArchive && PreviewStep == 0 )
+            WriteArchive();
+
+        // Variants go first so the summary describes the main model
+        float progress = Progress;
+        for( int v=0; v<Variants.Count(); ++v )
+        {
+            SelectVariant(v);
+            Prepare();
+            WriteScript();
+            WriteModel();
+            Progress = progress;
+        }
+        if( Variants.Count() > 0 )
+            SelectVariant(-1);
+
+        // Distance LODs of the main model share its frames too
+        if( LodCount > 0 && PreviewStep == 0 )
+            WriteLods();
 
         // Prepare data for writing
         Prepare();     
@@ -314,10 +565,17 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
         // Write to files
         WriteScript();
         WriteModel();   
-        WriteTracking();
+        TrackMemory(_T("WriteModel"));
+        if( PreviewStep == 0 )
+            WriteTracking();
+
+        // Every output is written, the previous ones are replaced together
+        CheckCancel();
+        CommitOutputs();
 
         // Show optional summary
-        ShowSummary();
+        if( PreviewStep == 0 )
+            ShowSummary();
 
         WriteConfig();
 
@@ -329,13 +587,39 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
     }
     catch( MAXException& e )
     {
-        if( bShowPrompts && !e.message.isNull() )
+        // Writers fail once cancelled, that is not an error
+        if( Cancel.IsCancelled() )
         {
-            MaxMsgBox(pInt->GetMAXHWnd(),e.message,ShortDesc(),MB_OK|MB_ICONERROR);
+            Result = IMPEXP_CANCEL;
+        }
+        else
+        {
+            if( bShowPrompts && !e.message.isNull() )
+            {
+                MaxMsgBox(pInt->GetMAXHWnd(),e.message,ShortDesc(),MB_OK|MB_ICONERROR);
+            }
+
+            Result = IMPEXP_FAIL;
         }
+    }
+    if( Result == IMPEXP_CANCEL )
+        Log.Printf( FLogWriter::Info, FLogWriter::General, _T("Cancelled, unfinished outputs were dropped\n") );
 
-        Result = IMPEXP_FAIL;
+    // Release scene access, recording must be complete for a successful export
+    if( Recorder != NULL )
+    {
+        if( !Recorder->Close() && Result == IMPEXP_SUCCESS )
+            Log.Printf( FLogWriter::Error, FLogWriter::Output, _T("Could not write %s\n"), SceneFileName.data() );
+
+        // A cut off recording cannot be replayed
+        if( Result == IMPEXP_CANCEL )
+            _tremove(SceneFileName);
+        delete Recorder;
+        Recorder = NULL;
     }
+    delete GameSource;
+    GameSource = NULL;
+    Source = NULL;
 
     // Release scene
     if( pScene != NULL )
@@ -344,11 +628,23 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
         pScene = NULL;
     }
 
-    // Close files
-    fclosen(fMesh);
-    fclosen(fAnim);
-    fclosen(fLog);
-    fclosen(fScript);
+    // Close files, unfinished outputs are dropped and the old ones kept
+    fMesh.Abort();
+    fAnim.Abort();
+    fScript.Abort();
+    fCost.Abort();
+    fSplit.Abort();
+    fVat.Abort();
+    fBounds.Abort();
+    fArchive.Abort();
+    Staged.Abort();
+    Log.Close();
+
+    // Release transient data
+    Frames.Release();
+    Packed.Release();
+    NodeRules.ZeroCount();
+    Arena.Release();
     
     // Return to MAX
     pInt->ProgressEnd();  
@@ -357,7 +653,7 @@ int Unreal3DExport::DoExport( const TCHAR *name, ExpInterface *ei, Interface *i,
 
 void Unreal3DExport::ExportNode( IGameNode * child )
 {
-    DebugPrint( _T("ExportNode: %s\n"), child->GetName() );
+    Log.Printf( FLogWriter::Debug, FLogWriter::Scene, _T("ExportNode: %s\n"), child->GetName() );
     CheckCancel();
 
     ProgressMsg.printf(GetString(IDS_INFO_ENUM_OBJ),NodeIdx,NodeCount,TSTR(child->GetName()));
@@ -368,6 +664,11 @@ void Unreal3DExport::ExportNode( IGameNode * child )
     {
         // do nothing
     }
+    else if( !IsNodeWanted(child) )
+    {
+        // Left out by the config rules, never evaluated
+        ++FilteredNodes;
+    }
     else
     {
         IGameObject * obj = child->GetIGameObject();
@@ -403,79 +704,207 @@ void Unreal3DExport::ExportNode( IGameNode * child )
 }
 
 
+// Wanted if no Include rule exists or one matches, and no Exclude rule does
+bool Unreal3DExport::IsNodeWanted( IGameNode* node )
+{
+    if( NodeRules.Count() == 0 )
+        return true;
+
+    bool included = true;
+    for( int i=0; i<NodeRules.Count(); ++i )
+    {
+        if( NodeRules[i].bInclude )
+            included = false;
+    }
+
+    INode* maxnode = node->GetMaxNode();
+    for( int i=0; i<NodeRules.Count(); ++i )
+    {
+        const sNodeRule& rule = NodeRules[i];
+        bool match = false;
+        switch( rule.Kind )
+        {
+            case sNodeRule::Name:
+                match = MatchPattern(TSTR(node->GetName()),TSTR(rule.Pattern),TRUE) != 0;
+                break;
+
+            case sNodeRule::Layer:
+            {
+                ILayer* layer = static_cast<ILayer*>(maxnode->GetLayer());
+                match = layer != NULL && MatchPattern(layer->GetName(),TSTR(rule.Pattern),TRUE);
+                break;
+            }
+
+            case sNodeRule::Prop:
+            {
+                TSTR value;
+                match = maxnode->UserPropExists(TSTR(rule.Pattern))
+                     && (rule.Value == NULL
+                      || (maxnode->GetUserPropString(TSTR(rule.Pattern),value) && MatchPattern(value,TSTR(rule.Value),TRUE)));
+                break;
+            }
+        }
+
+        if( match && !rule.bInclude )
+            return false;
+        if( match && rule.bInclude )
+            included = true;
+    }
+    return included;
+}
+
+// "pattern", "layer:pattern", "prop:key" or "prop:key=pattern"
+void Unreal3DExport::AddNodeRule( bool include, FStrView text )
+{
+    while( text.Len > 0 && (text.Str[text.Len-1] == _T('\n') || text.Str[text.Len-1] == _T('\r') || text.Str[text.Len-1] == _T(' ')) )
+        --text.Len;
+    if( text.isNull() )
+        return;
+
+    sNodeRule rule;
+    rule.bInclude = include;
+    rule.Kind = sNodeRule::Name;
+    rule.Text = Arena.Dup(text.Str,text.Len);
+    rule.Value = NULL;
+
+    FStrView pattern = text;
+    if( text.StartsWith(_T("layer:")) )
+    {
+        rule.Kind = sNodeRule::Layer;
+        SplitStr(pattern,_T(':'));
+    }
+    else if( text.StartsWith(_T("prop:")) )
+    {
+        rule.Kind = sNodeRule::Prop;
+        SplitStr(pattern,_T(':'));
+        FStrView key = SplitStr(pattern,_T('='));
+        if( pattern.Str != key.Str+key.Len )
+            rule.Value = Arena.Dup(pattern.Str,pattern.Len);
+        pattern = key;
+    }
+    rule.Pattern = Arena.Dup(pattern.Str,pattern.Len);
+    NodeRules.Append(1,&rule);
+}
+
+// Cheap enough for inner loops, Max is asked every U3D_CANCEL_POLL_MS
 void Unreal3DExport::CheckCancel()
 {
+    if( Cancel.Poll() )
+        throw CancelException();
+}
+
+// Loops between progress messages keep the bar and Esc alive from here
+bool Unreal3DExport::AskCancel()
+{
+    pInt->ProgressUpdate(Progress, FALSE);
     if( pInt->GetCancel() ) 
     {
         if( !bShowPrompts )
-            throw CancelException();
+            return true;
 
         switch(MessageBox(pInt->GetMAXHWnd(), GetString(IDS_CANCEL_Q), GetString(IDS_CANCEL_C), MB_ICONQUESTION | MB_YESNO)) 
         {
             case IDYES:
-                throw CancelException();
+                return true;
 
             case IDNO:
                 pInt->SetCancel(FALSE);
         }
     }
+    return false;
 }
 
-void Unreal3DExport::RegisterMaterial( IGameNode* node, IGameMesh* mesh, FaceEx* f, FJSMeshTri* tri )
+bool Unreal3DExport::AskCancelFn( void* ctx )
 {
-    tri->TextureNum = f->matID;
+    return static_cast<Unreal3DExport*>(ctx)->AskCancel();
+}
 
-    int matid = f->matID;
+int Unreal3DExport::RegisterMaterial( int matid, int material )
+{
+    if( material < 0 )
+        return 0;
 
-    IGameMaterial* mat = mesh->GetMaterialFromFace(f);
-    if( mat )
+    if( Materials.Count() <= matid )
     {
-        Tab<TSTR*> tokens = TokStr(mat->GetMaterialName(),_T(" \t,;"));
-        for( int i=0; i!=tokens.Count(); ++i )
-        {
-            if( MatchPattern(*tokens[i],TSTR(_T("F=*")),TRUE) )
-            {
-                SplitStr(*tokens[i],_T('='));
-                tri->Flags = static_cast<byte>(_ttoi(tokens[i]->data()));
-            }
-        }
-        tokens.Delete(0,tokens.Count());
+        Materials.Append(matid-Materials.Count()+1,&sMaterial::DefaultMaterial);
+    }
+    
+    if( Materials[matid].Mat != material )
+    {
+        Materials[matid].Mat = material;
+    }
 
-        if( Materials.Count() <= matid )
-        {
-            Materials.Append(matid-Materials.Count()+1,&sMaterial::DefaultMaterial);
-        }
-        
-        if( Materials[matid].Mat != mat )
-        {
-            Materials[matid].Mat = mat;
-        }
+    // Flags are parsed once per material, faces only keep the slot
+    if( MaterialSlots[material] != 0 )
+        return MaterialSlots[material];
 
-        /*for( int i=0; i!=mat->GetSubMaterialCount(); ++i )
+    sMaterial fm(material);
+    FStrView* tokens;
+    int tokencount = TokStr(Arena,Source->GetMaterialName(material),_T(" \t,;"),tokens);
+    for( int i=0; i!=tokencount; ++i )
+    {
+        if( tokens[i].StartsWith(_T("F=")) )
         {
-            IGameMaterial* sub = mat->GetSubMaterial(i);
-            if( sub )
-            {
-                TSTR matname = sub->GetMaterialName();
-                int subid = mat->GetMaterialID(i);
-                int x = 0;
-            }
-        }*/
+            SplitStr(tokens[i],_T('='));
+            fm.Flags = static_cast<byte>(tokens[i].ToInt());
+        }
     }
-}
 
+    FaceMaterials.Append(1,&fm);
+    MaterialSlots[material] = FaceMaterials.Count()-1;
+    return MaterialSlots[material];
+}
 
 
-static int CompareMaterials(IGameMaterial *k1, IGameMaterial *k2)
-{
-    TCHAR *a = k1->GetMaterialName();
-    TCHAR *b = k2->GetMaterialName();
-    return(_tcscmp(a,b));
-}
 
+// Numbers the materials by name and groups the tris by material, each
+// group in vertex cache order, see U3DOrder.h. Variants and LODs pick
+// their tris from here and keep the order.
 void Unreal3DExport::SortMaterials()
 {
-    //Materials.Sort((CompareFnc)CompareMaterials);
+    int tricount = Tris.Count();
+    if( tricount == 0 )
+        return;
+
+    int slots = Materials.Count();
+    for( int i=0; i<tricount; ++i )
+        slots = max(slots,Tris[i].TextureNum+1);
+
+    const TCHAR** names = Arena.New<const TCHAR*>(slots);
+    for( int i=0; i<slots; ++i )
+        names[i] = i < Materials.Count() && Materials[i].Mat >= 0 ? Source->GetMaterialName(Materials[i].Mat) : NULL;
+
+    int* remap = Arena.New<int>(slots);
+    FTriOrder::GetMaterialOrder(names,slots,remap);
+
+    int transitions = FTriOrder::CountTransitions(Tris.Addr(0),tricount);
+    float missrate = FTriOrder::GetMissRate(Tris.Addr(0),tricount,VertsPerFrame,U3D_ORDER_CACHE);
+
+    // Materials move with their number, SETTEXTURE NUM follows
+    Tab<sMaterial> sorted;
+    sorted.SetCount(slots);
+    for( int i=0; i<slots; ++i )
+        sorted[remap[i]] = i < Materials.Count() ? Materials[i] : sMaterial::DefaultMaterial;
+    Materials = sorted;
+    for( int i=0; i<tricount; ++i )
+        Tris[i].TextureNum = static_cast<U_BYTE>(remap[Tris[i].TextureNum]);
+
+    int* order = Arena.New<int>(tricount);
+    FTriOrder().Order(Tris.Addr(0),tricount,VertsPerFrame,order);
+
+    FJSMeshTri* tris = Arena.New<FJSMeshTri>(tricount);
+    int* nodes = Arena.New<int>(tricount);
+    for( int i=0; i<tricount; ++i )
+    {
+        tris[i] = Tris[order[i]];
+        nodes[i] = TriNodes[order[i]];
+    }
+    memcpy(Tris.Addr(0),tris,sizeof(FJSMeshTri)*tricount);
+    TriNodes = nodes;
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Geometry, _T("Materials: %d materials, %d transitions before, %d after, cache misses per tri %.2f before, %.2f after\n")
+        , slots, transitions, FTriOrder::CountTransitions(Tris.Addr(0),tricount)
+        , missrate, FTriOrder::GetMissRate(Tris.Addr(0),tricount,VertsPerFrame,U3D_ORDER_CACHE) );
 }
 
 void Unreal3DExport::Init()
@@ -483,7 +912,11 @@ void Unreal3DExport::Init()
     // Init
     CheckCancel();
     pScene = GetIGameInterface();
-    GetConversionManager()->SetUserCoordSystem(UnrealCoords);
+
+    // Points are sampled in Max world space, UnrealCoords is applied
+    // while packing them, folded into the precision optimization
+    GetConversionManager()->SetCoordSystem(IGameConversionManager::IGAME_MAX);
+    GetUnrealAxes(Axes);
     if( bExportSelected )
     {
         Tab<INode*> selnodes;;
@@ -511,6 +944,12 @@ void Unreal3DExport::Init()
     }
     Progress += U3D_PROGRESS_ENUM;
 
+    if( NodeRules.Count() > 0 )
+    {
+        Log.Printf( FLogWriter::Info, FLogWriter::Scene, _T("Filter: %d rules left out %d nodes, %d meshes and %d helpers remain\n")
+            , NodeRules.Count(), FilteredNodes, Nodes.Count(), TrackedNodes.Count() );
+    }
+
 
     // Get animation info
     FrameStart = pScene->GetSceneStartTime() / pScene->GetSceneTicks();
@@ -522,361 +961,1117 @@ void Unreal3DExport::Init()
         throw MAXException(ProgressMsg.data());
     }
     pScene->SetStaticFrame(FrameStart);
-}
-
-void Unreal3DExport::GetTris()
-{
-    
-    // Export triangle data
-    FJSMeshTri nulltri = FJSMeshTri();
-    for( int n=0; n<Nodes.Count(); ++n )
-    {
-        CheckCancel();
-        
-        IGameNode* node = Nodes[n];
-        IGameMesh* mesh = static_cast<IGameMesh*>(node->GetIGameObject());
-        if( mesh->InitializeData() )
-        {
-            int vertcount = mesh->GetNumberOfVerts();
-            int tricount = mesh->GetNumberOfFaces();
-            if( vertcount > 0 && tricount > 0 )
-            {
-                // Progress
-                ProgressMsg.printf(GetString(IDS_INFO_MESH),n+1,Nodes.Count(),TSTR(node->GetName()));
-                pInt->ProgressUpdate(Progress+(static_cast<float>(n)/Nodes.Count()*U3D_PROGRESS_MESH), FALSE, ProgressMsg.data());
-
-                // Alloc triangles space
-                Tris.Resize(Tris.Count()+tricount);
-
-                // Append triangles
-                for( int i=0; i!=tricount; ++i )
-                {
-                    FaceEx* f = mesh->GetFace(i);
-                    if( f )
-                    {
-                        FJSMeshTri tri(nulltri);
 
-                        // TODO: add material id listing
-                        RegisterMaterial( node, mesh, f, &tri );
+    // Everything after this point reads the scene through Source
+    GameSource = new FGameSceneSource(pScene,pInt,Nodes,TrackedNodes,FrameStart,FrameEnd,Arena);
+    Source = GameSource;
 
-                        tri.iVertex[0] = VertsPerFrame + f->vert[0];
-                        tri.iVertex[1] = VertsPerFrame + f->vert[1];
-                        tri.iVertex[2] = VertsPerFrame + f->vert[2];
-
-                        Point2 p;
-                        if( mesh->GetTexVertex(f->texCoord[0],p) ){
-                            tri.Tex[0] = FMeshUV(p);
-                        }
-                        if( mesh->GetTexVertex(f->texCoord[1],p) ){
-                            tri.Tex[1] = FMeshUV(p);
-                        }
-                        if( mesh->GetTexVertex(f->texCoord[2],p) ){
-                            tri.Tex[2] = FMeshUV(p);
-                        }
-                        
-                        Tris.Append(1,&tri);                       
-                    }
-                }
+    if( PreviewStep > 0 )
+        SetPreviewRange();
 
-                VertsPerFrame += vertcount;
-            }
-            else
-            {
-                // remove invalid node
-                Nodes.Delete(n--,1);
-            }
+    // Optional recording for replay with u3dexport, previews are not recorded
+    if( bRecordScene && PreviewStep == 0 )
+    {
+        Recorder = new FSceneRecorder(*GameSource);
+        if( !Recorder->Open(SceneFileName,Axes) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FSCENE),SceneFileName);
+            throw MAXException(ProgressMsg.data());
         }
-        node->ReleaseIGameObject();
+        Source = Recorder;
     }
-    Progress += U3D_PROGRESS_MESH;
 }
 
-void Unreal3DExport::GetAnim()
+// Named selection sets called "name.3d" ask for an extra model of their
+// meshes, written to name_d.3d next to the main one
+void Unreal3DExport::FindVariants()
 {
-    
-    // Export vertex animation
-    int lastvert = 0;
-    FMeshVert nullvert = FMeshVert();
-    Points.SetCount(VertsPerFrame*FrameCount,TRUE);
-    for( int t=0; t<FrameCount; ++t )
-    {            
-        // Progress
-        CheckCancel();
-        ProgressMsg.printf(GetString(IDS_INFO_ANIM),t+1,FrameCount);
-        pInt->ProgressUpdate(Progress+((float)t/FrameCount*U3D_PROGRESS_ANIM), FALSE, ProgressMsg.data());
-        
-        // Set frame
-        int frameverts = 0;
-        int curframe = FrameStart + t;
-        pScene->SetStaticFrame(curframe);
-        
-        // Write mesh verts
-        for( int n=0; n<Nodes.Count(); ++n )
-        {
-            CheckCancel();
+    for( int s=0; s<pInt->GetNumNamedSelSets(); ++s )
+    {
+        TSTR setname = pInt->GetNamedSelSetName(s);
+        if( !MatchPattern(setname,TSTR(_T("*.3d")),TRUE) )
+            continue;
 
-            IGameMesh * mesh = (IGameMesh*)Nodes[n]->GetIGameObject();          
-            if( mesh->InitializeData() )
+        sVariant var;
+        var.Name = Arena.Dup(setname.data(),setname.Length()-3);
+        var.Meshes = Arena.New<BYTE>(Nodes.Count());
+        memset(var.Meshes,0,max(Nodes.Count(),1));
+
+        int found = 0;
+        for( int i=0; i<pInt->GetNamedSelSetItemCount(s); ++i )
+        {
+            INode* node = pInt->GetNamedSelSetItem(s,i);
+            for( int n=0; n<Nodes.Count(); ++n )
             {
-                int vertcount = mesh->GetNumberOfVerts();
-                for( int i=0; i<vertcount; ++i )
+                if( Nodes[n]->GetMaxNode() == node && !var.Meshes[n] )
                 {
-                    Point3 p;
-                    if( mesh->GetVertex(i,p) )
-                    {
-                        Points[lastvert++] = p;
-                    }
+                    var.Meshes[n] = 1;
+                    ++found;
                 }
-                frameverts += vertcount;
             }
-            Nodes[n]->ReleaseIGameObject();
         }
 
-        // Check number of verts in this frame
-        if( frameverts != VertsPerFrame )
-        {
-            ProgressMsg.printf(GetString(IDS_ERR_NOVERTS),curframe,frameverts,VertsPerFrame);
-            throw MAXException(ProgressMsg.data());
-        }
+        Log.Printf( FLogWriter::Info, FLogWriter::Scene, _T("Variant %s: %d of %d meshes\n"), var.Name, found, Nodes.Count() );
+        if( found > 0 )
+            Variants.Append(1,&var);
     }
-    Progress += U3D_PROGRESS_ANIM;
+}
 
+void Unreal3DExport::SetOutputNames( const TSTR& name )
+{
+    FileName = name;
+    ModelFileName = FilePath + _T("\\") + FileName + TSTR(_T("_d")) + FileExt;
+    AnimFileName = FilePath + _T("\\") + FileName + TSTR(_T("_a")) + FileExt;
+    ScriptFileName = FilePath + _T("\\") + FileName + TSTR(_T("_rc.uc"));
+    CostFileName = FilePath + _T("\\") + FileName + TSTR(_T("_cost.json"));
+    SplitFileName = FilePath + _T("\\") + FileName + TSTR(_T(".u3dsplit"));
+    BoundsFileName = FilePath + _T("\\") + FileName + TSTR(_T(".u3dbounds"));
 }
 
-void Unreal3DExport::WriteTracking()
+// Points Tris, VertsPerFrame and the file names at variant v, or back at
+// the main model for -1. Variant verts are gathered from the shared frames.
+void Unreal3DExport::SelectVariant( int v )
 {
-    Tab<Point3> Loc;
-    Tab<Quat> Quat;
-    Tab<Point3> Euler;
+    if( VertMap == NULL )
+    {
+        SceneTris = Tris;
+        SceneVerts = VertsPerFrame;
+    }
+
+    OptOffset = Point3(0,0,0);
+    OptScale = Point3(1,1,1);
+    if( v < 0 )
+    {
+        SetOutputNames(ExportName);
+        Tris = SceneTris;
+        VertsPerFrame = SceneVerts;
+        VertMap = NULL;
+        return;
+    }
 
-    Loc.SetCount(FrameCount);
-    Quat.SetCount(FrameCount);
-    Euler.SetCount(FrameCount);
+    const sVariant& var = Variants[v];
+    SetOutputNames(TSTR(var.Name));
 
-    for( int n=0; n<TrackedNodes.Count(); ++n )
+    FJSMeshTri* tris = Arena.New<FJSMeshTri>(SceneTris.Count());
+    int count = 0;
+    for( int i=0; i<SceneTris.Count(); ++i )
     {
-        IGameNode* node = TrackedNodes[n];
+        if( var.Meshes[TriNodes[i]] )
+            tris[count++] = SceneTris[i];
+    }
+    SelectTris(tris,count);
 
-        for( int t=0; t<FrameCount; ++t )
-        {            
-            // Progress
-            CheckCancel();
-            
-            // Set frame
-            int curframe = FrameStart + t;
-            pScene->SetStaticFrame(curframe);
+    Log.Printf( FLogWriter::Info, FLogWriter::Scene, _T("Variant %s: %d tris, %d verts\n"), var.Name, Tris.Count(), VertsPerFrame );
+}
 
-            // Write tracking
-            GMatrix objTM = node->GetWorldTM();
-            Loc[t] = objTM.Translation();
-            Quat[t] = objTM.Rotation();
+// Makes tris in scene vert numbers the output, their verts are gathered
+// from the shared frames. Verts stay in frame order so meshes stay together.
+void Unreal3DExport::SelectTris( const FJSMeshTri* tris, int count )
+{
+    int* remap = Arena.New<int>(SceneVerts);
+    for( int i=0; i<SceneVerts; ++i )
+        remap[i] = -1;
 
-            float eu[3];
-            QuatToEuler(Quat[t],eu);
-            Euler[t]=Point3(eu[0],eu[1],eu[2]);
-            Euler[t] *= 180.0f/pi;
+    Tris.SetCount(0);
+    for( int i=0; i<count; ++i )
+    {
+        Tris.Append(1,&tris[i]);
+        for( int k=0; k<3; ++k )
+            remap[tris[i].iVertex[k]] = 0;
+    }
 
-            eu[1] *= -1;
-            EulerToQuat(eu,Quat[t],EULERTYPE_YXZ);
-        }
-        
-        for( int t=0; t<FrameCount; ++t )
-        {    
-            _ftprintf( fLog, _T("%sLoc[%d]=(X=%f,Y=%f,Z=%f)\n"), node->GetName(), t, Loc[t].x, Loc[t].y, Loc[t].z );
-        }
-        
-        for( int t=0; t<FrameCount; ++t )
-        {    
-            _ftprintf( fLog, _T("%sQuat[%d]=(W=%f,X=%f,Y=%f,Z=%f)\n"), node->GetName(), t, Quat[t].w, Quat[t].x, Quat[t].y, Quat[t].z ); 
-        }
-        
-        for( int t=0; t<FrameCount; ++t )
-        {    
-            _ftprintf( fLog, _T("%sEuler[%d]=(X=%f,Y=%f,Z=%f)\n"), node->GetName(), t, Euler[t].x, Euler[t].y, Euler[t].z ); 
+    VertMap = Arena.New<int>(SceneVerts);
+    VertsPerFrame = 0;
+    for( int i=0; i<SceneVerts; ++i )
+    {
+        if( remap[i] != -1 )
+        {
+            remap[i] = VertsPerFrame;
+            VertMap[VertsPerFrame++] = i;
         }
     }
+
+    for( int i=0; i<Tris.Count(); ++i )
+    {
+        for( int k=0; k<3; ++k )
+            Tris[i].iVertex[k] = remap[Tris[i].iVertex[k]];
+    }
+    Gathered = Arena.New<Point3>(VertsPerFrame);
 }
 
-/*
-    Nodes[n]->GetIGameObject
-    _ftprintf( fLog, _T("%sLocation[%d]=(X=%f,Y=%f,Z=%f)\n"), Nodes[n]->GetName(), curframe ); 
-*/
+const Point3* Unreal3DExport::GetOutputFrame( int t )
+{
+    const Point3* frame = Frames.GetFrame(t);
+    if( VertMap == NULL )
+        return frame;
 
-void Unreal3DExport::Prepare()
+    for( int i=0; i<VertsPerFrame; ++i )
+        Gathered[i] = frame[VertMap[i]];
+    return Gathered;
+}
+
+// Output frame t packed with OptOffset and OptScale, in Verts unless the
+// packed frames can be used as they are
+const FMeshVert* Unreal3DExport::GetPackedFrame( int t )
 {
-    
-    // Optimize
-    if( bMaxResolution && Points.Count() > 1 )
+    if( !bPacked )
     {
-        pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_OPT_SCAN));
+        U3DQuantizeAffine(&GetOutputFrame(t)->x,VertsPerFrame,Axes,&OptOffset.x,&OptScale.x,Verts.Addr(0));
+        return Verts.Addr(0);
+    }
+
+    const FMeshVert* frame = Packed.GetFrame(t);
+    if( VertMap == NULL )
+        return frame;
 
-        Point3 MaxPoint = Points[0];
-        Point3 MinPoint = MaxPoint;
+    for( int i=0; i<VertsPerFrame; ++i )
+        Verts[i] = frame[VertMap[i]];
+    return Verts.Addr(0);
+}
 
-        // get scene bounding box
-        for( int i=1; i<Points.Count(); ++i )
+// Narrows the export to the sequence under the time slider and samples
+// every PreviewStep-th frame of it. Without such a sequence the whole scene
+// range is thinned out.
+void Unreal3DExport::SetPreviewRange()
+{
+    int now = pInt->GetTime() / pScene->GetSceneTicks();
+    for( int k=0; k<Source->GetNoteCount(); ++k )
+    {
+        FStrView text(Source->GetNoteText(k));
+        int notetime = Source->GetNoteFrame(k);
+        while( !text.isNull() )
         {
-            if      ( Points[i].x > MaxPoint.x )    MaxPoint.x = Points[i].x;
-            else if ( Points[i].x < MinPoint.x )    MinPoint.x = Points[i].x;
+            FStrView cmd = SplitStr(text,_T('\n'));
+            if( !cmd.StartsWith(_T("a ")) )
+                continue;
+
+            SplitStr(cmd,_T(' '));
+            SplitStr(cmd,_T(' '));
+            int end = SplitStr(cmd,_T(' ')).ToInt();
+            if( notetime <= now && now < end && notetime >= FrameStart && end-1 <= FrameEnd )
+            {
+                FrameStart = notetime;
+                FrameEnd = end-1;
+            }
+        }
+    }
 
-            if      ( Points[i].y > MaxPoint.y )    MaxPoint.y = Points[i].y;
-            else if ( Points[i].y < MinPoint.y )    MinPoint.y = Points[i].y;
+    FrameStep = PreviewStep;
+    FrameCount = (FrameEnd - FrameStart) / FrameStep + 1;
 
-            if      ( Points[i].z > MaxPoint.z )    MaxPoint.z = Points[i].z;
-            else if ( Points[i].z < MinPoint.z )    MinPoint.z = Points[i].z;
-        }
-    
-        // get center point
-        OptOffset = MaxPoint+MinPoint;
-        OptOffset *= 0.5;
+    Log.Printf( FLogWriter::Info, FLogWriter::Sample, _T("Preview: frames %d to %d, every %d, %d sampled\n")
+        , FrameStart, FrameEnd, FrameStep, FrameCount );
+}
 
-        // center bounding box 
-        MaxPoint -= OptOffset;
-        MinPoint -= OptOffset;  
+void Unreal3DExport::GetTris()
+{
+    
+    // Copy face data out of the scene, slot 0 is the no-material slot
+    FaceMaterials.Append(1,&sMaterial::DefaultMaterial);
+    int meshcount = Source->GetMeshCount();
+    Spans = Arena.New<sNodeSpan>(meshcount);
+    for( int n=0; n<meshcount; ++n )
+    {
+        CheckCancel();
+        
+        sNodeSpan span = {NULL,0,0,0,0,NULL,-1,NULL,0,-1};
+        int vertcount = Source->GetVertCount(n);
+        int tricount = Source->GetFaceCount(n);
+        if( vertcount > 0 && tricount > 0 )
+        {
+            // Progress
+            ProgressMsg.printf(GetString(IDS_INFO_MESH),n+1,meshcount,TSTR(Source->GetMeshName(n)));
+            pInt->ProgressUpdate(Progress+(static_cast<float>(n)/meshcount*U3D_PROGRESS_MESH), FALSE, ProgressMsg.data());
 
-        // See FMeshVert
-        OptScale.x = 1023.0f / max(fabs(MaxPoint.x),fabs(MinPoint.x));
-        OptScale.y = 1023.0f / max(fabs(MaxPoint.y),fabs(MinPoint.y));
-        OptScale.z = 511.0f / max(fabs(MaxPoint.z),fabs(MinPoint.z));
+            // Empty meshes keep an empty span, nothing is sampled for them,
+            // instances point at the faces of the first mesh of their object
+            int instance = Source->GetInstanceOf(n);
+            if( instance != n && Spans[instance].Faces != NULL )
+            {
+                span.Faces = Spans[instance].Faces;
+                span.TriCount = Spans[instance].TriCount;
+            }
+            else
+            {
+                span.Faces = Arena.New<FSceneFace>(tricount);
+                span.TriCount = Source->GetFaces(n,span.Faces);
+            }
+            span.VertCount = vertcount;
+        }
+        Spans[n] = span;
+    }
 
-        // apply adjustments
-        pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_OPT_APPLY));
-        for( int i=0; i<Points.Count(); ++i )
+    // Materials are known once all faces are in
+    int matcount = Source->GetMaterialCount();
+    MaterialSlots = Arena.New<int>(matcount);
+    memset(MaterialSlots,0,sizeof(int)*max(matcount,1));
+    for( int n=0; n<meshcount; ++n )
+    {
+        for( int i=0; i!=Spans[n].TriCount; ++i )
         {
-            Point3& p = Points[i];
-            p -= OptOffset;
-            p *= OptScale;   
+            const FSceneFace& face = Spans[n].Faces[i];
+            RegisterMaterial(face.MatID,face.Material);
         }
     }
-    
-    // Convert verts
-    Verts.SetCount(Points.Count(),TRUE);
-    for( int i=0; i<Points.Count(); ++i )
+
+    // Prefix sum places each node in the shared arrays
+    int vertoffset = 0;
+    int trioffset = 0;
+    for( int n=0; n<meshcount; ++n )
     {
-        Verts[i] = FMeshVert(Points[i]);
+        Spans[n].VertOffset = vertoffset;
+        Spans[n].TriOffset = trioffset;
+        vertoffset += Spans[n].VertCount;
+        trioffset += Spans[n].TriCount;
     }
+    VertsPerFrame = vertoffset;
+
+    // Assemble triangles, nodes write disjoint ranges so order is fixed
+    Tris.SetCount(trioffset);
+    TriNodes = Arena.New<int>(trioffset);
+    ParallelFor(meshcount,AssembleTrisFn,this,&Cancel);
+    CheckCancel();
+    Progress += U3D_PROGRESS_MESH;
 }
 
-void Unreal3DExport::WriteScript()
+void Unreal3DExport::AssembleTrisFn( void* ctx, int n )
 {
-    // Write script file
+    static_cast<Unreal3DExport*>(ctx)->AssembleTris(n);
+}
+
+void Unreal3DExport::AssembleTris( int n )
+{
+    const sNodeSpan& span = Spans[n];
+    FJSMeshTri nulltri = FJSMeshTri();
+    for( int i=0; i!=span.TriCount; ++i )
     {
+        const FSceneFace& face = span.Faces[i];
+        FJSMeshTri& tri = Tris[span.TriOffset+i];
+        tri = nulltri;
+        TriNodes[span.TriOffset+i] = n;
+
+        tri.TextureNum = face.MatID;
+        tri.Flags = face.Material >= 0 ? FaceMaterials[MaterialSlots[face.Material]].Flags : 0;
 
-        fScript = _tfopen(ScriptFileName,_T("wb"));
-        if( !fScript )
+        for( int k=0; k<3; ++k )
         {
-            ProgressMsg.printf(GetString(IDS_ERR_FSCRIPT),ScriptFileName);
+            tri.iVertex[k] = span.VertOffset + face.Vert[k];
+            if( face.UVMask & (1<<k) ){
+                tri.Tex[k] = FMeshUV::FromFloat(face.UV[k][0],face.UV[k][1]);
+            }
+        }
+    }
+}
+
+void Unreal3DExport::GetAnim()
+{
+    
+    // Frames packed while sampling take 4 bytes per vert instead of 12,
+    // outputs that read the sampled floats need them kept
+    bool floats = ((bWriteArchive || LodCount > 0) && PreviewStep == 0) || VatFormat != FVatWriter::Off || bWriteBounds;
+    bPacked = bSinglePass && !floats;
+    if( bSinglePass && floats )
+        Log.Printf( FLogWriter::Warning, FLogWriter::Sample, _T("SinglePass: WriteArchive, LodPercent, VatFormat and WriteBounds need the sampled frames, frames are kept unpacked\n") );
+
+    if( bPacked )
+    {
+        if( !Packed.Begin(VertsPerFrame,FrameCount,Axes,bMaxResolution) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FRAMES),FrameCount,VertsPerFrame);
             throw MAXException(ProgressMsg.data());
         }
 
-        TSTR buf;
+        Log.Printf( FLogWriter::Info, FLogWriter::Memory, _T("Memory: packed frames need %u KB, kept in RAM\n")
+            , static_cast<unsigned>(Packed.GetBytes()/1024) );
+    }
+    else
+    {
+        // Estimate what sampling adds to what is already held, frames go to
+        // disk when that would not fit the budget
+        double need = static_cast<double>(VertsPerFrame)*FrameCount*sizeof(Point3);
+        double budget = static_cast<double>(MemoryBudget)*1024*1024;
+        bool spill = MemoryBudget > 0 && LiveBytes + need > budget;
+        if( !Frames.Init(VertsPerFrame,FrameCount,spill) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FRAMES),FrameCount,VertsPerFrame);
+            throw MAXException(ProgressMsg.data());
+        }
+
+        Log.Printf( FLogWriter::Info, FLogWriter::Memory, _T("Memory: frames need %u KB, budget %u KB, %s\n")
+            , static_cast<unsigned>(need/1024), static_cast<unsigned>(budget/1024)
+            , Frames.IsSpilled() ? _T("kept in temp file") : _T("kept in RAM") );
+    }
 
+    // Previews skip tracking
+    if( PreviewStep == 0 )
+        TrackTMs = Arena.New<float>(FrameCount*TrackedNodes.Count()*12);
+    FindShared();
 
-        // Write class def     
-        _ftprintf( fScript, _T("class %s extends Object;\n\n"), FileName ); 
+    // Packed frames are sampled into one scratch frame, bounds are
+    // predicted before the first one is packed
+    Point3* sampled = NULL;
+    if( bPacked )
+    {
+        sampled = Arena.New<Point3>(VertsPerFrame);
+        if( bMaxResolution )
+            AddProbes(sampled);
+    }
 
-        // write import
-        _ftprintf( fScript, _T("#exec MESH IMPORT MESH=%s ANIVFILE=%s_a.3D DATAFILE=%s_d.3D \n"), FileName, FileName, FileName ); 
+    // Export vertex animation
+    for( int t=0; t<FrameCount; ++t )
+    {            
+        // Progress
+        CheckCancel();
+        ProgressMsg.printf(GetString(IDS_INFO_ANIM),t+1,FrameCount);
+        pInt->ProgressUpdate(Progress+((float)t/FrameCount*U3D_PROGRESS_ANIM), FALSE, ProgressMsg.data());
         
-        // write origin & rotation
-        // TODO: figure out why it's incorrect without -1
-        Point3 porg = OptOffset * OptScale * -1; 
-        _ftprintf( fScript, _T("#exec MESH ORIGIN MESH=%s X=%f Y=%f Z=%f PITCH=%d YAW=%d ROLL=%d \n"), FileName, porg.x, porg.y, porg.z, (int)OptRot.x, (int)OptRot.y, (int)OptRot.z ); 
+        Point3* frame = bPacked ? sampled : Frames.GetFrame(t);
+        SampleFrame(t,frame);
+        if( bPacked )
+            Packed.AddFrame(&frame->x);
+    }
+    Progress += U3D_PROGRESS_ANIM;
+
+    if( bPacked )
+    {
+        Log.Printf( FLogWriter::Info, FLogWriter::Sample, _T("SinglePass: bounds grown %d times, %d frames packed again\n")
+            , Packed.Regrows, Packed.RepackedFrames );
+    }
+}
+
+// Samples the verts of frame t and the tracked nodes in one pass
+void Unreal3DExport::SampleFrame( int t, Point3* frame )
+{
+    // Set frame
+    int frameverts = 0;
+    int curframe = FrameStart + t*FrameStep;
+    Source->SetFrame(curframe);
+    
+    // Write mesh verts
+    for( int n=0; n<Source->GetMeshCount(); ++n )
+    {
+        CheckCancel();
+
+        const sNodeSpan& span = Spans[n];
+        if( span.Rigid != NULL )
+        {
+            float tm[12];
+            Source->GetMeshTM(n,tm);
+            U3DTransformPoints(span.Rigid,span.VertCount,tm,&frame[span.VertOffset].x);
+            frameverts += span.VertCount;
+        }
+        else if( span.Shared >= 0 )
+        {
+            // Instances sample their object once per frame
+            sNodeSpan& object = Spans[span.Shared];
+            if( object.LocalFrame != t )
+            {
+                object.LocalFrame = t;
+                object.LocalCount = Source->GetLocalVerts(span.Shared,object.Local,object.VertCount);
+            }
+
+            float tm[12];
+            Source->GetMeshTM(n,tm);
+            U3DTransformPoints(object.Local,span.VertCount,tm,&frame[span.VertOffset].x);
+            frameverts += object.LocalCount;
+        }
+        else if( span.VertCount > 0 )
+        {
+            frameverts += Source->GetVerts(n,&frame[span.VertOffset].x,span.VertCount);
+        }
+    }
+
+    // Tracked nodes are sampled in the same pass
+    for( int n=0; n<TrackedNodes.Count() && PreviewStep == 0; ++n )
+    {
+        Source->GetTrackedTM(n,TrackTMs+(t*TrackedNodes.Count()+n)*12);
+    }
+
+    // Check number of verts in this frame
+    if( frameverts != VertsPerFrame )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_NOVERTS),curframe,frameverts,VertsPerFrame);
+        throw MAXException(ProgressMsg.data());
+    }
+}
+
+// Predicts the bounds of the packed frames from frames spread over the
+// range and the first and last frame of each sequence, where clips tend
+// to reach their extremes
+void Unreal3DExport::AddProbes( Point3* frame )
+{
+    BYTE* probe = Arena.New<BYTE>(FrameCount);
+    memset(probe,0,FrameCount);
+    int spread = min(FrameCount,U3D_PREDICT_PROBES);
+    for( int p=0; p<spread; ++p )
+        probe[spread > 1 ? p*(FrameCount-1)/(spread-1) : 0] = 1;
+
+    for( int k=0; k<Source->GetNoteCount(); ++k )
+    {
+        FStrView text(Source->GetNoteText(k));
+        int notetime = Source->GetNoteFrame(k);
+        while( !text.isNull() )
+        {
+            FStrView cmd = SplitStr(text,_T('\n'));
+            if( !cmd.StartsWith(_T("a ")) )
+                continue;
+
+            SplitStr(cmd,_T(' '));
+            SplitStr(cmd,_T(' '));
+            int end = SplitStr(cmd,_T(' ')).ToInt();
+            int first = (notetime-FrameStart)/FrameStep;
+            int last = (end-1-FrameStart)/FrameStep;
+            if( notetime >= FrameStart && first < FrameCount )
+                probe[first] = 1;
+            if( end-1 >= FrameStart && last < FrameCount )
+                probe[last] = 1;
+        }
+    }
+
+    int probes = 0;
+    for( int t=0; t<FrameCount; ++t )
+    {
+        if( !probe[t] )
+            continue;
+
+        CheckCancel();
+        SampleFrame(t,frame);
+        Packed.AddProbe(&frame->x);
+        ++probes;
+    }
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Sample, _T("SinglePass: %d probe frames, bounds (%f,%f,%f) to (%f,%f,%f)\n")
+        , probes, Packed.Min[0], Packed.Min[1], Packed.Min[2], Packed.Max[0], Packed.Max[1], Packed.Max[2] );
+}
+
+static bool SamePoints( const float* a, const float* b, int count )
+{
+    for( int i=0; i<count*3; ++i )
+    {
+        if( fabs(a[i]-b[i]) > 1e-4f*(1.0f+fabs(b[i])) )
+            return false;
+    }
+    return true;
+}
+
+// Meshes whose verts can be made from object space verts and the mesh TM:
+// rigid meshes are sampled once, instances of one object share a single
+// sampling per frame. Rigid candidates come from the source, which only
+// accepts stacks that cannot deform. Both are also checked on the first,
+// middle and last frame, the TM must take the object verts where the
+// regular sampling puts them and rigid objects must not change in object
+// space.
+void Unreal3DExport::FindShared()
+{
+    int meshcount = Source->GetMeshCount();
+    int* object = Arena.New<int>(meshcount);
+    int* users = Arena.New<int>(meshcount);
+    BYTE* match = Arena.New<BYTE>(meshcount);
+    float** fixed = Arena.New<float*>(meshcount);
+    int maxcount = 0;
+    for( int n=0; n<meshcount; ++n )
+    {
+        object[n] = -1;
+        users[n] = 0;
+        match[n] = 1;
+        fixed[n] = NULL;
+    }
+    for( int n=0; n<meshcount; ++n )
+    {
+        if( Spans[n].VertCount == 0 )
+            continue;
+
+        int m = Source->GetInstanceOf(n);
+        if( m != n || Source->IsRigidCandidate(n) )
+        {
+            object[n] = m;
+            object[m] = m;
+        }
+    }
+    for( int n=0; n<meshcount; ++n )
+    {
+        if( object[n] == n )
+        {
+            Spans[n].Local = Arena.New<float>(Spans[n].VertCount*3);
+            if( Source->IsRigidCandidate(n) )
+                fixed[n] = Arena.New<float>(Spans[n].VertCount*3);
+            maxcount = max(maxcount,Spans[n].VertCount);
+        }
+    }
+    if( maxcount == 0 )
+        return;
+
+    float* moved = Arena.New<float>(maxcount*3);
+    float* world = Arena.New<float>(maxcount*3);
+    int probes[3] = { FrameStart, FrameStart+(FrameCount-1)/2*FrameStep, FrameStart+(FrameCount-1)*FrameStep };
+    for( int p=0; p<3; ++p )
+    {
+        if( p > 0 && probes[p] == probes[p-1] )
+            continue;
+
+        CheckCancel();
+        Source->SetFrame(probes[p]);
+        for( int n=0; n<meshcount; ++n )
+        {
+            // Objects come before their instances
+            int m = object[n];
+            if( m < 0 )
+                continue;
+
+            sNodeSpan& span = Spans[n];
+            if( m == n )
+            {
+                span.LocalCount = Source->GetLocalVerts(n,span.Local,span.VertCount);
+                if( span.LocalCount != span.VertCount )
+                    fixed[n] = NULL;
+                else if( fixed[n] != NULL && p == 0 )
+                    memcpy(fixed[n],span.Local,sizeof(float)*3*span.VertCount);
+                else if( fixed[n] != NULL && !SamePoints(span.Local,fixed[n],span.VertCount) )
+                    fixed[n] = NULL;
+            }
+
+            float tm[12];
+            Source->GetMeshTM(n,tm);
+            U3DTransformPoints(Spans[m].Local,span.VertCount,tm,moved);
+            if( Spans[m].LocalCount != span.VertCount
+             || Source->GetVerts(n,world,span.VertCount) != span.VertCount
+             || !SamePoints(moved,world,span.VertCount) )
+                match[n] = 0;
+        }
+    }
+
+    // An object whose verts move is only worth sharing between instances
+    int rigidnodes = 0;
+    int sharednodes = 0;
+    int savedverts = 0;
+    for( int n=0; n<meshcount; ++n )
+    {
+        if( object[n] >= 0 && match[n] )
+            ++users[object[n]];
+    }
+    for( int n=0; n<meshcount; ++n )
+    {
+        int m = object[n];
+        if( m < 0 || !match[n] || (fixed[m] == NULL && users[m] < 2) )
+            continue;
+
+        Spans[n].Shared = m;
+        Spans[n].Rigid = fixed[m];
+        if( fixed[m] != NULL )
+            ++rigidnodes;
+        else
+            ++sharednodes;
+        if( fixed[m] != NULL || m != n )
+            savedverts += Spans[n].VertCount;
+    }
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Sample, _T("Shared: %d of %d meshes rigid, %d instanced, %d verts not sampled per frame\n")
+        , rigidnodes, meshcount, sharednodes, savedverts );
+}
+
+static int CompareTriKeys( const void* a, const void* b )
+{
+    const sTriKey* ka = static_cast<const sTriKey*>(a);
+    const sTriKey* kb = static_cast<const sTriKey*>(b);
+    int r = memcmp(&ka->Tri,&kb->Tri,sizeof(FJSMeshTri));
+    return r != 0 ? r : ka->Index - kb->Index;
+}
+
+void Unreal3DExport::Strip()
+{
+    if( !bStripGeometry || Tris.Count() == 0 )
+        return;
+
+    pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_STRIP));
+    int tricount = Tris.Count();
+    BYTE* keep = Arena.New<BYTE>(tricount);
+
+    // Triangles with a repeated vertex are degenerate in every frame,
+    // others are kept as soon as any frame gives them an area. Packed
+    // frames are checked as the engine will see them.
+    Point3* unpacked = bPacked ? Arena.New<Point3>(VertsPerFrame) : NULL;
+    int pending = 0;
+    for( int i=0; i<tricount; ++i )
+    {
+        const U_WORD* v = Tris[i].iVertex;
+        keep[i] = 0;
+        if( v[0] != v[1] && v[1] != v[2] && v[2] != v[0] )
+            ++pending;
+        else
+            keep[i] = 2;
+    }
+
+    for( int t=0; t<FrameCount && pending>0; ++t )
+    {
+        CheckCancel();
+        const Point3* frame = unpacked;
+        if( bPacked )
+        {
+            const FMeshVert* verts = Packed.GetFrame(t);
+            for( int i=0; i<VertsPerFrame; ++i )
+                U3DUnpack(verts[i],&unpacked[i].x);
+        }
+        else
+        {
+            frame = Frames.GetFrame(t);
+        }
+        for( int i=0; i<tricount; ++i )
+        {
+            if( keep[i] != 0 )
+                continue;
+
+            const U_WORD* v = Tris[i].iVertex;
+            Point3 e1 = frame[v[1]] - frame[v[0]];
+            Point3 e2 = frame[v[2]] - frame[v[0]];
+            float area = CrossProd(e1,e2).LengthSquared();
+            if( area > 1e-12f * e1.LengthSquared() * e2.LengthSquared() )
+            {
+                keep[i] = 1;
+                --pending;
+            }
+        }
+    }
+
+    for( int i=0; i<tricount; ++i )
+    {
+        if( keep[i] != 1 )
+        {
+            keep[i] = 0;
+            ++StrippedDegenerate;
+        }
+    }
+
+    // Duplicates: rotate each triangle so the lowest vertex comes first,
+    // sort, and keep the first of each run of identical triangles
+    sTriKey* keys = Arena.New<sTriKey>(tricount);
+    int keycount = 0;
+    for( int i=0; i<tricount; ++i )
+    {
+        if( !keep[i] )
+            continue;
+
+        const FJSMeshTri& tri = Tris[i];
+        int r = 0;
+        if( tri.iVertex[1] < tri.iVertex[r] ) r = 1;
+        if( tri.iVertex[2] < tri.iVertex[r] ) r = 2;
+
+        sTriKey& key = keys[keycount++];
+        key.Tri = tri;
+        key.Index = i;
+        for( int k=0; k<3; ++k )
+        {
+            key.Tri.iVertex[k] = tri.iVertex[(r+k)%3];
+            key.Tri.Tex[k] = tri.Tex[(r+k)%3];
+        }
+    }
+
+    qsort(keys,keycount,sizeof(sTriKey),CompareTriKeys);
+    for( int i=1; i<keycount; ++i )
+    {
+        if( memcmp(&keys[i].Tri,&keys[i-1].Tri,sizeof(FJSMeshTri)) == 0 )
+        {
+            keep[keys[i].Index] = 0;
+            ++StrippedDuplicate;
+        }
+    }
+
+    // Compact triangles and mark referenced verts
+    int* remap = Arena.New<int>(VertsPerFrame);
+    for( int i=0; i<VertsPerFrame; ++i )
+        remap[i] = -1;
+
+    int tri = 0;
+    for( int i=0; i<tricount; ++i )
+    {
+        if( !keep[i] )
+            continue;
+
+        Tris[tri] = Tris[i];
+        TriNodes[tri] = TriNodes[i];
+        for( int k=0; k<3; ++k )
+            remap[Tris[tri].iVertex[k]] = 0;
+        ++tri;
+    }
+    Tris.SetCount(tri);
+
+    int vertcount = 0;
+    for( int i=0; i<VertsPerFrame; ++i )
+    {
+        if( remap[i] != -1 )
+            remap[i] = vertcount++;
+    }
+    StrippedVerts = VertsPerFrame - vertcount;
+
+    // Remap indices and compact every frame within its slot, destination
+    // never runs ahead of the source so no second buffer is needed
+    if( StrippedVerts > 0 )
+    {
+        for( int i=0; i<Tris.Count(); ++i )
+        {
+            for( int k=0; k<3; ++k )
+                Tris[i].iVertex[k] = remap[Tris[i].iVertex[k]];
+        }
+
+        for( int t=0; t<FrameCount && !bPacked; ++t )
+        {
+            CheckCancel();
+            Point3* frame = Frames.GetFrame(t);
+            int dst = 0;
+            for( int i=0; i<VertsPerFrame; ++i )
+            {
+                if( remap[i] != -1 )
+                    frame[dst++] = frame[i];
+            }
+        }
+        if( bPacked )
+            Packed.Compact(remap,vertcount);
+        VertsPerFrame = vertcount;
+    }
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Geometry, _T("Strip: %d degenerate tris, %d duplicate tris, %d unused verts\n")
+        , StrippedDegenerate, StrippedDuplicate, StrippedVerts );
+}
+
+void Unreal3DExport::WriteArchive()
+{
+    if( VertsPerFrame == 0 )
+        return;
+
+    CheckCancel();
+    pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_ARCHIVE));
+
+    FPointsFrameSource source(Frames,Axes,VertsPerFrame,FrameCount);
+    FPcaEncoder encoder(source,0,U3D_PCA_MAXBASIS,&Cancel);
+    if( !encoder.Encode() )
+        throw CancelException();
+
+    if( !fArchive.Open(ArchiveFileName) || !encoder.Write(fArchive,Tris.Count() ? Tris.Addr(0) : NULL,Tris.Count()) )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_FARCHIVE),ArchiveFileName);
+        throw MAXException(ProgressMsg.data());
+    }
+    StageOutput(fArchive,ArchiveFileName,IDS_ERR_FARCHIVE);
+
+    size_t raw = static_cast<size_t>(VertsPerFrame)*FrameCount*sizeof(Point3);
+    Log.Printf( FLogWriter::Info, FLogWriter::Output, _T("Archive: %d basis vectors, max error %f (tolerance %f), %u bytes, %.1fx smaller than raw frames\n")
+        , encoder.Header.NumBasis, encoder.Header.MaxError, encoder.Header.Tolerance
+        , static_cast<unsigned>(encoder.GetSize()), static_cast<double>(raw)/encoder.GetSize() );
+}
+
+// Each LOD keeps LodPercent of the main model's tris. The collapse error is
+// measured in frames spread over the whole clip, the surviving verts keep
+// their sampled frames. LODs are written like variants, as name_lod1...
+void Unreal3DExport::WriteLods()
+{
+    SelectVariant(-1);
+    if( Tris.Count() == 0 || FrameCount == 0 )
+        return;
+
+    int probes = min(FrameCount,U3D_LOD_FRAMES);
+    FLodBuilder lod;
+    lod.Begin(Tris.Addr(0),Tris.Count(),VertsPerFrame,probes);
+    for( int p=0; p<probes; ++p )
+    {
+        CheckCancel();
+        lod.AddFrame(&GetOutputFrame(probes > 1 ? p*(FrameCount-1)/(probes-1) : 0)->x);
+    }
+    lod.End();
+
+    float progress = Progress;
+    std::vector<FJSMeshTri> tris;
+    std::vector<FJSMeshTri> sorted;
+    std::vector<int> order;
+    FTriOrder sorter;
+    for( int l=0; l<LodCount; ++l )
+    {
+        ProgressMsg.printf(GetString(IDS_INFO_LOD),LodPercent[l]);
+        pInt->ProgressUpdate(Progress, FALSE, ProgressMsg.data());
+
+        // Each LOD continues from the previous one
+        int target = max(1,SceneTris.Count()*LodPercent[l]/100);
+        while( !lod.Reduce(target,U3D_LOD_STEPS) )
+            CheckCancel();
+        lod.GetTris(tris);
+
+        // Collapses leave the tris out of material and cache order
+        if( !tris.empty() )
+        {
+            order.resize(tris.size());
+            sorter.Order(&tris[0],static_cast<int>(tris.size()),SceneVerts,&order[0]);
+            sorted.resize(tris.size());
+            for( size_t i=0; i<tris.size(); ++i )
+                sorted[i] = tris[order[i]];
+            tris.swap(sorted);
+        }
+
+        TSTR name;
+        name.printf(_T("%s_lod%d"),ExportName.data(),l+1);
+        SetOutputNames(name);
+        SelectTris(tris.empty() ? NULL : &tris[0],static_cast<int>(tris.size()));
+        Log.Printf( FLogWriter::Info, FLogWriter::Geometry, _T("LOD %s: %d of %d tris, %d of %d verts, max collapse error %g\n")
+            , FileName.data(), Tris.Count(), SceneTris.Count(), VertsPerFrame, SceneVerts, lod.MaxCost );
+
+        Prepare();
+        WriteScript();
+        WriteModel();
+        Progress = progress;
+    }
+    SelectVariant(-1);
+}
+
+void Unreal3DExport::WriteTracking()
+{
+    Point3* Loc = Arena.New<Point3>(FrameCount);
+    ::Quat* Quat = Arena.New< ::Quat >(FrameCount);
+    Point3* Euler = Arena.New<Point3>(FrameCount);
+
+    // Transforms were sampled in Max world space like the verts
+    Matrix3 toUnreal;
+    for( int r=0; r<4; ++r )
+        toUnreal.SetRow(r,Point3(Axes[r*3+0],Axes[r*3+1],Axes[r*3+2]));
+    Matrix3 fromUnreal = Inverse(toUnreal);
+
+    for( int n=0; n<TrackedNodes.Count(); ++n )
+    {
+        const TCHAR* name = Source->GetTrackedName(n);
+
+        for( int t=0; t<FrameCount; ++t )
+        {            
+            // Progress
+            CheckCancel();
+            
+            // Transforms were sampled with the verts
+            const float* tm = TrackTMs+(t*TrackedNodes.Count()+n)*12;
+            Matrix3 objTM;
+            for( int r=0; r<4; ++r )
+                objTM.SetRow(r,Point3(tm[r*3+0],tm[r*3+1],tm[r*3+2]));
+            objTM = fromUnreal * objTM * toUnreal;
+
+            // Write tracking
+            AffineParts parts;
+            decomp_affine(objTM,&parts);
+            Loc[t] = parts.t;
+            Quat[t] = parts.q;
+
+            float eu[3];
+            QuatToEuler(Quat[t],eu);
+            Euler[t]=Point3(eu[0],eu[1],eu[2]);
+            Euler[t] *= 180.0f/pi;
+
+            eu[1] *= -1;
+            EulerToQuat(eu,Quat[t],EULERTYPE_YXZ);
+        }
         
-        // write mesh scale
-        Point3 psc( Point3(1.0f/OptScale.x,1.0f/OptScale.y,1.0f/OptScale.z));
-        _ftprintf( fScript, _T("#exec MESH SCALE MESH=%s X=%f Y=%f Z=%f \n"), FileName, psc.x, psc.y, psc.z ); 
+        for( int t=0; t<FrameCount; ++t )
+        {    
+            Log.Printf( FLogWriter::Info, FLogWriter::Track, _T("%sLoc[%d]=(X=%f,Y=%f,Z=%f)\n"), name, t, Loc[t].x, Loc[t].y, Loc[t].z );
+        }
         
-        // write meshmap
-        _ftprintf( fScript, _T("#exec MESHMAP NEW MESHMA=P%s MESH=%smap \n"), FileName, FileName ); 
+        for( int t=0; t<FrameCount; ++t )
+        {    
+            Log.Printf( FLogWriter::Info, FLogWriter::Track, _T("%sQuat[%d]=(W=%f,X=%f,Y=%f,Z=%f)\n"), name, t, Quat[t].w, Quat[t].x, Quat[t].y, Quat[t].z ); 
+        }
         
-        // write meshmap scale
-        _ftprintf( fScript, _T("#exec MESHMAP SCALE MESHMAP=%s X=%f Y=%f Z=%f \n"), FileName, psc.x, psc.y, psc.z ); 
+        for( int t=0; t<FrameCount; ++t )
+        {    
+            Log.Printf( FLogWriter::Info, FLogWriter::Track, _T("%sEuler[%d]=(X=%f,Y=%f,Z=%f)\n"), name, t, Euler[t].x, Euler[t].y, Euler[t].z ); 
+        }
+    }
+}
 
-        // write sequence
-        _ftprintf( fScript, _T("#exec MESH SEQUENCE MESH=%s SEQ=%s STARTFRAME=%d NUMFRAMES=%d \n"), FileName, _T("All"), 0, FrameCount-1 ); 
+/*
+    Nodes[n]->GetIGameObject
+    _ftprintf( fLog, _T("%sLocation[%d]=(X=%f,Y=%f,Z=%f)\n"), Nodes[n]->GetName(), curframe ); 
+*/
+
+void Unreal3DExport::Prepare()
+{
+    // Header counts are 16 bits, a bigger model would be written truncated
+    if( !U3DFitsFormat(VertsPerFrame,Tris.Count(),FrameCount) )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_FORMAT),VertsPerFrame,U3D_MAX_VERTS,Tris.Count(),U3D_MAX_TRIS,FrameCount,U3D_MAX_FRAMES);
+        throw MAXException(ProgressMsg.data());
+    }
+
+    // Optimize, bounds are gathered a frame at a time along with the
+    // culling volumes of each frame. Position textures need them too.
+    bool bounds = bMaxResolution || VatFormat != FVatWriter::Off || bWriteBounds;
+    Bounds.Begin(FrameCount);
+    if( bPacked )
+    {
+        // Chosen while sampling, variants share them
+        BoundsMin = Point3(Packed.Min[0],Packed.Min[1],Packed.Min[2]);
+        BoundsMax = Point3(Packed.Max[0],Packed.Max[1],Packed.Max[2]);
+        OptOffset = Point3(Packed.Offset[0],Packed.Offset[1],Packed.Offset[2]);
+        OptScale = Point3(Packed.Scale[0],Packed.Scale[1],Packed.Scale[2]);
+    }
+    else if( bounds && VertsPerFrame*FrameCount > 1 )
+    {
+        pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_OPT_SCAN));
+        for( int t=0; t<FrameCount; ++t )
+        {
+            CheckCancel();
+            Bounds.AddFrame(&GetOutputFrame(t)->x,VertsPerFrame,Axes);
+        }
+        BoundsMin = Point3(Bounds.Total.Min[0],Bounds.Total.Min[1],Bounds.Total.Min[2]);
+        BoundsMax = Point3(Bounds.Total.Max[0],Bounds.Total.Max[1],Bounds.Total.Max[2]);
+        if( bMaxResolution )
+            U3DGetOptimization(&BoundsMin.x,&BoundsMax.x,&OptOffset.x,&OptScale.x);
+        pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_OPT_APPLY));
+    }
+    
+    // Verts are packed one frame at a time while writing
+    Verts.SetCount(VertsPerFrame,TRUE);
 
-        // Get World NoteTrack
-        ReferenceTarget *rtscene = pInt->GetScenePointer();
-        for( int t=0; t<rtscene->NumNoteTracks(); ++t )
+    // Static verts are found before writing so they can be moved up front
+    if( (bSplitStatic || bStaticFirst) && VertsPerFrame > 0 )
+    {
+        Split.Begin(VertsPerFrame,FrameCount);
+        for( int t=0; t<FrameCount; ++t )
         {
-            DefNoteTrack* notetrack = static_cast<DefNoteTrack*>(rtscene->GetNoteTrack(t));
-            for( int k=0; k<notetrack->keys.Count(); ++k )
-            {
+            CheckCancel();
+            Split.AddFrame(GetPackedFrame(t));
+        }
+        Split.End();
 
+        if( bStaticFirst )
+            SortStaticFirst();
 
-                NoteKey* notekey = notetrack->keys[k];                        
-                TSTR text = notekey->note;
-                int notetime = notekey->time / pScene->GetSceneTicks();
+        Log.Printf( FLogWriter::Info, FLogWriter::Geometry, _T("Static: %d of %d verts never move%s\n")
+            , Split.GetStaticCount(), VertsPerFrame, bStaticFirst ? _T(", moved to the front") : _T("") );
+    }
+}
 
-                while( !text.isNull() )
-                {
-                    TSTR cmd = SplitStr(text,_T('\n'));
-                    
-                    if( MatchPattern(cmd,TSTR(_T("a *")),TRUE) )
-                    {
-                        SplitStr(cmd,_T(' '));
-                        TSTR seq = SplitStr(cmd,_T(' '));
-                        int end = _ttoi(SplitStr(cmd,_T(' ')));;
-                        TSTR rate = SplitStr(cmd,_T(' '));
-                        TSTR group = SplitStr(cmd,_T(' '));
+// Renumbers the output verts so the static ones come first. Frames are
+// reordered through VertMap, like variants.
+void Unreal3DExport::SortStaticFirst()
+{
+    int* order = Arena.New<int>(VertsPerFrame);
+    int* remap = Arena.New<int>(VertsPerFrame);
+    int* map = Arena.New<int>(VertsPerFrame);
+    Split.GetStaticFirstOrder(order);
+    for( int i=0; i<VertsPerFrame; ++i )
+    {
+        remap[order[i]] = i;
+        map[i] = VertMap != NULL ? VertMap[order[i]] : order[i];
+    }
 
-                        if( seq.isNull() )
-                        {
-                            ProgressMsg.printf(_T("Missing animation name in notekey #%d"),notetime);
-                            throw MAXException(ProgressMsg.data());
-                        }
-                        
-                        if( end <= notetime )
-                        {
-                            ProgressMsg.printf(_T("Invalid animation endframe (%d) in notekey #%d"),end,notetime);
-                            throw MAXException(ProgressMsg.data());
-                        }
+    for( int i=0; i<Tris.Count(); ++i )
+    {
+        for( int k=0; k<3; ++k )
+            Tris[i].iVertex[k] = remap[Tris[i].iVertex[k]];
+    }
 
-                        int startframe = notetime;
-                        int numframes = end - notetime;
+    if( VertMap == NULL )
+        Gathered = Arena.New<Point3>(VertsPerFrame);
+    VertMap = map;
+    Split.Reorder(order,true);
+}
+
+void Unreal3DExport::WriteScript()
+{
+    // Write script file
+    {
+
+        if( !fScript.Open(ScriptFileName) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FSCRIPT),ScriptFileName);
+            throw MAXException(ProgressMsg.data());
+        }
 
-                        buf.printf( _T("#exec MESH SEQUENCE MESH=%s SEQ=%s STARTFRAME=%d NUMFRAMES=%d"), FileName, seq, notetime, numframes );
+        // Write class def, import and precision adjustments
+        U3DWriteScriptHeader( fScript, FileName, &OptOffset.x, &OptScale.x, &OptRot.x, FrameCount );
+        Cost.Clear();
+        Vat.Clear();
 
-                        if( !rate.isNull() )
-                            buf.printf( _T("%s RATE=%f"), buf, rate );
-                        
-                        if( !group.isNull() )
-                            buf.printf( _T("%s GROUP=%f"), buf, rate );
-                        
-                        SeqName = seq;
-                        SeqFrame = startframe;
+        // Get World NoteTrack keys
+        for( int k=0; k<Source->GetNoteCount(); ++k )
+        {
+            // Commands are parsed as views into the note text
+            FStrView text(Source->GetNoteText(k));
+            int notetime = Source->GetNoteFrame(k);
 
-                        buf.printf( _T("%s \n"), buf );
-                        _fputts( buf, fScript ); 
+            while( !text.isNull() )
+            {
+                FStrView cmd = SplitStr(text,_T('\n'));
+                
+                if( cmd.StartsWith(_T("a ")) )
+                {
+                    SplitStr(cmd,_T(' '));
+                    FStrView seq = SplitStr(cmd,_T(' '));
+                    int end = SplitStr(cmd,_T(' ')).ToInt();
+                    FStrView rate = SplitStr(cmd,_T(' '));
+                    FStrView group = SplitStr(cmd,_T(' '));
 
+                    if( seq.isNull() )
+                    {
+                        ProgressMsg.printf(_T("Missing animation name in notekey #%d"),notetime);
+                        throw MAXException(ProgressMsg.data());
                     }
-                    else if( MatchPattern(cmd,TSTR(_T("n *")),TRUE) )
+                    
+                    if( end <= notetime )
                     {
-                        SplitStr(cmd,_T(' '));
-                        TSTR func = SplitStr(cmd,_T(' '));
-                        TSTR time = SplitStr(cmd,_T(' '));
-                        
-                        if( func.isNull() )
+                        ProgressMsg.printf(_T("Invalid animation endframe (%d) in notekey #%d"),end,notetime);
+                        throw MAXException(ProgressMsg.data());
+                    }
+
+                    int startframe = notetime;
+                    int numframes = end - notetime;
+
+                    // Previews hold only their own frames, thinned out
+                    TCHAR ratebuf[32];
+                    if( PreviewStep > 0 )
+                    {
+                        if( startframe < FrameStart || startframe > FrameEnd )
                         {
-                            ProgressMsg.printf(_T("Missing notify name in notekey #%d"),notetime);
-                            throw MAXException(ProgressMsg.data());
+                            SeqName = FStrView();
+                            continue;
                         }
 
-                        if(  time.isNull() )
+                        TSTR ratestr = rate.isNull() ? TSTR(_T("30")) : TSTR(rate.Str).Substr(0,rate.Len);
+                        _stprintf(ratebuf,_T("%g"),_ttof(ratestr)/FrameStep);
+                        rate = FStrView(ratebuf);
+                        // Only the samples inside the sequence, the first
+                        // one may come after its start
+                        int first = (startframe - FrameStart + FrameStep-1) / FrameStep;
+                        int last = min((end-1 - FrameStart) / FrameStep, FrameCount-1);
+                        if( last < first )
                         {
-                            ProgressMsg.printf(_T("Missing notify time in notekey #%d"),notetime);
-                            throw MAXException(ProgressMsg.data());
+                            SeqName = FStrView();
+                            continue;
                         }
-
-                        buf.printf( _T("#exec MESH NOTIFY MESH=%s SEQ=%s TIME=%s FUNCTION=%s"), FileName, SeqName, time, func );
-                        
-                        _fputts( buf, fScript ); 
+                        startframe = first;
+                        numframes = last - first + 1;
                     }
 
+                    U3DWriteSequence( fScript, FileName, seq, startframe, numframes, rate, group );
+                    Cost.AddSequence( seq, startframe, numframes );
+                    Vat.AddSequence( seq, startframe, numframes, rate );
+                    Bounds.AddSequence( seq, startframe, numframes );
+                    
+                    SeqName = seq;
+                    SeqFrame = startframe;
+                }
+                else if( cmd.StartsWith(_T("n ")) )
+                {
+                    SplitStr(cmd,_T(' '));
+                    FStrView func = SplitStr(cmd,_T(' '));
+                    FStrView time = SplitStr(cmd,_T(' '));
+                    
+                    if( func.isNull() )
+                    {
+                        ProgressMsg.printf(_T("Missing notify name in notekey #%d"),notetime);
+                        throw MAXException(ProgressMsg.data());
+                    }
 
+                    if(  time.isNull() )
+                    {
+                        ProgressMsg.printf(_T("Missing notify time in notekey #%d"),notetime);
+                        throw MAXException(ProgressMsg.data());
+                    }
 
-
+                    if( PreviewStep == 0 || !SeqName.isNull() )
+                        U3DWriteNotify( fScript, FileName, SeqName, time, func );
                 }
             }
         }
@@ -887,14 +2082,18 @@ void Unreal3DExport::WriteScript()
         {
             for( int i=0; i<Materials.Count(); ++i )
             {
-                IGameMaterial* mat = Materials[i].Mat;
-                if( mat == NULL )
+                if( Materials[i].Mat < 0 )
                     continue;
 
-                _ftprintf( fScript, _T("#exec MESHMAP SETTEXTURE MESHMAP=%s NUM=%d TEXTURE=%s \n"), FileName, i, _T("DefaultTexture") ); 
+                U3DWriteTexture( fScript, FileName, i, _T("DefaultTexture") );
             }
         }
 
+        // Culling volumes go last, they end with the default properties
+        if( bWriteBounds )
+            Bounds.WriteScript(fScript);
+
+        StageOutput(fScript,ScriptFileName,IDS_ERR_FSCRIPT);
     }
 }
 
@@ -904,16 +2103,14 @@ void Unreal3DExport::WriteModel()
         pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_WRITE));
 
         // Open data file
-        fMesh = _tfopen(ModelFileName,_T("wb"));
-        if( !fMesh ) 
+        if( !fMesh.Open(ModelFileName) ) 
         {
             ProgressMsg.printf(GetString(IDS_ERR_FMODEL),ModelFileName);
             throw MAXException(ProgressMsg.data());
         }
 
         // Open anim file
-        fAnim = _tfopen(AnimFileName,_T("wb"));
-        if( !fAnim )
+        if( !fAnim.Open(AnimFileName) )
         {
             ProgressMsg.printf(GetString(IDS_ERR_FANIM),AnimFileName);
             throw MAXException(ProgressMsg.data());
@@ -934,10 +2131,10 @@ void Unreal3DExport::WriteModel()
         
 
         // Write data
-        fwrite(&hData,sizeof(FJSDataHeader),1,fMesh);
-        if( Tris.Count() > 0 )
+        if( !U3DWriteData(fMesh,hData,Tris.Count() ? Tris.Addr(0) : NULL) )
         {
-            fwrite(Tris.Addr(0),sizeof(FJSMeshTri),Tris.Count(),fMesh);
+            ProgressMsg.printf(GetString(IDS_ERR_FMODEL),ModelFileName);
+            throw MAXException(ProgressMsg.data());
         }
         Progress += U3D_PROGRESS_WMESH;
 
@@ -945,13 +2142,183 @@ void Unreal3DExport::WriteModel()
         CheckCancel();
         pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_WANIM));
 
-        // Write anim
-        fwrite(&hAnim,sizeof(FJSAnivHeader),1,fAnim);
-        if( Verts.Count() > 0 )
+        // Static split sidecar is written along with the anim
+        bool split = bSplitStatic && VertsPerFrame > 0;
+        if( split && (!fSplit.Open(SplitFileName) || !Split.WriteHeader(fSplit)) )
         {
-            fwrite(Verts.Addr(0),sizeof(FMeshVert),Verts.Count(),fAnim);
+            ProgressMsg.printf(GetString(IDS_ERR_FSPLIT),SplitFileName);
+            throw MAXException(ProgressMsg.data());
+        }
+
+        // Write anim, offset and scale are applied while packing
+        // Cost analysis sees the packed frames as the engine will
+        bool ok = U3DWriteAnivHeader(fAnim,hAnim);
+        bool splitok = true;
+        Cost.Begin(VertsPerFrame,Tris.Count(),FrameCount,&OptScale.x);
+        for( int t=0; t<FrameCount && ok && VertsPerFrame>0; ++t )
+        {
+            CheckCancel();
+            const FMeshVert* verts = GetPackedFrame(t);
+            Cost.AddFrame(verts);
+            ok = fAnim.Write(verts,hAnim.FrameSize);
+            splitok = splitok && (!split || Split.WriteFrame(fSplit,verts));
+        }
+        Cost.End();
+        if( !ok )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FANIM),AnimFileName);
+            throw MAXException(ProgressMsg.data());
+        }
+        if( !splitok )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FSPLIT),SplitFileName);
+            throw MAXException(ProgressMsg.data());
         }
         Progress += U3D_PROGRESS_WANIM;
+
+        StageOutput(fMesh,ModelFileName,IDS_ERR_FMODEL);
+        StageOutput(fAnim,AnimFileName,IDS_ERR_FANIM);
+        if( split )
+            StageOutput(fSplit,SplitFileName,IDS_ERR_FSPLIT);
+
+        // Budget checks read the cost sidecar
+        if( !fCost.Open(CostFileName) || !Cost.WriteJson(fCost,FileName) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FCOST),CostFileName);
+            throw MAXException(ProgressMsg.data());
+        }
+        StageOutput(fCost,CostFileName,IDS_ERR_FCOST);
+        FLogWriter::FChannel costlog = Log.Channel(FLogWriter::Info,FLogWriter::Output);
+        Cost.WriteLog(costlog);
+
+        // Per frame and per sequence culling volumes from Prepare
+        if( bWriteBounds )
+        {
+            if( !fBounds.Open(BoundsFileName) || !Bounds.Write(fBounds) )
+            {
+                ProgressMsg.printf(GetString(IDS_ERR_FBOUNDS),BoundsFileName);
+                throw MAXException(ProgressMsg.data());
+            }
+            StageOutput(fBounds,BoundsFileName,IDS_ERR_FBOUNDS);
+            Log.Printf( FLogWriter::Info, FLogWriter::Output, _T("Bounds: frame boxes take %.0f%% of the animation box on average\n")
+                , Bounds.GetFrameFill()*100 );
+        }
+
+        // GPU playback copy of the same frames
+        if( VatFormat != FVatWriter::Off )
+            WriteVat();
+}
+
+// Position texture, rest pose mesh and layout for engines that play the
+// frames on the GPU, see U3DVat.h. Pages are streamed a frame at a time.
+void Unreal3DExport::WriteVat()
+{
+    if( VertsPerFrame == 0 || FrameCount == 0 )
+        return;
+
+    CheckCancel();
+    pInt->ProgressUpdate(Progress, FALSE, GetString(IDS_INFO_VAT));
+
+    Vat.Begin(VatFormat,VertsPerFrame,FrameCount,&BoundsMin.x,&BoundsMax.x);
+    if( !Vat.IsInRange() )
+        Log.Printf( FLogWriter::Warning, FLogWriter::Output, _T("VAT: %s is too big for float16 positions, use VatFormat=2\n"), FileName.data() );
+
+    // Frames go through UnrealCoords one at a time, like the packed verts
+    Point3* frame = Arena.New<Point3>(VertsPerFrame);
+    TSTR base = FilePath + _T("\\") + FileName;
+    TSTR path;
+    for( int p=0; p<Vat.Pages; ++p )
+    {
+        path = Vat.GetPageName(base.data(),p).c_str();
+        bool ok = fVat.Open(path) && Vat.WritePageHeader(fVat);
+        for( int i=0; i<Vat.GetPageFrames(p) && ok; ++i )
+        {
+            CheckCancel();
+            U3DTransformPoints(&GetOutputFrame(p*Vat.FramesPerPage+i)->x,VertsPerFrame,Axes,&frame->x);
+            ok = Vat.WriteFrame(fVat,&frame->x);
+        }
+        if( !ok || !Vat.EndPage(fVat,p) )
+        {
+            ProgressMsg.printf(GetString(IDS_ERR_FVAT),path);
+            throw MAXException(ProgressMsg.data());
+        }
+        StageOutput(fVat,path,IDS_ERR_FVAT);
+    }
+
+    U3DTransformPoints(&GetOutputFrame(0)->x,VertsPerFrame,Axes,&frame->x);
+    Vat.BuildMesh(&frame->x,Tris.Count() ? Tris.Addr(0) : NULL,Tris.Count());
+    path = base + _T("_vat.bin");
+    if( !fVat.Open(path) || !Vat.WriteMeshBin(fVat) )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_FVAT),path);
+        throw MAXException(ProgressMsg.data());
+    }
+    StageOutput(fVat,path,IDS_ERR_FVAT);
+
+    path = base + _T("_vat.gltf");
+    if( !fVat.Open(path) || !Vat.WriteMeshGltf(fVat,FileName,FileName + _T("_vat.bin")) )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_FVAT),path);
+        throw MAXException(ProgressMsg.data());
+    }
+    StageOutput(fVat,path,IDS_ERR_FVAT);
+
+    path = base + _T("_vat.json");
+    if( !fVat.Open(path) || !Vat.WriteJson(fVat,FileName) )
+    {
+        ProgressMsg.printf(GetString(IDS_ERR_FVAT),path);
+        throw MAXException(ProgressMsg.data());
+    }
+    StageOutput(fVat,path,IDS_ERR_FVAT);
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Output, _T("VAT: %d x %d texels in %d page(s), %s\n")
+        , Vat.Width, Vat.PageHeight, Vat.Pages, VatFormat == FVatWriter::Half ? _T("float16") : _T("unorm16") );
+}
+
+// Adds up the big buffers after a phase, the peak goes to the summary
+void Unreal3DExport::TrackMemory( const TCHAR* phase )
+{
+    LiveBytes = Frames.GetResidentBytes()
+              + Packed.GetBytes()
+              + (Tris.Count() + SceneTris.Count()) * sizeof(FJSMeshTri)
+              + Verts.Count() * sizeof(FMeshVert)
+              + FaceMaterials.Count() * sizeof(sMaterial)
+              + Arena.GetReserved();
+    PeakBytes = max(PeakBytes,LiveBytes);
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Memory, _T("Memory: %u KB live after %s, %u KB peak, %u KB on disk\n")
+        , static_cast<unsigned>(LiveBytes/1024), phase
+        , static_cast<unsigned>(PeakBytes/1024)
+        , static_cast<unsigned>(Frames.GetSpilledBytes()/1024) );
+}
+
+// Finished output, it replaces the target in CommitOutputs
+void Unreal3DExport::StageOutput( FOutFile& f, const TSTR& filename, int errid )
+{
+    if( !f.Stage(Staged,errid) )
+    {
+        ProgressMsg.printf(GetString(errid),filename);
+        throw MAXException(ProgressMsg.data());
+    }
+}
+
+// Replaces the targets whose content changed since the last export, only
+// once every output of the export is written
+void Unreal3DExport::CommitOutputs()
+{
+    bool ok = Staged.Commit(Outputs);
+    OutputsWritten = Staged.Written;
+    OutputsUnchanged = Staged.Unchanged;
+
+    // Stale manifest only costs a rewrite next time
+    Outputs.Save();
+
+    Log.Printf( FLogWriter::Info, FLogWriter::Output, _T("Outputs: %d written, %d unchanged\n"), OutputsWritten, OutputsUnchanged );
+    if( !ok )
+    {
+        ProgressMsg.printf(GetString(Staged.FailedTag),Staged.FailedPath.c_str());
+        throw MAXException(ProgressMsg.data());
+    }
 }
 
 void Unreal3DExport::ShowSummary()
@@ -968,6 +2335,33 @@ void Unreal3DExport::ShowSummary()
             , hData.NumPolys
             , hData.NumVertices);
 
+        if( StrippedDegenerate + StrippedDuplicate + StrippedVerts > 0 )
+        {
+            TSTR buf;
+            buf.printf(GetString(IDS_INFO_STRIPPED)
+                , StrippedDegenerate
+                , StrippedDuplicate
+                , StrippedVerts);
+            ProgressMsg += buf;
+        }
+
+        {
+            TSTR buf;
+            buf.printf(GetString(IDS_INFO_MEMORY)
+                , static_cast<unsigned>(PeakBytes/1024)
+                , static_cast<unsigned>(Frames.GetSpilledBytes()/1024));
+            ProgressMsg += buf;
+        }
+
+        if( OutputsUnchanged > 0 )
+        {
+            TSTR buf;
+            buf.printf(GetString(IDS_INFO_UNCHANGED)
+                , OutputsUnchanged
+                , OutputsWritten + OutputsUnchanged);
+            ProgressMsg += buf;
+        }
+
         if( bMaxResolution )
         {
             TSTR buf;
@@ -992,30 +2386,126 @@ TSTR Unreal3DExport::GetCfgFileName()
 }
 
 
+// Comma separated category names or "all"
+static int ParseLogCategories( FStrView text )
+{
+    int categories = 0;
+    while( !text.isNull() )
+    {
+        FStrView name = SplitStr(text,_T(','));
+        while( name.Len > 0 && (name.Str[0] == _T(' ')) )
+        {
+            ++name.Str;
+            --name.Len;
+        }
+        if( name.StartsWith(_T("all")) )
+            categories = FLogWriter::All;
+        for( int i=0; FLogWriter::GetCategoryName(i) != NULL; ++i )
+        {
+            if( name.StartsWith(FLogWriter::GetCategoryName(i)) )
+                categories |= 1 << i;
+        }
+    }
+    return categories;
+}
+
+// Comma separated percentages of the tris each LOD keeps, kept largest first
+void Unreal3DExport::ParseLodPercent( FStrView text )
+{
+    LodCount = 0;
+    while( !text.isNull() && LodCount < U3D_LOD_MAXLODS )
+    {
+        int percent = SplitStr(text,_T(',')).ToInt();
+        if( percent <= 0 || percent >= 100 )
+            continue;
+
+        int i = LodCount++;
+        for( ; i > 0 && LodPercent[i-1] < percent; --i )
+            LodPercent[i] = LodPercent[i-1];
+        LodPercent[i] = percent;
+    }
+}
+
 BOOL Unreal3DExport::ReadConfig()
 {
-    //TSTR FileName = GetCfgFileName();
-    //FILE* cfgStream;
-
-    //cfgStream = fopen(FileName, "rb");
-    //if (!cfgStream)
-    //    return FALSE;
-    //
-    //fclose(cfgStream);
+    FILE* cfgStream = _tfopen(GetCfgFileName(), _T("rb"));
+    if (!cfgStream)
+        return FALSE;
+
+    // One "Key=Value" per line, unknown keys are ignored
+    TCHAR line[256];
+    while( _fgetts(line,256,cfgStream) )
+    {
+        FStrView value(line);
+        FStrView key = SplitStr(value,_T('='));
+
+        if( key.StartsWith(_T("MemoryBudget")) )
+            MemoryBudget = max(0,value.ToInt());
+        else if( key.StartsWith(_T("StripGeometry")) )
+            bStripGeometry = value.ToInt() != 0;
+        else if( key.StartsWith(_T("WriteArchive")) )
+            bWriteArchive = value.ToInt() != 0;
+        else if( key.StartsWith(_T("RecordScene")) )
+            bRecordScene = value.ToInt() != 0;
+        else if( key.StartsWith(_T("SplitStatic")) )
+            bSplitStatic = value.ToInt() != 0;
+        else if( key.StartsWith(_T("StaticFirst")) )
+            bStaticFirst = value.ToInt() != 0;
+        else if( key.StartsWith(_T("LodPercent")) )
+            ParseLodPercent(value);
+        else if( key.StartsWith(_T("WriteBounds")) )
+            bWriteBounds = value.ToInt() != 0;
+        else if( key.StartsWith(_T("SinglePass")) )
+            bSinglePass = value.ToInt() != 0;
+        else if( key.StartsWith(_T("VatFormat")) )
+            VatFormat = max(0,min(value.ToInt(),FVatWriter::Unorm16));
+        else if( key.StartsWith(_T("LogLevel")) )
+            Log.SetFilter(max(0,value.ToInt()),Log.GetCategories());
+        else if( key.StartsWith(_T("LogCategories")) )
+            Log.SetFilter(Log.GetLevel(),ParseLogCategories(value));
+        else if( key.StartsWith(_T("Include")) )
+            AddNodeRule(true,value);
+        else if( key.StartsWith(_T("Exclude")) )
+            AddNodeRule(false,value);
+    }
+
+    fclose(cfgStream);
     return TRUE;
 }
 
 void Unreal3DExport::WriteConfig()
 {
-    //TSTR FileName = GetCfgFileName();
-    //FILE* cfgStream;
-
-    //cfgStream = fopen(FileName, "wb");
-    //if (!cfgStream)
-    //    return;
+    FILE* cfgStream = _tfopen(GetCfgFileName(), _T("wb"));
+    if (!cfgStream)
+        return;
+
+    _ftprintf( cfgStream, _T("MemoryBudget=%d\n"), MemoryBudget );
+    _ftprintf( cfgStream, _T("StripGeometry=%d\n"), bStripGeometry ? 1 : 0 );
+    _ftprintf( cfgStream, _T("WriteArchive=%d\n"), bWriteArchive ? 1 : 0 );
+    _ftprintf( cfgStream, _T("RecordScene=%d\n"), bRecordScene ? 1 : 0 );
+    _ftprintf( cfgStream, _T("SplitStatic=%d\n"), bSplitStatic ? 1 : 0 );
+    _ftprintf( cfgStream, _T("StaticFirst=%d\n"), bStaticFirst ? 1 : 0 );
+    _ftprintf( cfgStream, _T("VatFormat=%d\n"), VatFormat );
+    _ftprintf( cfgStream, _T("WriteBounds=%d\n"), bWriteBounds ? 1 : 0 );
+    _ftprintf( cfgStream, _T("SinglePass=%d\n"), bSinglePass ? 1 : 0 );
+    _ftprintf( cfgStream, _T("LodPercent=") );
+    for( int i=0; i<LodCount; ++i )
+        _ftprintf( cfgStream, _T("%s%d"), i ? _T(",") : _T(""), LodPercent[i] );
+    _ftprintf( cfgStream, _T("\n") );
+    _ftprintf( cfgStream, _T("LogLevel=%d\n"), Log.GetLevel() );
+    _ftprintf( cfgStream, _T("LogCategories=") );
+    for( int i=0, sep=0; FLogWriter::GetCategoryName(i) != NULL; ++i )
+    {
+        if( Log.GetCategories() & (1 << i) )
+            _ftprintf( cfgStream, _T("%s%s"), sep++ ? _T(",") : _T(""), FLogWriter::GetCategoryName(i) );
+    }
+    _ftprintf( cfgStream, _T("\n") );
+    for( int i=0; i<NodeRules.Count(); ++i )
+    {
+        _ftprintf( cfgStream, _T("%s=%s\n"), NodeRules[i].bInclude ? _T("Include") : _T("Exclude"), NodeRules[i].Text );
+    }
 
-    //
-    //fclose(cfgStream);
+    fclose(cfgStream);
 }
 
 
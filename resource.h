@@ -23,6 +23,13 @@
 #define IDS_INFO_OPT_SCAN               109
 #define IDS_INFO_OPT_APPLY              110
 #define IDS_INFO_DIDPRECISION           111
+#define IDS_INFO_STRIP                  112
+#define IDS_INFO_STRIPPED               113
+#define IDS_INFO_ARCHIVE                114
+#define IDS_INFO_UNCHANGED              115
+#define IDS_INFO_MEMORY                 116
+#define IDS_INFO_LOD                    117
+#define IDS_INFO_VAT                    118
 #define IDS_ERR_IGAME                   201
 #define IDS_ERR_FRAMERANGE              202
 #define IDS_ERR_FMODEL                  203
@@ -30,6 +37,14 @@
 #define IDS_ERR_NOTRI                   205
 #define IDS_ERR_NOVERTS                 206
 #define IDS_ERR_FSCRIPT                 207
+#define IDS_ERR_FARCHIVE                208
+#define IDS_ERR_FRAMES                  209
+#define IDS_ERR_FSCENE                  210
+#define IDS_ERR_FCOST                   211
+#define IDS_ERR_FSPLIT                  212
+#define IDS_ERR_FVAT                    213
+#define IDS_ERR_FBOUNDS                 214
+#define IDS_ERR_FORMAT                  215
 #define IDS_CANCEL_Q                    300
 #define IDS_CANCEL_C                    301
 #define IDS_CANCEL_ERR                  302
@@ -41,6 +56,7 @@
 #define IDC_EDIT5                       1005
 #define IDC_EDIT_Z                      1005
 #define IDC_BUTTON1                     1006
+#define IDC_EDIT_PREVIEW                1007
 #define IDC_COLOR                       1456
 #define IDC_EDIT                        1490
 #define IDC_SPIN                        1496
@@ -51,7 +67,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        103
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1007
+#define _APS_NEXT_CONTROL_VALUE         1008
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
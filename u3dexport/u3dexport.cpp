@@ -0,0 +1,1365 @@
+/**********************************************************************
+ *<
+    FILE: u3dexport.cpp
+
+    DESCRIPTION:    Headless batch converter from point caches to Unreal .3d
+
+    CREATED BY:     Roman Switch` Dzieciol
+
+    HISTORY:
+
+ *> Copyright (c) 2007, All Rights Reserved.
+ **********************************************************************/
+
+#include "U3DHeadless.h"
+#include "U3DFormat.h"
+#include "U3DCancel.h"
+#include "U3DOutput.h"
+#include "U3DCore.h"
+#include "U3DScene.h"
+#include "U3DPca.h"
+#include "U3DCost.h"
+#include "U3DPlayer.h"
+#include "U3DVat.h"
+#include "U3DOrder.h"
+#include "U3DBounds.h"
+#include "U3DPredict.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define U3D_CACHE_MAGIC     0x43443355  // "U3DC"
+#define U3D_FILL_CHUNK      (1 << 22)   // floats zeroed between cancel checks
+
+#pragma pack(push,1)
+// Raw point cache: header followed by float[NumFrames][NumVertices][3]
+struct FPointCacheHeader
+{
+    U_DWORD Magic;
+    U_DWORD NumVertices;
+    U_DWORD NumFrames;
+};
+#pragma pack(pop)
+
+
+struct FSequence
+{
+    std::string Name;
+    int         Start;
+    int         NumFrames;
+    std::string Rate;
+    std::string Group;
+    std::vector< std::pair<std::string,std::string> > Notifies;  // function, time
+};
+
+struct FAsset
+{
+    std::string                 Name;
+    std::string                 OutDir;
+    std::string                 Kind;
+    std::vector<std::string>    Inputs;
+    std::vector<FSequence>      Seqs;
+    long long                   Cost;
+
+    // Results
+    std::string                 Error;
+    int                         Frames;
+    int                         Verts;
+    int                         Tris;
+    int                         Outputs;
+    int                         Unchanged;
+    float                       MaxError;       // -verify, world units
+    float                       VatError;       // -verify with -vat
+    int                         Probes;         // -singlepass
+    int                         Regrows;
+    int                         Repacked;
+    double                      PackTwoPass;    // -bench, seconds
+    double                      PackFused;
+    int                         PackDiffs;
+    double                      Seconds;
+};
+
+// Sampled data, same layout as the plugin's Points and Tris
+struct FMesh
+{
+    int                         VertsPerFrame;
+    int                         FrameCount;
+    std::vector<float>          Points;
+    std::vector<FJSMeshTri>     Tris;
+    std::vector<std::string>    Materials;
+
+    FMesh() : VertsPerFrame(0), FrameCount(0)
+    {
+    }
+};
+
+static bool bMaxResolution = true;
+static bool bVerify = false;
+static bool bBench = false;
+static bool bWriteBounds = false;
+static bool bSinglePass = false;
+static int VatFormat = FVatWriter::Off;
+
+// Set by Ctrl+C, workers check it per frame and per chunk written
+static FCancelToken Cancel;
+
+static void OnInterrupt( int )
+{
+    Cancel.Cancel();
+}
+
+static bool IsCancelled( std::string& err )
+{
+    if( !Cancel.IsCancelled() )
+        return false;
+    err = "Cancelled";
+    return true;
+}
+
+// Sizes Points for all frames. Zeroing a long clip takes long enough that
+// Ctrl+C is checked between chunks.
+static bool AllocPoints( FMesh& mesh, std::string& err )
+{
+    size_t count = static_cast<size_t>(mesh.VertsPerFrame)*mesh.FrameCount*3;
+    mesh.Points.clear();
+    mesh.Points.reserve(count);
+    while( mesh.Points.size() < count )
+    {
+        if( IsCancelled(err) )
+            return false;
+        mesh.Points.resize(std::min(count,mesh.Points.size()+U3D_FILL_CHUNK));
+    }
+    return true;
+}
+
+// Creates path and its missing parents. Assets on other threads may be
+// creating the same ones.
+static bool MakeDirs( const std::string& path )
+{
+    for( size_t s = path.find('/',1); ; s = path.find('/',s+1) )
+    {
+        std::string dir = path.substr(0,s);
+        if( !dir.empty() && mkdir(dir.c_str(),0777) != 0 && errno != EEXIST )
+            return false;
+        if( s == std::string::npos )
+            break;
+    }
+
+    struct stat st;
+    return stat(path.c_str(),&st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+static std::vector<std::string> Tokenize( const std::string& line, const char* sep )
+{
+    std::vector<std::string> tokens;
+    size_t i = line.find_first_not_of(sep);
+    while( i != std::string::npos )
+    {
+        size_t e = line.find_first_of(sep,i);
+        tokens.push_back(line.substr(i,e == std::string::npos ? std::string::npos : e-i));
+        i = line.find_first_not_of(sep,e);
+    }
+    return tokens;
+}
+
+static long long FileSize( const std::string& path )
+{
+    FILE* f = fopen(path.c_str(),"rb");
+    if( !f )
+        return 0;
+    fseek(f,0,SEEK_END);
+    long long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static bool ReadLine( FILE* f, std::string& line )
+{
+    line.clear();
+    int c;
+    while( (c = fgetc(f)) != EOF )
+    {
+        if( c == '\n' )
+            return true;
+        if( c != '\r' )
+            line += static_cast<char>(c);
+    }
+    return !line.empty();
+}
+
+// Same rule as the plugin: "F=Number" token in the material name
+static U_BYTE GetMaterialFlags( const std::string& name )
+{
+    U_BYTE flags = 0;
+    std::vector<std::string> tokens = Tokenize(name," \t,;");
+    for( size_t i=0; i!=tokens.size(); ++i )
+    {
+        if( FStrView(tokens[i].c_str()).StartsWith("F=") )
+            flags = static_cast<U_BYTE>(atoi(tokens[i].c_str()+2));
+    }
+    return flags;
+}
+
+
+//--- Loaders --------------------------------------------------------------
+
+// Frames of an OBJ sequence, faces and UVs come from the first frame
+static bool LoadObjFrame( const std::string& path, FMesh& mesh, bool first, std::string& err )
+{
+    FILE* f = fopen(path.c_str(),"rb");
+    if( !f )
+    {
+        err = "Could not open " + path;
+        return false;
+    }
+
+    std::vector<float> uvs;
+    int vertcount = 0;
+    int mat = 0;
+    std::string line;
+    while( ReadLine(f,line) )
+    {
+        if( line.size() < 2 )
+            continue;
+
+        if( line[0] == 'v' && line[1] == ' ' )
+        {
+            float p[3] = { 0,0,0 };
+            sscanf(line.c_str()+2,"%f %f %f",&p[0],&p[1],&p[2]);
+            mesh.Points.insert(mesh.Points.end(),p,p+3);
+            ++vertcount;
+        }
+        else if( !first )
+        {
+            continue;
+        }
+        else if( line[0] == 'v' && line[1] == 't' )
+        {
+            float uv[2] = { 0,0 };
+            sscanf(line.c_str()+2,"%f %f",&uv[0],&uv[1]);
+            uvs.insert(uvs.end(),uv,uv+2);
+        }
+        else if( line.compare(0,7,"usemtl ") == 0 )
+        {
+            std::string name = line.substr(7);
+            for( mat=0; mat<static_cast<int>(mesh.Materials.size()); ++mat )
+                if( mesh.Materials[mat] == name )
+                    break;
+            if( mat == static_cast<int>(mesh.Materials.size()) )
+                mesh.Materials.push_back(name);
+        }
+        else if( line[0] == 'f' && line[1] == ' ' )
+        {
+            // Polygons are split into fans
+            std::vector<std::string> corners = Tokenize(line.substr(2)," \t");
+            int vi[3] = { 0,0,0 };
+            int ti[3] = { 0,0,0 };
+            for( size_t c=0; c<corners.size(); ++c )
+            {
+                int v = 0;
+                int t = 0;
+                sscanf(corners[c].c_str(),"%d/%d",&v,&t);
+                v = v < 0 ? vertcount+v : v-1;
+                t = t < 0 ? static_cast<int>(uvs.size()/2)+t : t-1;
+
+                int slot = c < 3 ? static_cast<int>(c) : 2;
+                if( c >= 3 )
+                {
+                    vi[1] = vi[2];
+                    ti[1] = ti[2];
+                }
+                vi[slot] = v;
+                ti[slot] = t;
+
+                if( c >= 2 )
+                {
+                    FJSMeshTri tri;
+                    for( int k=0; k<3; ++k )
+                    {
+                        if( vi[k] < 0 || vi[k] > U3D_MAX_INDEX )
+                        {
+                            err = "Invalid face in " + path;
+                            fclose(f);
+                            return false;
+                        }
+                        tri.iVertex[k] = static_cast<U_WORD>(vi[k]);
+                        if( ti[k] >= 0 && ti[k]*2+1 < static_cast<int>(uvs.size()) )
+                            tri.Tex[k] = FMeshUV::FromFloat(uvs[ti[k]*2],uvs[ti[k]*2+1]);
+                    }
+                    tri.TextureNum = static_cast<U_BYTE>(mat);
+                    tri.Flags = mesh.Materials.empty() ? 0 : GetMaterialFlags(mesh.Materials[mat]);
+                    mesh.Tris.push_back(tri);
+                }
+            }
+        }
+    }
+    fclose(f);
+
+    if( first )
+    {
+        mesh.VertsPerFrame = vertcount;
+    }
+    else if( vertcount != mesh.VertsPerFrame )
+    {
+        char buf[256];
+        sprintf(buf,"Frame #%d has different number of vertices (%d instead of %d)",mesh.FrameCount,vertcount,mesh.VertsPerFrame);
+        err = buf;
+        return false;
+    }
+
+    ++mesh.FrameCount;
+    return true;
+}
+
+static bool LoadObj( const FAsset& asset, FMesh& mesh, std::string& err )
+{
+    std::vector<std::string> files;
+
+    // "name_%04d.obj first last" or a list of files
+    if( asset.Inputs.size() == 3 && asset.Inputs[0].find('%') != std::string::npos )
+    {
+        int first = atoi(asset.Inputs[1].c_str());
+        int last = atoi(asset.Inputs[2].c_str());
+        for( int i=first; i<=last; ++i )
+        {
+            char buf[1024];
+            snprintf(buf,sizeof(buf),asset.Inputs[0].c_str(),i);
+            files.push_back(buf);
+        }
+    }
+    else
+    {
+        files = asset.Inputs;
+    }
+
+    for( size_t i=0; i<files.size(); ++i )
+    {
+        if( IsCancelled(err) || !LoadObjFrame(files[i],mesh,i == 0,err) )
+            return false;
+    }
+    return true;
+}
+
+// Triangle list: "a b c [u0 v0 u1 v1 u2 v2 [texture [flags]]]" per line
+static bool LoadTriList( const std::string& path, FMesh& mesh, std::string& err )
+{
+    FILE* f = fopen(path.c_str(),"rb");
+    if( !f )
+    {
+        err = "Could not open " + path;
+        return false;
+    }
+
+    std::string line;
+    while( ReadLine(f,line) )
+    {
+        std::vector<std::string> t = Tokenize(line," \t");
+        if( t.empty() || t[0][0] == '#' )
+            continue;
+        if( t.size() < 3 )
+        {
+            err = "Invalid triangle in " + path + ": " + line;
+            fclose(f);
+            return false;
+        }
+
+        FJSMeshTri tri;
+        for( int k=0; k<3; ++k )
+        {
+            int v = atoi(t[k].c_str());
+            if( v < 0 || v > U3D_MAX_INDEX )
+            {
+                err = "Invalid triangle in " + path + ": " + line;
+                fclose(f);
+                return false;
+            }
+            tri.iVertex[k] = static_cast<U_WORD>(v);
+            if( t.size() >= 9 )
+                tri.Tex[k] = FMeshUV::FromFloat(static_cast<float>(atof(t[3+k*2].c_str())),static_cast<float>(atof(t[4+k*2].c_str())));
+        }
+        if( t.size() >= 10 )
+            tri.TextureNum = static_cast<U_BYTE>(atoi(t[9].c_str()));
+        if( t.size() >= 11 )
+            tri.Flags = static_cast<U_BYTE>(atoi(t[10].c_str()));
+
+        while( static_cast<int>(mesh.Materials.size()) <= tri.TextureNum )
+            mesh.Materials.push_back(std::string());
+        mesh.Tris.push_back(tri);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool LoadCache( const FAsset& asset, FMesh& mesh, std::string& err )
+{
+    if( asset.Inputs.size() != 2 )
+    {
+        err = "cache needs a point cache and a triangle list";
+        return false;
+    }
+
+    FILE* f = fopen(asset.Inputs[0].c_str(),"rb");
+    if( !f )
+    {
+        err = "Could not open " + asset.Inputs[0];
+        return false;
+    }
+
+    FPointCacheHeader h;
+    bool ok = fread(&h,sizeof(h),1,f) == 1 && h.Magic == U3D_CACHE_MAGIC;
+    if( ok )
+    {
+        mesh.VertsPerFrame = h.NumVertices;
+        mesh.FrameCount = h.NumFrames;
+        ok = AllocPoints(mesh,err);
+
+        // Read a frame at a time so Ctrl+C is seen
+        size_t frame = static_cast<size_t>(h.NumVertices)*3;
+        for( U_DWORD t=0; t<h.NumFrames && ok && frame>0; ++t )
+            ok = !Cancel.IsCancelled() && fread(&mesh.Points[frame*t],sizeof(float),frame,f) == frame;
+    }
+    fclose(f);
+
+    if( IsCancelled(err) )
+        return false;
+    if( !ok )
+    {
+        err = "Invalid point cache " + asset.Inputs[0];
+        return false;
+    }
+    return LoadTriList(asset.Inputs[1],mesh,err);
+}
+
+static bool LoadPca( const FAsset& asset, FMesh& mesh, std::string& err )
+{
+    FILE* f = asset.Inputs.size() == 1 ? fopen(asset.Inputs[0].c_str(),"rb") : NULL;
+    if( !f )
+    {
+        err = "pca needs one readable .u3dpca archive";
+        return false;
+    }
+
+    FPcaDecoder dec;
+    bool ok = dec.Read(f);
+    fclose(f);
+    if( !ok )
+    {
+        err = "Invalid archive " + asset.Inputs[0];
+        return false;
+    }
+
+    mesh.VertsPerFrame = dec.Header.NumVertices;
+    mesh.FrameCount = dec.Header.NumFrames;
+    mesh.Tris = dec.Tris;
+    if( !AllocPoints(mesh,err) )
+        return false;
+    if( !mesh.Points.empty() )
+        dec.DecodeAll(&mesh.Points[0]);
+
+    for( size_t i=0; i<mesh.Tris.size(); ++i )
+        while( static_cast<int>(mesh.Materials.size()) <= mesh.Tris[i].TextureNum )
+            mesh.Materials.push_back(std::string());
+    return true;
+}
+
+
+// Scene recorded by the plugin, goes through the same steps as GetTris,
+// GetAnim and WriteScript do inside 3ds Max
+static bool LoadScene( FAsset& asset, FMesh& mesh, std::string& err )
+{
+    FSceneReplay scene;
+    if( asset.Inputs.size() != 1 || !scene.Open(asset.Inputs[0].c_str()) )
+    {
+        err = "scene needs one readable .u3dscene recording";
+        return false;
+    }
+
+    // Material flags are parsed once per material
+    std::vector<U_BYTE> flags(scene.GetMaterialCount());
+    for( size_t m=0; m<flags.size(); ++m )
+        flags[m] = GetMaterialFlags(scene.GetMaterialName(static_cast<int>(m)));
+
+    // Meshes without verts or faces are skipped, like in the plugin
+    int meshcount = scene.GetMeshCount();
+    std::vector<int> offsets(meshcount,-1);
+    std::vector<FSceneFace> faces;
+    for( int n=0; n<meshcount; ++n )
+    {
+        int vertcount = scene.GetVertCount(n);
+        int facecount = scene.GetFaceCount(n);
+        if( vertcount <= 0 || facecount <= 0 )
+            continue;
+
+        faces.resize(facecount);
+        facecount = scene.GetFaces(n,&faces[0]);
+        for( int i=0; i<facecount; ++i )
+        {
+            const FSceneFace& face = faces[i];
+            FJSMeshTri tri;
+            tri.TextureNum = static_cast<U_BYTE>(face.MatID);
+            tri.Flags = face.Material >= 0 ? flags[face.Material] : 0;
+            for( int k=0; k<3; ++k )
+            {
+                if( mesh.VertsPerFrame + face.Vert[k] > U3D_MAX_INDEX )
+                {
+                    err = "Too many vertices for the .3d format in " + asset.Inputs[0];
+                    return false;
+                }
+                tri.iVertex[k] = static_cast<U_WORD>(mesh.VertsPerFrame + face.Vert[k]);
+                if( face.UVMask & (1<<k) )
+                    tri.Tex[k] = FMeshUV::FromFloat(face.UV[k][0],face.UV[k][1]);
+            }
+            mesh.Tris.push_back(tri);
+
+            while( static_cast<int>(mesh.Materials.size()) <= tri.TextureNum )
+                mesh.Materials.push_back(std::string());
+            if( face.Material >= 0 )
+                mesh.Materials[tri.TextureNum] = scene.GetMaterialName(face.Material);
+        }
+
+        offsets[n] = mesh.VertsPerFrame;
+        mesh.VertsPerFrame += vertcount;
+    }
+
+    mesh.FrameCount = scene.GetFrameEnd() - scene.GetFrameStart() + 1;
+    if( !AllocPoints(mesh,err) )
+        return false;
+    for( int t=0; t<mesh.FrameCount; ++t )
+    {
+        if( IsCancelled(err) )
+            return false;
+
+        int frame = scene.GetFrameStart() + t;
+        scene.SetFrame(frame);
+
+        int frameverts = 0;
+        for( int n=0; n<meshcount; ++n )
+        {
+            if( offsets[n] >= 0 )
+                frameverts += scene.GetVerts(n,&mesh.Points[(static_cast<size_t>(t)*mesh.VertsPerFrame + offsets[n])*3],scene.GetVertCount(n));
+        }
+
+        if( frameverts != mesh.VertsPerFrame )
+        {
+            char buf[256];
+            snprintf(buf,sizeof(buf),"Frame #%d has different number of vertices (%d instead of %d)",frame,frameverts,mesh.VertsPerFrame);
+            err = buf;
+            return false;
+        }
+    }
+
+    // Version 2 recordings are in Max world space, the plugin converts
+    // while packing, here the points are converted once up front
+    float axes[12];
+    scene.GetAxes(axes);
+    if( !mesh.Points.empty() )
+        U3DTransformPoints(&mesh.Points[0],mesh.VertsPerFrame*mesh.FrameCount,axes,&mesh.Points[0]);
+
+    // Note track commands, unless the manifest gives the sequences
+    if( !asset.Seqs.empty() )
+        return true;
+
+    for( int k=0; k<scene.GetNoteCount(); ++k )
+    {
+        std::vector<std::string> lines = Tokenize(scene.GetNoteText(k),"\r\n");
+        int notetime = scene.GetNoteFrame(k);
+        for( size_t l=0; l<lines.size(); ++l )
+        {
+            std::vector<std::string> t = Tokenize(lines[l]," ");
+            if( t.size() >= 3 && (t[0] == "a" || t[0] == "A") )
+            {
+                FSequence seq;
+                seq.Name = t[1];
+                seq.Start = notetime;
+                seq.NumFrames = atoi(t[2].c_str()) - notetime;
+                if( t.size() >= 4 ) seq.Rate = t[3];
+                if( t.size() >= 5 ) seq.Group = t[4];
+                if( seq.NumFrames <= 0 )
+                {
+                    err = "Invalid animation endframe in notekey #" + std::to_string(notetime);
+                    return false;
+                }
+                asset.Seqs.push_back(seq);
+            }
+            else if( t.size() >= 3 && (t[0] == "n" || t[0] == "N") && !asset.Seqs.empty() )
+            {
+                asset.Seqs.back().Notifies.push_back(std::make_pair(t[1],t[2]));
+            }
+        }
+    }
+    return true;
+}
+
+
+//--- Pipeline -------------------------------------------------------------
+
+// Materials numbered by name, tris grouped by material in vertex cache
+// order, like SortMaterials in the plugin
+static void SortMaterials( FMesh& mesh )
+{
+    int tricount = static_cast<int>(mesh.Tris.size());
+    int slots = static_cast<int>(mesh.Materials.size());
+    for( int i=0; i<tricount; ++i )
+        slots = std::max(slots,mesh.Tris[i].TextureNum+1);
+
+    std::vector<const char*> names(slots+1,static_cast<const char*>(NULL));
+    for( int i=0; i<static_cast<int>(mesh.Materials.size()); ++i )
+        names[i] = mesh.Materials[i].empty() ? NULL : mesh.Materials[i].c_str();
+
+    std::vector<int> remap(slots+1);
+    FTriOrder::GetMaterialOrder(&names[0],slots,&remap[0]);
+
+    std::vector<std::string> materials(slots);
+    for( int i=0; i<static_cast<int>(mesh.Materials.size()); ++i )
+        materials[remap[i]] = mesh.Materials[i];
+    mesh.Materials.swap(materials);
+    for( int i=0; i<tricount; ++i )
+        mesh.Tris[i].TextureNum = static_cast<U_BYTE>(remap[mesh.Tris[i].TextureNum]);
+
+    std::vector<int> order(tricount);
+    FTriOrder().Order(&mesh.Tris[0],tricount,mesh.VertsPerFrame,&order[0]);
+    std::vector<FJSMeshTri> tris(tricount);
+    for( int i=0; i<tricount; ++i )
+        tris[i] = mesh.Tris[order[i]];
+    mesh.Tris.swap(tris);
+}
+
+// Packs every frame the way the plugin did with the axis conversion as a
+// separate pass, then with the conversion folded into the packing kernel.
+// Points are taken as Max world space and turned Y up so both do the work.
+static void BenchPack( const FMesh& mesh, FAsset& asset )
+{
+    static const float yup[12] = { 1,0,0, 0,0,-1, 0,1,0, 0,0,0 };
+    int verts = mesh.VertsPerFrame;
+    int count = verts*mesh.FrameCount;
+
+    float mn[3] = { mesh.Points[0], mesh.Points[1], mesh.Points[2] };
+    float mx[3] = { mesh.Points[0], mesh.Points[1], mesh.Points[2] };
+    U3DGrowBounds(&mesh.Points[0],count,mn,mx);
+    U3DTransformBounds(yup,mn,mx);
+
+    float offset[3], scale[3];
+    U3DGetOptimization(mn,mx,offset,scale);
+
+    std::vector<float> scratch(static_cast<size_t>(verts)*3);
+    std::vector<FMeshVert> twopass(count), fused(count);
+    asset.PackTwoPass = asset.PackFused = 1e30;
+    for( int run=0; run<3; ++run )
+    {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        for( int t=0; t<mesh.FrameCount; ++t )
+        {
+            U3DTransformPoints(&mesh.Points[static_cast<size_t>(t)*verts*3],verts,yup,&scratch[0]);
+            U3DQuantize(&scratch[0],verts,offset,scale,&twopass[static_cast<size_t>(t)*verts]);
+        }
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        for( int t=0; t<mesh.FrameCount; ++t )
+            U3DQuantizeAffine(&mesh.Points[static_cast<size_t>(t)*verts*3],verts,yup,offset,scale,&fused[static_cast<size_t>(t)*verts]);
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+        asset.PackTwoPass = std::min(asset.PackTwoPass,std::chrono::duration<double>(t1-t0).count());
+        asset.PackFused = std::min(asset.PackFused,std::chrono::duration<double>(t2-t1).count());
+    }
+
+    // Both must pack the same, swapping and flipping axes is exact
+    asset.PackDiffs = 0;
+    for( int i=0; i<count; ++i )
+        asset.PackDiffs += twopass[i].V != fused[i].V ? 1 : 0;
+}
+
+static bool Convert( FAsset& asset )
+{
+    FMesh mesh;
+    std::string& err = asset.Error;
+
+    bool ok = false;
+    if( asset.Kind == "obj" )           ok = LoadObj(asset,mesh,err);
+    else if( asset.Kind == "cache" )    ok = LoadCache(asset,mesh,err);
+    else if( asset.Kind == "pca" )      ok = LoadPca(asset,mesh,err);
+    else if( asset.Kind == "scene" )    ok = LoadScene(asset,mesh,err);
+    else                                err = "Unknown input kind " + asset.Kind;
+    if( !ok || IsCancelled(err) )
+        return false;
+
+    if( mesh.FrameCount <= 0 || mesh.VertsPerFrame <= 0 || mesh.Tris.empty() )
+    {
+        err = "Nothing to export";
+        return false;
+    }
+    for( size_t i=0; i<mesh.Tris.size(); ++i )
+    {
+        for( int k=0; k<3; ++k )
+        {
+            if( mesh.Tris[i].iVertex[k] >= mesh.VertsPerFrame )
+            {
+                err = "Triangle references a missing vertex";
+                return false;
+            }
+        }
+    }
+
+    // Bigger meshes would be written with truncated headers
+    if( !U3DFitsFormat(mesh.VertsPerFrame,static_cast<int>(mesh.Tris.size()),mesh.FrameCount) )
+    {
+        char buf[256];
+        snprintf(buf,sizeof(buf),"Too big for the .3d format: %d verts per frame (max %d), %d triangles (max %d), %d frames (max %d)"
+            , mesh.VertsPerFrame, U3D_MAX_VERTS, static_cast<int>(mesh.Tris.size()), U3D_MAX_TRIS, mesh.FrameCount, U3D_MAX_FRAMES);
+        err = buf;
+        return false;
+    }
+
+    asset.Frames = mesh.FrameCount;
+    asset.Verts = mesh.VertsPerFrame;
+    asset.Tris = static_cast<int>(mesh.Tris.size());
+    SortMaterials(mesh);
+
+    // Prepare
+    float offset[3] = { 0,0,0 };
+    float scale[3] = { 1,1,1 };
+    float rot[3] = { 0,0,0 };
+    int count = mesh.VertsPerFrame*mesh.FrameCount;
+
+    // Bounds a frame at a time so Ctrl+C is seen, position textures use them too
+    float mn[3] = { mesh.Points[0], mesh.Points[1], mesh.Points[2] };
+    float mx[3] = { mesh.Points[0], mesh.Points[1], mesh.Points[2] };
+    for( int t=0; t<mesh.FrameCount && (!bSinglePass || VatFormat != FVatWriter::Off); ++t )
+    {
+        if( IsCancelled(err) )
+            return false;
+        U3DGrowBounds(&mesh.Points[static_cast<size_t>(t)*mesh.VertsPerFrame*3],mesh.VertsPerFrame,mn,mx);
+    }
+    if( bMaxResolution && count > 1 && !bSinglePass )
+        U3DGetOptimization(mn,mx,offset,scale);
+
+    // Same kernel as the plugin, the points are already converted.
+    // A frame at a time so Ctrl+C is seen.
+    static const float identity[12] = { 1,0,0, 0,1,0, 0,0,1, 0,0,0 };
+    std::vector<FMeshVert> verts;
+    FPackedFrames packed;
+    const FMeshVert* frames = NULL;
+    asset.Probes = -1;
+    if( bSinglePass )
+    {
+        // Packed as they come like the plugin's SinglePass, bounds are
+        // predicted from probe frames and the ends of each sequence
+        if( !packed.Begin(mesh.VertsPerFrame,mesh.FrameCount,identity,bMaxResolution && count > 1) )
+        {
+            err = "Too many frames to pack";
+            return false;
+        }
+
+        std::vector<U_BYTE> probe(mesh.FrameCount,0);
+        int spread = std::min(mesh.FrameCount,U3D_PREDICT_PROBES);
+        for( int p=0; p<spread; ++p )
+            probe[spread > 1 ? p*(mesh.FrameCount-1)/(spread-1) : 0] = 1;
+        for( size_t s=0; s<asset.Seqs.size(); ++s )
+        {
+            int first = asset.Seqs[s].Start;
+            int last = first + asset.Seqs[s].NumFrames - 1;
+            if( first >= 0 && first < mesh.FrameCount )
+                probe[first] = 1;
+            if( last >= 0 && last < mesh.FrameCount )
+                probe[last] = 1;
+        }
+
+        asset.Probes = 0;
+        for( int t=0; t<mesh.FrameCount && bMaxResolution && count > 1; ++t )
+        {
+            if( probe[t] )
+            {
+                packed.AddProbe(&mesh.Points[static_cast<size_t>(t)*mesh.VertsPerFrame*3]);
+                ++asset.Probes;
+            }
+        }
+        for( int t=0; t<mesh.FrameCount; ++t )
+        {
+            if( IsCancelled(err) )
+                return false;
+            packed.AddFrame(&mesh.Points[static_cast<size_t>(t)*mesh.VertsPerFrame*3]);
+        }
+
+        memcpy(offset,packed.Offset,sizeof(offset));
+        memcpy(scale,packed.Scale,sizeof(scale));
+        asset.Regrows = packed.Regrows;
+        asset.Repacked = packed.RepackedFrames;
+        frames = packed.GetFrame(0);
+    }
+    else
+    {
+        verts.resize(count);
+        for( int t=0; t<mesh.FrameCount; ++t )
+        {
+            if( IsCancelled(err) )
+                return false;
+            size_t first = static_cast<size_t>(t)*mesh.VertsPerFrame;
+            U3DQuantizeAffine(&mesh.Points[first*3],mesh.VertsPerFrame,identity,offset,scale,&verts[first]);
+        }
+        frames = &verts[0];
+    }
+
+    // Culling volumes of each frame and sequence
+    FBoundsBuilder bounds;
+    if( bWriteBounds )
+    {
+        bounds.Begin(mesh.FrameCount);
+        for( int t=0; t<mesh.FrameCount; ++t )
+            bounds.AddFrame(&mesh.Points[static_cast<size_t>(t)*mesh.VertsPerFrame*3],mesh.VertsPerFrame,identity);
+        for( size_t s=0; s<asset.Seqs.size(); ++s )
+            bounds.AddSequence(asset.Seqs[s].Name.c_str(),asset.Seqs[s].Start,asset.Seqs[s].NumFrames);
+    }
+
+    asset.PackTwoPass = -1;
+    if( bBench )
+        BenchPack(mesh,asset);
+
+    std::string base = asset.OutDir + "/" + asset.Name;
+    const char* name = asset.Name.c_str();
+    if( !MakeDirs(asset.OutDir) )
+    {
+        err = "Could not create output directory " + asset.OutDir;
+        return false;
+    }
+
+    // Outputs are only replaced when their content changed, and only once
+    // every output of the asset is written
+    FOutManifest outputs;
+    outputs.Load((base + ".u3dhash").c_str());
+    FOutStage stage;
+    asset.Outputs = 0;
+    asset.Unchanged = 0;
+
+    // WriteScript
+    FOutFile f;
+    f.SetCancel(&Cancel);
+    std::string path = base + "_rc.uc";
+    if( !f.Open(path.c_str()) )
+    {
+        err = "Could not open for writing: " + path;
+        return false;
+    }
+    U3DWriteScriptHeader(f,name,offset,scale,rot,mesh.FrameCount);
+    for( size_t s=0; s<asset.Seqs.size(); ++s )
+    {
+        const FSequence& seq = asset.Seqs[s];
+        U3DWriteSequence(f,name,seq.Name.c_str(),seq.Start,seq.NumFrames,seq.Rate.c_str(),seq.Group.c_str());
+        for( size_t n=0; n<seq.Notifies.size(); ++n )
+            U3DWriteNotify(f,name,seq.Name.c_str(),seq.Notifies[n].second.c_str(),seq.Notifies[n].first.c_str());
+    }
+    for( size_t m=0; m<mesh.Materials.size(); ++m )
+        U3DWriteTexture(f,name,static_cast<int>(m),"DefaultTexture");
+    if( bWriteBounds )
+        bounds.WriteScript(f);
+    if( !f.Stage(stage) )
+    {
+        err = "Could not write " + path;
+        return false;
+    }
+
+    // WriteModel
+    FJSDataHeader hData;
+    hData.NumPolys = static_cast<U_WORD>(mesh.Tris.size());
+    hData.NumVertices = static_cast<U_WORD>(mesh.VertsPerFrame);
+
+    FJSAnivHeader hAnim;
+    hAnim.FrameSize = static_cast<U_WORD>(mesh.VertsPerFrame * sizeof(FMeshVert));
+    hAnim.NumFrames = static_cast<U_WORD>(mesh.FrameCount);
+
+    path = base + "_d.3d";
+    if( !f.Open(path.c_str()) || !U3DWriteData(f,hData,mesh.Tris.empty() ? NULL : &mesh.Tris[0]) || !f.Stage(stage) )
+    {
+        err = "Could not write " + path;
+        return false;
+    }
+
+    path = base + "_a.3d";
+    if( !f.Open(path.c_str()) || !U3DWriteAniv(f,hAnim,frames) || !f.Stage(stage) )
+    {
+        err = "Could not write " + path;
+        return false;
+    }
+
+    // Cost sidecar for budget checks
+    FCostAnalyzer cost;
+    for( size_t s=0; s<asset.Seqs.size(); ++s )
+        cost.AddSequence(asset.Seqs[s].Name.c_str(),asset.Seqs[s].Start,asset.Seqs[s].NumFrames);
+    cost.Begin(mesh.VertsPerFrame,asset.Tris,mesh.FrameCount,scale);
+    for( int t=0; t<mesh.FrameCount; ++t )
+        cost.AddFrame(&frames[static_cast<size_t>(t)*mesh.VertsPerFrame]);
+    cost.End();
+
+    path = base + "_cost.json";
+    if( !f.Open(path.c_str()) || !cost.WriteJson(f,name) || !f.Stage(stage) )
+    {
+        err = "Could not write " + path;
+        return false;
+    }
+
+    path = base + ".u3dbounds";
+    if( bWriteBounds && (!f.Open(path.c_str()) || !bounds.Write(f) || !f.Stage(stage)) )
+    {
+        err = "Could not write " + path;
+        return false;
+    }
+
+    // Position texture for GPU playback, streamed a frame at a time
+    size_t framefloats = static_cast<size_t>(mesh.VertsPerFrame);
+    FVatWriter vat;
+    if( VatFormat != FVatWriter::Off )
+    {
+        for( size_t s=0; s<asset.Seqs.size(); ++s )
+            vat.AddSequence(asset.Seqs[s].Name.c_str(),asset.Seqs[s].Start,asset.Seqs[s].NumFrames,asset.Seqs[s].Rate.c_str());
+        vat.Begin(VatFormat,mesh.VertsPerFrame,mesh.FrameCount,mn,mx);
+        if( !vat.IsInRange() )
+        {
+            err = "Too big for float16 positions, use -vat unorm";
+            return false;
+        }
+
+        for( int p=0; p<vat.Pages; ++p )
+        {
+            path = asset.OutDir + "/" + vat.GetPageName(name,p);
+            bool ok = f.Open(path.c_str()) && vat.WritePageHeader(f);
+            for( int t=0; t<vat.GetPageFrames(p) && ok; ++t )
+                ok = vat.WriteFrame(f,&mesh.Points[framefloats*3*(p*vat.FramesPerPage+t)]);
+            if( !ok || !vat.EndPage(f,p) || !f.Stage(stage) )
+            {
+                err = "Could not write " + path;
+                return false;
+            }
+        }
+
+        vat.BuildMesh(&mesh.Points[0],mesh.Tris.empty() ? NULL : &mesh.Tris[0],asset.Tris);
+        path = base + "_vat.bin";
+        if( !f.Open(path.c_str()) || !vat.WriteMeshBin(f) || !f.Stage(stage) )
+        {
+            err = "Could not write " + path;
+            return false;
+        }
+        path = base + "_vat.gltf";
+        if( !f.Open(path.c_str()) || !vat.WriteMeshGltf(f,name,(asset.Name + "_vat.bin").c_str()) || !f.Stage(stage) )
+        {
+            err = "Could not write " + path;
+            return false;
+        }
+        path = base + "_vat.json";
+        if( !f.Open(path.c_str()) || !vat.WriteJson(f,name) || !f.Stage(stage) )
+        {
+            err = "Could not write " + path;
+            return false;
+        }
+    }
+
+    bool committed = stage.Commit(outputs);
+    asset.Outputs = stage.Written + stage.Unchanged;
+    asset.Unchanged = stage.Unchanged;
+    if( !committed )
+    {
+        err = "Could not replace " + std::string(stage.FailedPath.c_str());
+        outputs.Save();
+        return false;
+    }
+    if( !outputs.Save() )
+    {
+        err = "Could not write " + base + ".u3dhash";
+        return false;
+    }
+
+    // Play the written files back like the engine and compare
+    asset.MaxError = -1;
+    asset.VatError = -1;
+    if( IsCancelled(err) )
+        return false;
+    if( bVerify )
+    {
+        FMeshPlayer player;
+        if( !player.Load((base + "_d.3d").c_str(),(base + "_a.3d").c_str(),(base + "_rc.uc").c_str())
+         || player.NumFrames != mesh.FrameCount || player.NumVerts != mesh.VertsPerFrame )
+        {
+            err = "Could not play back " + base;
+            return false;
+        }
+
+        std::vector<float> soa(framefloats*3*mesh.FrameCount);
+        std::vector<FMeshPlayer::FInstance> batch(mesh.FrameCount);
+        for( int t=0; t<mesh.FrameCount; ++t )
+        {
+            FMeshPlayer::FInstance& inst = batch[t];
+            inst.Seq = -1;
+            inst.Time = static_cast<float>(t);
+            inst.bLoop = false;
+            inst.X = &soa[framefloats*(t*3+0)];
+            inst.Y = &soa[framefloats*(t*3+1)];
+            inst.Z = &soa[framefloats*(t*3+2)];
+        }
+        // Batches of frames so Ctrl+C is seen
+        for( int t=0; t<mesh.FrameCount; t+=64 )
+        {
+            if( IsCancelled(err) )
+                return false;
+            player.Evaluate(&batch[t],std::min(64,mesh.FrameCount-t));
+        }
+
+        asset.MaxError = 0;
+        for( int t=0; t<mesh.FrameCount; ++t )
+        {
+            if( IsCancelled(err) )
+                return false;
+            const float* p = &mesh.Points[framefloats*3*t];
+            for( int i=0; i<mesh.VertsPerFrame; ++i )
+            {
+                float d[3] = { batch[t].X[i]-p[i*3+0], batch[t].Y[i]-p[i*3+1], batch[t].Z[i]-p[i*3+2] };
+                for( int a=0; a<3; ++a )
+                    asset.MaxError = fabsf(d[a]) > asset.MaxError ? fabsf(d[a]) : asset.MaxError;
+            }
+        }
+    }
+
+    // Decode the written texture pages like the vertex shader would
+    if( bVerify && VatFormat != FVatWriter::Off )
+    {
+        asset.VatError = 0;
+        for( int p=0; p<vat.Pages; ++p )
+        {
+            if( IsCancelled(err) )
+                return false;
+            path = asset.OutDir + "/" + vat.GetPageName(name,p);
+            std::vector<U_BYTE> data(FileSize(path) > 0 ? static_cast<size_t>(FileSize(path)) : 0);
+            FILE* in = fopen(path.c_str(),"rb");
+            bool ok = in != NULL && !data.empty() && fread(&data[0],data.size(),1,in) == 1;
+            if( in )
+                fclose(in);
+
+            FVatReader page;
+            if( !ok || !page.Open(&data[0],data.size()) || page.Width != vat.Width || page.Height != vat.PageHeight )
+            {
+                err = "Could not read back " + path;
+                return false;
+            }
+
+            for( int t=p*vat.FramesPerPage; t<p*vat.FramesPerPage+vat.GetPageFrames(p); ++t )
+            {
+                if( IsCancelled(err) )
+                    return false;
+                const float* pts = &mesh.Points[framefloats*3*t];
+                for( int i=0; i<mesh.VertsPerFrame; ++i )
+                {
+                    int pg, x, y;
+                    float d[3];
+                    vat.GetTexel(t,i,pg,x,y);
+                    vat.Decode(page.GetTexel(x,y),d);
+                    for( int a=0; a<3; ++a )
+                        asset.VatError = fabsf(d[a]-pts[i*3+a]) > asset.VatError ? fabsf(d[a]-pts[i*3+a]) : asset.VatError;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+//--- Manifest -------------------------------------------------------------
+
+// name outdir kind inputs... [seq=Name:Start:End[:Rate[:Group]]] [notify=Function:Time]
+static bool ReadManifest( const char* path, std::vector<FAsset>& assets )
+{
+    FILE* f = fopen(path,"rb");
+    if( !f )
+    {
+        fprintf(stderr,"Could not open manifest %s\n",path);
+        return false;
+    }
+
+    std::string line;
+    int lineno = 0;
+    while( ReadLine(f,line) )
+    {
+        ++lineno;
+        std::vector<std::string> t = Tokenize(line," \t");
+        if( t.empty() || t[0][0] == '#' )
+            continue;
+
+        if( t.size() < 4 )
+        {
+            fprintf(stderr,"%s(%d): expected name, outdir, kind and inputs\n",path,lineno);
+            fclose(f);
+            return false;
+        }
+
+        FAsset asset;
+        asset.Name = t[0];
+        asset.OutDir = t[1];
+        asset.Kind = t[2];
+        asset.Cost = 0;
+        asset.Frames = asset.Verts = asset.Tris = 0;
+        asset.Seconds = 0;
+
+        for( size_t i=3; i<t.size(); ++i )
+        {
+            if( t[i].compare(0,4,"seq=") == 0 )
+            {
+                std::vector<std::string> a = Tokenize(t[i].substr(4),":");
+                if( a.size() < 3 || atoi(a[2].c_str()) <= atoi(a[1].c_str()) )
+                {
+                    fprintf(stderr,"%s(%d): invalid %s\n",path,lineno,t[i].c_str());
+                    fclose(f);
+                    return false;
+                }
+                FSequence seq;
+                seq.Name = a[0];
+                seq.Start = atoi(a[1].c_str());
+                seq.NumFrames = atoi(a[2].c_str()) - seq.Start;
+                if( a.size() > 3 ) seq.Rate = a[3];
+                if( a.size() > 4 ) seq.Group = a[4];
+                asset.Seqs.push_back(seq);
+            }
+            else if( t[i].compare(0,7,"notify=") == 0 )
+            {
+                std::vector<std::string> a = Tokenize(t[i].substr(7),":");
+                if( a.size() != 2 || asset.Seqs.empty() )
+                {
+                    fprintf(stderr,"%s(%d): invalid %s\n",path,lineno,t[i].c_str());
+                    fclose(f);
+                    return false;
+                }
+                asset.Seqs.back().Notifies.push_back(std::make_pair(a[0],a[1]));
+            }
+            else
+            {
+                asset.Inputs.push_back(t[i]);
+                asset.Cost += FileSize(t[i]);
+            }
+        }
+        assets.push_back(asset);
+    }
+    fclose(f);
+    return true;
+}
+
+
+//--- Work stealing pool ---------------------------------------------------
+
+// Every worker owns a queue and takes from its front, idle workers steal
+// from the back of the others. Items are dealt out biggest first.
+class FWorkPool
+{
+    struct FQueue
+    {
+        std::mutex      Lock;
+        std::deque<int> Items;
+    };
+
+    std::vector<FQueue*> Queues;
+
+public:
+    FWorkPool( int workers )
+    {
+        for( int i=0; i<workers; ++i )
+            Queues.push_back(new FQueue);
+    }
+
+    ~FWorkPool()
+    {
+        for( size_t i=0; i<Queues.size(); ++i )
+            delete Queues[i];
+    }
+
+    void Run( const std::vector<int>& items, const std::function<void(int)>& fn )
+    {
+        int workers = static_cast<int>(Queues.size());
+        for( size_t i=0; i<items.size(); ++i )
+            Queues[i%workers]->Items.push_back(items[i]);
+
+        std::vector<std::thread> threads;
+        for( int w=0; w<workers; ++w )
+            threads.push_back(std::thread(&FWorkPool::Worker,this,w,std::cref(fn)));
+        for( size_t i=0; i<threads.size(); ++i )
+            threads[i].join();
+    }
+
+protected:
+    bool Take( int w, int& item )
+    {
+        FQueue* own = Queues[w];
+        {
+            std::lock_guard<std::mutex> lock(own->Lock);
+            if( !own->Items.empty() )
+            {
+                item = own->Items.front();
+                own->Items.pop_front();
+                return true;
+            }
+        }
+
+        for( size_t i=1; i<Queues.size(); ++i )
+        {
+            FQueue* victim = Queues[(w+i)%Queues.size()];
+            std::lock_guard<std::mutex> lock(victim->Lock);
+            if( !victim->Items.empty() )
+            {
+                item = victim->Items.back();
+                victim->Items.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Worker( int w, const std::function<void(int)>& fn )
+    {
+        int item;
+        while( Take(w,item) )
+            fn(item);
+    }
+};
+
+
+//--- Main -----------------------------------------------------------------
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: u3dexport [-j threads] [-noopt] [-verify] [-bench] [-bounds] [-singlepass] [-vat half|unorm] manifest...\n"
+        "\n"
+        "Manifest lines, '#' starts a comment:\n"
+        "  name outdir obj   frame_%%04d.obj first last   [options]\n"
+        "  name outdir obj   frame0.obj frame1.obj ...   [options]\n"
+        "  name outdir cache points.u3dc tris.txt        [options]\n"
+        "  name outdir pca   archive.u3dpca              [options]\n"
+        "  name outdir scene recording.u3dscene          [options]\n"
+        "Options:\n"
+        "  seq=Name:Start:End[:Rate[:Group]]  animation sequence\n"
+        "  notify=Function:Time               notify for the last seq\n");
+}
+
+int main( int argc, char** argv )
+{
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<FAsset> assets;
+
+    for( int i=1; i<argc; ++i )
+    {
+        std::string arg = argv[i];
+        if( arg == "-j" && i+1 < argc )
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if( arg == "-noopt" )
+        {
+            bMaxResolution = false;
+        }
+        else if( arg == "-verify" )
+        {
+            bVerify = true;
+        }
+        else if( arg == "-bench" )
+        {
+            bBench = true;
+        }
+        else if( arg == "-bounds" )
+        {
+            bWriteBounds = true;
+        }
+        else if( arg == "-singlepass" )
+        {
+            bSinglePass = true;
+        }
+        else if( arg == "-vat" && i+1 < argc )
+        {
+            std::string format = argv[++i];
+            VatFormat = format == "half" ? FVatWriter::Half : format == "unorm" ? FVatWriter::Unorm16 : -1;
+            if( VatFormat < 0 )
+            {
+                Usage();
+                return 2;
+            }
+        }
+        else if( arg[0] == '-' )
+        {
+            Usage();
+            return 2;
+        }
+        else if( !ReadManifest(argv[i],assets) )
+        {
+            return 2;
+        }
+    }
+
+    if( assets.empty() )
+    {
+        Usage();
+        return 2;
+    }
+    if( threads < 1 )
+        threads = 1;
+    if( threads > static_cast<int>(assets.size()) )
+        threads = static_cast<int>(assets.size());
+
+    // Biggest inputs first so the long ones do not end up last
+    std::vector<int> order;
+    for( size_t i=0; i<assets.size(); ++i )
+        order.push_back(static_cast<int>(i));
+    for( size_t i=1; i<order.size(); ++i )
+        for( size_t j=i; j>0 && assets[order[j]].Cost > assets[order[j-1]].Cost; --j )
+            std::swap(order[j],order[j-1]);
+
+    std::mutex printlock;
+    std::atomic<int> failed(0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Ctrl+C stops the workers, unfinished outputs are dropped
+    signal(SIGINT,OnInterrupt);
+
+    FWorkPool pool(threads);
+    pool.Run(order,[&]( int i )
+    {
+        FAsset& asset = assets[i];
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        bool ok = Convert(asset);
+        if( !ok && Cancel.IsCancelled() )
+            asset.Error = "Cancelled";
+        asset.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+
+        std::lock_guard<std::mutex> lock(printlock);
+        if( ok )
+        {
+            printf("%s: %d frames, %d triangles, %d verts per frame, %d of %d files unchanged (%.2fs)\n"
+                , asset.Name.c_str(), asset.Frames, asset.Tris, asset.Verts, asset.Unchanged, asset.Outputs, asset.Seconds);
+            if( asset.MaxError >= 0 )
+                printf("%s: played back within %f units\n", asset.Name.c_str(), asset.MaxError);
+            if( asset.VatError >= 0 )
+                printf("%s: VAT decoded within %f units\n", asset.Name.c_str(), asset.VatError);
+            if( asset.Probes >= 0 )
+            {
+                printf("%s: single pass from %d probe frames, bounds grown %d times, %d frames packed again\n"
+                    , asset.Name.c_str(), asset.Probes, asset.Regrows, asset.Repacked);
+            }
+            if( asset.PackTwoPass >= 0 )
+            {
+                double mverts = asset.Frames * static_cast<double>(asset.Verts) / 1e6;
+                printf("%s: packing %.1f Mverts/s transform then quantize, %.1f Mverts/s fused (%.2fx), %d verts differ\n"
+                    , asset.Name.c_str(), mverts/asset.PackTwoPass, mverts/asset.PackFused, asset.PackTwoPass/asset.PackFused, asset.PackDiffs);
+            }
+        }
+        else
+        {
+            fprintf(stderr,"%s: %s\n",asset.Name.c_str(),asset.Error.c_str());
+            ++failed;
+        }
+    });
+
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    printf("%d assets, %d failed, %d threads, %.2fs%s\n", static_cast<int>(assets.size()), failed.load(), threads, total
+        , Cancel.IsCancelled() ? ", cancelled" : "");
+    return Cancel.IsCancelled() ? 130 : failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/**********************************************************************
+ *<
+    FILE: u3dpack.cpp
+
+    DESCRIPTION:    Lossless archiver for _a.3d files, see U3DPack.h
+
+    CREATED BY:     Roman Switch` Dzieciol
+
+    HISTORY:
+
+ *> Copyright (c) 2007, All Rights Reserved.
+ **********************************************************************/
+
+#include "U3DHeadless.h"
+#include "U3DFormat.h"
+#include "U3DCancel.h"
+#include "U3DOutput.h"
+#include "U3DCore.h"
+#include "U3DPack.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+static int Threads = 1;
+static int BlockFrames = U3D_PACK_BLOCK;
+
+static bool ReadFile( const std::string& path, std::vector<U_BYTE>& data )
+{
+    FILE* f = fopen(path.c_str(),"rb");
+    if( !f )
+        return false;
+
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size >= 0 && (data.empty() || fread(&data[0],data.size(),1,f) == 1);
+    fclose(f);
+    return ok;
+}
+
+static bool WriteFile( const std::string& path, const void* data, size_t size )
+{
+    FOutManifest manifest;
+    FOutFile f;
+    return f.Open(path.c_str())
+        && f.Write(data,size)
+        && f.Commit(manifest) != FOutFile::Failed;
+}
+
+// Indices are handed out one at a time, each must write its own output
+static void ParallelFor( int count, int threads, const std::function<void(int)>& fn )
+{
+    std::atomic<int> next(0);
+    std::function<void()> worker = [&]()
+    {
+        for( int i=next++; i<count; i=next++ )
+            fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    for( int t=1; t<threads && t<count; ++t )
+        pool.push_back(std::thread(worker));
+    worker();
+    for( size_t t=0; t<pool.size(); ++t )
+        pool[t].join();
+}
+
+static void Encode( const FAnivPacker& packer, std::vector< std::vector<U_BYTE> >& blocks, int threads )
+{
+    blocks.resize(packer.GetBlockCount());
+    ParallelFor(packer.GetBlockCount(),threads,[&]( int b )
+    {
+        packer.EncodeBlock(b,blocks[b]);
+    });
+}
+
+static bool Decode( const FAnivUnpacker& unpacker, std::vector<FMeshVert>& frames, int threads )
+{
+    frames.resize(static_cast<size_t>(unpacker.Header.NumFrames)*unpacker.GetVertCount()+1);
+    std::atomic<int> failed(0);
+    ParallelFor(unpacker.GetBlockCount(),threads,[&]( int b )
+    {
+        if( !unpacker.DecodeBlock(b,&frames[0]) )
+            ++failed;
+    });
+    return failed == 0;
+}
+
+
+//--- Commands -------------------------------------------------------------
+
+static int Pack( const std::string& archive, const std::string& anivpath, const std::string& datapath )
+{
+    std::vector<U_BYTE> aniv, data;
+    if( !ReadFile(anivpath,aniv) )
+    {
+        fprintf(stderr,"Could not read %s\n",anivpath.c_str());
+        return 1;
+    }
+    if( !datapath.empty() && !ReadFile(datapath,data) )
+    {
+        fprintf(stderr,"Could not read %s\n",datapath.c_str());
+        return 1;
+    }
+
+    FAnivPacker packer;
+    packer.Init(aniv.empty() ? NULL : &aniv[0],aniv.size(),data.empty() ? NULL : &data[0],data.size(),BlockFrames);
+    std::vector< std::vector<U_BYTE> > blocks;
+    Encode(packer,blocks,Threads);
+
+    FOutManifest manifest;
+    FOutFile f;
+    if( !f.Open(archive.c_str()) || !packer.Write(f,blocks) || f.Commit(manifest) == FOutFile::Failed )
+    {
+        fprintf(stderr,"Could not write %s\n",archive.c_str());
+        return 1;
+    }
+
+    long long packed = 0;
+    for( size_t b=0; b<blocks.size(); ++b )
+        packed += blocks[b].size();
+    printf("%s: %d frames, %d verts, %u bytes packed to %lld (%.2fx)\n"
+        , anivpath.c_str(), packer.Header.NumFrames, packer.Header.FrameSize/4
+        , static_cast<unsigned>(aniv.size()), packed + packer.Header.RawSize
+        , packed + packer.Header.RawSize > 0 ? static_cast<double>(aniv.size())/(packed + packer.Header.RawSize) : 0.0);
+    return 0;
+}
+
+static int Unpack( const std::string& archive, const std::string& anivpath, const std::string& datapath )
+{
+    std::vector<U_BYTE> file;
+    FAnivUnpacker unpacker;
+    if( !ReadFile(archive,file) || file.empty() || !unpacker.Open(&file[0],file.size()) )
+    {
+        fprintf(stderr,"%s is not a u3dpack archive\n",archive.c_str());
+        return 1;
+    }
+
+    std::vector<FMeshVert> frames;
+    std::vector<U_BYTE> aniv;
+    if( !Decode(unpacker,frames,Threads) || !unpacker.Restore(&frames[0],aniv) )
+    {
+        fprintf(stderr,"%s: frames are damaged\n",archive.c_str());
+        return 1;
+    }
+    if( !WriteFile(anivpath,aniv.empty() ? NULL : &aniv[0],aniv.size()) )
+    {
+        fprintf(stderr,"Could not write %s\n",anivpath.c_str());
+        return 1;
+    }
+
+    if( !datapath.empty() )
+    {
+        if( unpacker.Header.DataSize == 0 )
+        {
+            fprintf(stderr,"%s holds no data file\n",archive.c_str());
+            return 1;
+        }
+        if( !unpacker.CheckData() )
+        {
+            fprintf(stderr,"%s: data file is damaged\n",archive.c_str());
+            return 1;
+        }
+        if( !WriteFile(datapath,unpacker.GetData(),unpacker.Header.DataSize) )
+        {
+            fprintf(stderr,"Could not write %s\n",datapath.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs fn until at least half a second passed, returns seconds per run
+static double Time( const std::function<void()>& fn )
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int runs = 0;
+    double elapsed = 0;
+    do
+    {
+        fn();
+        ++runs;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    }
+    while( elapsed < 0.5 );
+    return elapsed / runs;
+}
+
+static int Bench( const std::string& anivpath )
+{
+    std::vector<U_BYTE> aniv;
+    if( !ReadFile(anivpath,aniv) || aniv.empty() )
+    {
+        fprintf(stderr,"Could not read %s\n",anivpath.c_str());
+        return 1;
+    }
+
+    FAnivPacker packer;
+    packer.Init(&aniv[0],aniv.size(),NULL,0,BlockFrames);
+    std::vector< std::vector<U_BYTE> > blocks;
+
+    double mb = aniv.size() / (1024.0*1024.0);
+    double enc1 = Time([&]() { Encode(packer,blocks,1); });
+    double encn = Time([&]() { Encode(packer,blocks,Threads); });
+
+    FOutManifest manifest;
+    FOutFile f;
+    std::string tmp = anivpath + ".bench.u3dz";
+    if( !f.Open(tmp.c_str()) || !packer.Write(f,blocks) || f.Commit(manifest) == FOutFile::Failed )
+    {
+        fprintf(stderr,"Could not write %s\n",tmp.c_str());
+        return 1;
+    }
+    std::vector<U_BYTE> file;
+    bool ok = ReadFile(tmp,file);
+    remove(tmp.c_str());
+
+    FAnivUnpacker unpacker;
+    std::vector<FMeshVert> frames;
+    std::vector<U_BYTE> restored;
+    if( !ok || file.empty() || !unpacker.Open(&file[0],file.size())
+    ||  !Decode(unpacker,frames,1) || !unpacker.Restore(&frames[0],restored) || restored != aniv )
+    {
+        fprintf(stderr,"%s: round trip failed\n",anivpath.c_str());
+        return 1;
+    }
+
+    double dec1 = Time([&]() { Decode(unpacker,frames,1); });
+    double decn = Time([&]() { Decode(unpacker,frames,Threads); });
+
+    // Single frames from all over the clip, like scrubbing
+    int count = unpacker.Header.NumFrames;
+    std::vector<FMeshVert> one(unpacker.GetVertCount()+1);
+    unsigned seed = 12345;
+    double seek = count > 0 ? Time([&]()
+    {
+        for( int i=0; i<64; ++i )
+        {
+            seed = seed*1103515245 + 12345;
+            unpacker.ReadFrames((seed >> 8) % count,1,&one[0]);
+        }
+    }) / 64 : 0;
+
+    printf("%s: %.2f MB to %.2f MB (%.2fx), %d frames in %d blocks\n"
+        , anivpath.c_str(), mb, file.size()/(1024.0*1024.0), static_cast<double>(aniv.size())/file.size()
+        , count, unpacker.GetBlockCount());
+    printf("  pack    %8.1f MB/s 1 thread, %8.1f MB/s %d threads\n", mb/enc1, mb/encn, Threads);
+    printf("  unpack  %8.1f MB/s 1 thread, %8.1f MB/s %d threads\n", mb/dec1, mb/decn, Threads);
+    printf("  seek    %8.1f us per random frame\n", seek*1e6);
+    return 0;
+}
+
+
+//--- Main -----------------------------------------------------------------
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: u3dpack [-j threads] [-block frames] pack   archive.u3dz name_a.3d [name_d.3d]\n"
+        "       u3dpack [-j threads] unpack archive.u3dz name_a.3d [name_d.3d]\n"
+        "       u3dpack [-j threads] [-block frames] bench name_a.3d...\n");
+}
+
+int main( int argc, char** argv )
+{
+    Threads = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<std::string> args;
+    for( int i=1; i<argc; ++i )
+    {
+        std::string arg = argv[i];
+        if( arg == "-j" && i+1 < argc )
+        {
+            Threads = atoi(argv[++i]);
+        }
+        else if( arg == "-block" && i+1 < argc )
+        {
+            BlockFrames = atoi(argv[++i]);
+        }
+        else if( arg[0] == '-' )
+        {
+            Usage();
+            return 2;
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+    if( Threads < 1 )
+        Threads = 1;
+    if( BlockFrames < 1 )
+        BlockFrames = U3D_PACK_BLOCK;
+
+    if( args.size() >= 3 && args.size() <= 4 && (args[0] == "pack" || args[0] == "unpack") )
+    {
+        std::string data = args.size() == 4 ? args[3] : std::string();
+        return args[0] == "pack" ? Pack(args[1],args[2],data) : Unpack(args[1],args[2],data);
+    }
+    if( args.size() >= 2 && args[0] == "bench" )
+    {
+        int failed = 0;
+        for( size_t i=1; i<args.size(); ++i )
+            failed += Bench(args[i]);
+        return failed > 0 ? 1 : 0;
+    }
+
+    Usage();
+    return 2;
+}